@@ -1,3 +1,4 @@
+import copy
 import hashlib
 import os
 from collections import defaultdict
@@ -12,6 +13,8 @@ from astropy.coordinates import SkyCoord
 import mkidcore.config
 import mkidcore.utils
 import mkidpipeline.config as mkpc
+import mkidpipeline.utils.indexing as indexing
+from mkidpipeline.utils.indexing import MetadataIndex
 from mkidcore.corelog import getLogger
 from mkidcore.legacy import parse_dither as parse_legacy_dither
 from mkidcore.utils import derangify
@@ -307,8 +310,19 @@ class MKIDTimerange(_Base):
         Returns a dict of KEY:mkidcore.metadata.MetadataSeries|value pairs, likely a subset of all keys
 
         Does not return default key values, that would be the responsibility of e.g. get_metadata for a photontable
+
+        The parsed metadata is cached for the process until one of the obslogs changes, each call returns a copy of it
+        that the caller is free to modify
         """
         obslog_files = mkidcore.utils.get_obslogs(mkpc.config.paths.data, start=self.start)
+        return copy.deepcopy(indexing.cached(self._metadata_cache_key(obslog_files),
+                                             lambda: self._load_metadata(obslog_files)))
+
+    def _metadata_cache_key(self, obslog_files):
+        return ('timerange', tuple(indexing.file_key(f) for f in obslog_files), int(self.start),
+                np.round(self.duration), mkpc.config.instrument.name, repr(sorted(self._metadata.items())))
+
+    def _load_metadata(self, obslog_files):
         data = mkidcore.metadata.load_observing_metadata(files=obslog_files, use_cache=True,
                                                          instrument=mkpc.config.instrument.name)
 
@@ -330,18 +344,20 @@ class MKIDTimerange(_Base):
 
         return metadata
 
+    @property
+    def metadata_index(self):
+        """A MetadataIndex of metadata, cached along with it"""
+        obslog_files = mkidcore.utils.get_obslogs(mkpc.config.paths.data, start=self.start)
+        key = self._metadata_cache_key(obslog_files)
+        return indexing.cached(key + ('index',), lambda: MetadataIndex(
+            indexing.cached(key, lambda: self._load_metadata(obslog_files))))
+
     def metadata_at(self, time='start'):
         """Returns the metadata values at 'time'"""
         if time == 'start':
             time = self.start
-        md = self.metadata
-        ret = {}
-        for k, v in md.items():
-            try:
-                ret[k] = v.get(time) if isinstance(v, mkidcore.metadata.MetadataSeries) else v
-            except ValueError:
-                pass
-        return ret
+        index = self.metadata_index
+        return index.at_state(int(index.states(time)))
 
 
 class MKIDObservation(MKIDTimerange):
@@ -1,20 +1,28 @@
 import os
 import time
-import multiprocessing as mp
+import threading
 import functools
+import multiprocessing as mp
+from collections import OrderedDict
 import numpy as np
 from scipy.interpolate import InterpolatedUnivariateSpline
 from ruamel.yaml.comments import CommentedSeq
 
 import mkidcore.metadata
-from mkidcore.binfile.mkidbin import PhotonCType, PhotonNumpyType
+from mkidcore.binfile.mkidbin import PhotonNumpyType
 from mkidcore.corelog import getLogger
 from mkidcore.pixelflags import FlagSet
 import mkidcore.pixelflags as pixelflags
 from mkidcore.instruments import compute_wcs_ref_pixel
 import mkidpipeline.utils.memory as pipeline_ram
+import mkidpipeline.utils.chunkread as chunkread
+import mkidpipeline.utils.cores as cores
+import mkidpipeline.utils.indexing as indexing
+import mkidpipeline.utils.pooling as pooling
+import mkidpipeline.utils.tracing as tracing
+import mkidpipeline.utils.tuning as tuning
+from mkidpipeline.utils.indexing import MetadataIndex
 from mkidcore.metadata import INSTRUMENT_KEY_MAP
-import SharedArray
 
 import tables
 import tables.parameters
@@ -27,38 +35,12 @@ from astropy.io import fits
 import warnings
 
 
-# These are little better than blind guesses and don't seem to impact performaace, but still need benchmarking
-# tables.parameters.CHUNK_CACHE_SIZE = 2 * 1024 * 1024 * 1024
-# tables.parameters.TABLE_MAX_SIZE = 2 * 1024 * 1024 * 1024  # default 1MB
-# This governs the chunk cache that will store table data, if a row is
-# 20 bytes (as is our present state)
-# nslots = TABLE_MAX_SIZE / (chunksize * rowsize_bytes)
-# so number of rows in the cache is ~ TABLE_MAX_SIZE/rowsize_bytes
-# one 1s of 20k pix data @ 2500c/s is 0.95GB
-
-# These are all used by the c code backing pytables and it isn't clear their importance yet
-# tables.parameters.CHUNK_CACHE_NELMTS *= 10
-# tables.parameters.SORTEDLR_MAX_SIZE = 1 *1024*1024*1024 # default 8MB
-# tables.parameters.SORTED_MAX_SIZE = 1 *1024*1024*1024 # default 1MB
-# tables.parameters.LIMBOUNDS_MAX_SIZE = 1*1024*1024*1024
-# tables.parameters.SORTEDLR_MAX_SLOTS *= 10
-
-# tables.parameters.CHUNK_CACHE_SIZE *=10
-# tables.parameters.TABLE_MAX_SIZE *=10
-# tables.parameters.CHUNK_CACHE_NELMTS *= 10
-# tables.parameters.SORTEDLR_MAX_SIZE *=10
-# tables.parameters.SORTED_MAX_SIZE *=10
-# tables.parameters.LIMBOUNDS_MAX_SIZE *=10
-# tables.parameters.SORTEDLR_MAX_SLOTS *= 10
-
-# tables.parameters.CHUNK_CACHE_SIZE = 32*1024**2
-# tables.parameters.MAX_BLOSC_THREADS = 8
-# tables.parameters.MAX_NUMEXPR_THREADS = 8
-# tables.parameters.IO_BUFFER_SIZE = 32*1024**2   # Don't exceed L3 cache size (16MiB)
+# The HDF5 chunk cache used to read photontables is set per file from the pipeline config, see
+# mkidpipeline.utils.tuning (mkidpipe --autotune) for how it and the table layout are chosen.
 
 
 class ThreadsafeFileRegistry(tables.file._FileRegistry):
-    lock = mp.RLock()
+    lock = mp.RLock()  # Opens and closes are serialized across the forked pipeline processes too
 
     @property
     def handlers(self):
@@ -73,23 +55,23 @@ class ThreadsafeFileRegistry(tables.file._FileRegistry):
             return super().remove(handler)
 
     def close_all(self):
-        with self.lock:
+        with chunkread.HDF5_LOCK, self.lock:
             return super().close_all()
 
 
 class ThreadsafeFile(tables.file.File):
     def __init__(self, *args, **kargs):
-        with ThreadsafeFileRegistry.lock:
+        with chunkread.HDF5_LOCK, ThreadsafeFileRegistry.lock:
             super().__init__(*args, **kargs)
 
     def close(self):
-        with ThreadsafeFileRegistry.lock:
+        with chunkread.HDF5_LOCK, ThreadsafeFileRegistry.lock:
             super().close()
 
 
 @functools.wraps(tables.open_file)
 def synchronized_open_file(*args, **kwargs):
-    with ThreadsafeFileRegistry.lock:
+    with chunkread.HDF5_LOCK, ThreadsafeFileRegistry.lock:
         return tables.file._original_open_file(*args, **kwargs)
 
 
@@ -102,81 +84,57 @@ tables.file.File = ThreadsafeFile
 tables.File = ThreadsafeFile
 tables.file._open_files = ThreadsafeFileRegistry()
 
-
-class SharedTable(object):
-    """multiprocessingsafe shared photon table, readonly!!!!"""
-
-    def __init__(self, shape):
-        self._shape = shape
-        self._X = mp.RawArray(PhotonCType, int(np.prod(shape)))
-        self.data = np.frombuffer(self._X, dtype=PhotonNumpyType).reshape(self._shape)
-
-    def __getstate__(self):
-        d = dict(self.__dict__)
-        d.pop('data', None)
-        return d
-
-    def __setstate__(self, state):
-        self.__dict__ = state
-        self.data = np.frombuffer(self._X, dtype=PhotonNumpyType).reshape(self._shape)
-
-
-def load_shareable_photonlist(file, query=None):
-    tic = time.time()
-    f = Photontable(file)
-
-    if query is not None:
-        d = f.query(**query)
-        table = SharedTable(d.shape)
-        table.data = d
-    else:
-        table = SharedTable(f.photonTable.shape)
-        f.photonTable.read(out=table.data)
-    ram = table.data.size * table.data.itemsize / 1024 / 1024 / 1024.0
-    msg = 'Created a shared table with {size} rows from {file} in {time:.2f} s, using {ram:.2f} GB'
-    getLogger(__name__).info(msg.format(file=file, size=f.photonTable.shape[0], time=time.time() - tic, ram=ram))
-    return table
-
-
-class SharedPhotonList(object):
-    """multiprocessingsafe shared photon table, readonly!!!!"""
-
-    def __init__(self, file):
-
-        file = os.path.abspath(file)
-        self._primary = True
-        self._name = file.replace(os.path.sep, '_')
-        try:
-            SharedArray.delete("shm://{}".format(self._name))
-            getLogger(__name__).debug("Deleted existing shared memory store {}".format(self._name))
-        except FileNotFoundError:
-            pass
-        f = Photontable(file)
-        tic = time.time()
-        self.data = np.frombuffer(SharedArray.create("shm://{}".format(self._name), f.photonTable.shape,
-                                                     dtype=PhotonNumpyType), dtype=PhotonNumpyType)
-        f.photonTable.read(out=self.data)
-        toc = time.time()
-        ram = self.data.size * self.data.itemsize / 1024 / 1024 / 1024.0
-        msg = 'Created a shared table with {size} rows from {file} in {time:.2f} s, using {ram:.2f} GB'
-        getLogger(__name__).debug(msg.format(file=file, size=f.photonTable.shape[0], time=toc - tic, ram=ram))
-
-    def __getstate__(self):
-        d = dict(__dict__)
-        d.pop('data', None)
-        d.pop('raw')
-        return d
-
-    def __setstate__(self, state):
-        self.__dict__ = state
-        self._primary = False
-        getLogger(__name__).debug('Attaching to ' + self._name)
-        self.data = np.frombuffer(SharedArray.attach("shm://{}".format(self._name), dtype=PhotonNumpyType))
-
-    def __del__(self):
-        if self._primary:
-            getLogger(__name__).debug('Deleting ' + self._name)
-            SharedArray.delete("shm://{}".format(self._name))
+# Number of read-only tables kept open by open_photontable
+OPEN_TABLE_LIMIT = 16
+
+# Queries without a resID spanning at least this fraction of the file are answered by a threaded scan (see
+# mkidpipeline.utils.chunkread) rather than through the PyTables indices
+SCAN_FRACTION = .5
+
+_open_tables = OrderedDict()  # realpath: (indexing.file_key, Photontable)
+_open_tables_lock = threading.RLock()
+
+
+def open_photontable(file_name):
+    """
+    Return a read-only Photontable for file_name that is kept open for later calls in this process, sparing them the
+    reopen and the reload of the beammap and metadata. The table is shared: do not enablewrite or close it. It is
+    reopened if the file has been rewritten and is closed whenever a Photontable opens the file for writing.
+
+    The process running the shared pool (mkidpipeline.utils.pooling) gets a table of its own instead, closed once it is
+    no longer used. Its workers can't have it release a file they are about to write.
+    """
+    if pooling.running():
+        return Photontable(file_name)
+    key = indexing.file_key(file_name)
+    with _open_tables_lock:
+        entry = _open_tables.get(key[0])
+        if entry is not None and entry[0] == key:
+            _open_tables.move_to_end(key[0])
+            return entry[1]
+        close_photontables(key[0])
+        pt = Photontable(file_name)
+        _open_tables[key[0]] = key, pt
+        while len(_open_tables) > OPEN_TABLE_LIMIT:
+            close_photontables(next(iter(_open_tables)))
+        return pt
+
+
+def open_photontables():
+    """Return the paths of the tables held open by open_photontable"""
+    with _open_tables_lock:
+        return list(_open_tables)
+
+
+def close_photontables(file_name=None):
+    """Close the tables held open by open_photontable, only the one for file_name if given"""
+    with _open_tables_lock:
+        paths = list(_open_tables) if file_name is None else [os.path.realpath(file_name)]
+        for path in paths:
+            entry = _open_tables.pop(path, None)
+            if entry is not None and entry[1].file is not None:
+                entry[1].file.close()
+                entry[1].file = None
 
 
 _METADATA_BLOCK_BYTES = 4 * 1024 * 1024
@@ -184,6 +142,73 @@ _KEY_BYTES = 256
 _VALUE_BYTES = 8192
 
 
+def _merge_intervals(resid, start, stop):
+    """Merge overlapping or adjoining (resid, start, stop) intervals of each resonator, sorted by resID then start"""
+    order = np.lexsort((start, resid))
+    resid = np.asarray(resid, dtype=np.uint32)[order]
+    start = np.asarray(start, dtype=np.uint32)[order]
+    stop = np.asarray(stop, dtype=np.uint32)[order]
+    if not resid.size:
+        return resid, start, stop
+    # Keys order intervals by resonator then time, an interval starts a new run if it begins after every earlier stop
+    high = resid.astype(np.uint64) << np.uint64(32)
+    reach = np.maximum.accumulate(high | stop)
+    new = np.ones(resid.size, dtype=bool)
+    new[1:] = (high[1:] | start[1:]) > reach[:-1]
+    first = np.flatnonzero(new)
+    last = np.append(first[1:], resid.size) - 1
+    return resid[first], start[first], (reach[last] & np.uint64(0xFFFFFFFF)).astype(np.uint32)
+
+
+# Column of the /metadata table holding each kind of record value, those of kind OBJECT are pickled in /metadata/values
+_MD_FLOAT, _MD_INT, _MD_BOOL, _MD_STR, _MD_OBJECT = range(5)
+
+
+def _metadata_columns(values):
+    """Split metadata record values into (kind, float, int, str columns, other values to pickle)"""
+    kind = np.full(len(values), _MD_OBJECT, dtype=np.uint8)
+    number = np.zeros(len(values))
+    integer = np.zeros(len(values), dtype=np.int64)
+    text = [b''] * len(values)
+    objects = []
+    for i, v in enumerate(values):
+        if isinstance(v, (bool, np.bool_)):
+            kind[i], integer[i] = _MD_BOOL, v
+        elif isinstance(v, (int, np.integer)) and -2 ** 63 <= v < 2 ** 63:
+            kind[i], integer[i] = _MD_INT, v
+        elif isinstance(v, (float, np.floating)):
+            kind[i], number[i] = _MD_FLOAT, v
+        elif isinstance(v, str) and '\x00' not in v:  # HDF5 strings are NUL padded
+            kind[i], text[i] = _MD_STR, v.encode()
+        else:
+            objects.append(v)
+    return kind, number, integer, np.array(text, dtype=bytes), objects
+
+
+def _metadata_values(records, objects):
+    """Return the record values of /metadata table rows, the inverse of _metadata_columns"""
+    values = np.empty(records.size, dtype=object)
+    for kind, col, convert in ((_MD_FLOAT, 'number', None), (_MD_INT, 'integer', None), (_MD_BOOL, 'integer', bool),
+                               (_MD_STR, 'text', bytes.decode)):
+        rows = records['kind'] == kind
+        vals = records[col][rows].tolist()
+        values[rows] = vals if convert is None else [convert(v) for v in vals]
+    rows = np.flatnonzero(records['kind'] == _MD_OBJECT)
+    for i, v in zip(rows, objects):
+        values[i] = v
+    return values.tolist()
+
+
+def _cut(photons, start, stop, startw, stopw):
+    """Return the mask of the photons in the time and wavelength ranges of a query, None for no limit"""
+    keep = np.ones(photons.size, dtype=bool)
+    for col, limit, op in (('time', start, np.greater_equal), ('time', stop, np.less),
+                           ('wavelength', startw, np.greater_equal), ('wavelength', stopw, np.less)):
+        if limit is not None:
+            keep &= op(photons[col], limit)
+    return keep
+
+
 class Photontable:
     TICKS_PER_SEC = int(1.0 / 1e-6)  # each integer value is 1 microsecond
 
@@ -193,6 +218,20 @@ class Photontable:
         wavelength = tables.Float32Col(pos=2)
         weight = tables.Float32Col(pos=3)
 
+    class MetadataDescription(tables.IsDescription):
+        key = tables.UInt16Col(pos=0)  # index into the table's KEYS attribute
+        time = tables.Float64Col(pos=1)  # NaN for keys that are not a series
+        kind = tables.UInt8Col(pos=2)  # which column holds the value, see _metadata_columns
+        number = tables.Float64Col(pos=3)
+        integer = tables.Int64Col(pos=4)  # ints and bools
+        # text, a string column sized to the longest value, is added as the table is written
+
+    class TimeFlagDescription(tables.IsDescription):
+        resID = tables.UInt32Col(pos=0)
+        start = tables.UInt32Col(pos=1)  # first tick of the interval, in photon time ticks
+        stop = tables.UInt32Col(pos=2)  # end of the interval (exclusive)
+        flag = tables.Int64Col(pos=3)  # flag bitmask set during the interval
+
     def __init__(self, file_name, mode='read', verbose=False, in_memory=False):
         """
         Create Photontable object and load in specified HDF5 file.
@@ -219,9 +258,15 @@ class Photontable:
         self.nominal_wavelength_bins = None
         self.beamImage = None
         self._flagArray = None
+        self._timeflags = None
+        self._bmindex = None
+        self._flagset = None
         self.nXPix = None
         self.nYPix = None
         self._mdcache = None
+        self._metadata_dirty = False
+        self._reader = None
+        self._resid_rows = None
         self.in_memory = in_memory
         self.ram_manager = pipeline_ram.Manager(self.filename)
         self._load_file()
@@ -231,6 +276,10 @@ class Photontable:
         if self.file is None:
             return
         try:
+            if self._metadata_dirty:
+                self.write_metadata_table()
+            if self._reader is not None:
+                self._reader.close()
             self.file.close()
             del self.file
             self.file = None
@@ -268,22 +317,77 @@ class Photontable:
     def _load_file(self):
         """ Opens file and loads obs file attributes and beammap """
         getLogger(__name__).debug("Loading {} in {} mode.".format(self.filename, self.mode))
-        try:
-            kwargs = {'driver': 'H5FD_CORE'} if self.in_memory else {}
-            self.file = tables.open_file(self.filename, mode='a' if self.mode == 'write' else 'r', **kwargs)
-        except (IOError, OSError):
-            raise
+        if self.mode == 'write':  # HDF5 refuses to open a file for writing while we or a pool worker have it open
+            close_photontables(self.filename)
+            pooling.release(self.filename)
+        with chunkread.HDF5_LOCK:  # Tables are opened by the threads of e.g. drizzler.load_data at once
+            try:
+                kwargs = {'driver': 'H5FD_CORE'} if self.in_memory else {}
+                kwargs.update(tuning.open_kwargs())
+                self.file = tables.open_file(self.filename, mode='a' if self.mode == 'write' else 'r', **kwargs)
+            except (IOError, OSError):
+                raise
 
-        # get important cal params
-        self.nominal_wavelength_bins = self.nyquist_wavelengths()
+            # get important cal params
+            self.nominal_wavelength_bins = self.nyquist_wavelengths()
 
-        # get the beam image
-        self.beamImage = self.file.get_node('/beammap/map').read()
-        self._flagArray = self.file.get_node('/beammap/flag')  # The absence of .read() here is correct
-        self.nXPix, self.nYPix = self.beamImage.shape
+            # get the beam image
+            self.beamImage = self.file.get_node('/beammap/map').read()
+            self._flagArray = self.file.get_node('/beammap/flag')  # The absence of .read() here is correct
+            self.nXPix, self.nYPix = self.beamImage.shape
+
+            # get the photontable
+            self.photonTable = self.file.get_node('/photons/photontable')
+        self._mdcache = None
+        self._timeflags = None
+        self._bmindex = None
+        self._flagset = None
+        if self._reader is not None:
+            self._reader.close()
+        self._reader = None
+        self._resid_rows = None
+        if self.mode == 'read' and chunkread.supported(self.photonTable):
+            self._reader = chunkread.ChunkReader(self.photonTable)
 
-        # get the photontable
-        self.photonTable = self.file.get_node('/photons/photontable')
+    @property
+    def concurrent_reads(self):
+        """True if queries may be made from many threads at once without them taking turns"""
+        return self._reader is not None
+
+    def resid_rows(self, build=True):
+        """
+        Return (resIDs, starts, stops) where the photons of each resID are rows start to stop-1 of the table, or None if
+        the table isn't sorted by resID or isn't open for concurrent reads. The table is read to find them on the first
+        call in the process unless build is False. Once found they are used by query for photons by resID.
+        """
+        if self._resid_rows is not None or not build or self._reader is None:
+            return self._resid_rows or None
+
+        def scan():
+            def bounds(rows, first):
+                r = rows['resID']
+                change = np.flatnonzero(r[1:] != r[:-1]) + 1
+                return first, r[0], r[-1], bool((r[1:] >= r[:-1]).all()), r[change], change + first
+
+            blocks = self._reader.scan(bounds)
+            if not blocks:
+                return (np.array([], dtype=np.uint32),) + (np.array([], dtype=np.int64),) * 2
+            if not all(b[3] for b in blocks) or any(a[2] > b[1] for a, b in zip(blocks[:-1], blocks[1:])):
+                return False
+            resids, starts = [], []
+            for k, (row, first, _, _, r, change) in enumerate(blocks):
+                if not k or first != blocks[k - 1][2]:  # a resID starts with the block
+                    resids.append(np.array([first]))
+                    starts.append(np.array([row]))
+                resids.append(r)
+                starts.append(change)
+            resids, starts = np.concatenate(resids).astype(np.uint32), np.concatenate(starts).astype(np.int64)
+            return resids, starts, np.append(starts[1:], self.photonTable.nrows)
+
+        self._resid_rows = indexing.cached(('resid_rows',) + indexing.file_key(self.filename), scan)
+        if self._resid_rows is False:
+            getLogger(__name__).debug(f'{self.filename} is not sorted by resID')
+        return self._resid_rows or None
 
     def _parse_query_range_info(self, startw=None, stopw=None, start=None, stop=None, intt=None):
         """ return a dict with info about the data returned by query with a particular set of args
@@ -379,6 +483,8 @@ class Photontable:
 
         Changing this once it is initialized is at your own peril!
         """
+        if self._flagset is not None:
+            return self._flagset
         from mkidpipeline.pipeline import PIPELINE_FLAGS  # This must be here to prevent a circular import!
 
         names = self.query_header('flags')
@@ -391,9 +497,18 @@ class Photontable:
             self.update_header('flags', names)
             self.disablewrite()
 
-        f = FlagSet.define(*[(n, i, PIPELINE_FLAGS.flags[n].description if n in PIPELINE_FLAGS.flags else '')
-                             for i, n in enumerate(names)])
-        return f
+        self._flagset = FlagSet.define(*[(n, i, PIPELINE_FLAGS.flags[n].description if n in PIPELINE_FLAGS.flags
+                                          else '') for i, n in enumerate(names)])
+        return self._flagset
+
+    @property
+    def beammap_index(self):
+        """The BeammapIndex of the file's beammap and pixel flags"""
+        if self._bmindex is None:
+            with chunkread.HDF5_LOCK:
+                flags = self._flagArray.read()
+            self._bmindex = indexing.BeammapIndex(self.beamImage, flags)
+        return self._bmindex
 
     def multiply_column_weight(self, resid, weights, column, flush=True):
         """
@@ -439,6 +554,8 @@ class Photontable:
         """USE CARE IN A THREADED ENVIRONMENT"""
         if self.mode == 'read':
             return
+        if self._metadata_dirty:
+            self.write_metadata_table()
         self.photonTable.flush()
         self.file.close()
         self.mode = 'read'
@@ -494,11 +611,11 @@ class Photontable:
         return s
 
     def xy(self, photons):
-        """Return a tuple of two arrays corresponding to the x & y pixel positions of the given photons"""
-        flatbeam = self.beamImage.flatten()
-        beamsorted = np.argsort(flatbeam)
-        ind = np.searchsorted(flatbeam[beamsorted], photons["resID"])
-        return np.unravel_index(beamsorted[ind], self.beamImage.shape)
+        """
+        Return a tuple of two arrays corresponding to the x & y pixel positions of the given photons, raises
+        ValueError for photons of resIDs that are not in the beammap
+        """
+        return self.beammap_index.xy(photons['resID'])
 
     def flagged(self, flags, pixel=(slice(None), slice(None)), allow_unknown_flags=True, all_flags=False,
                 resid=None):
@@ -514,18 +631,19 @@ class Photontable:
         """
 
         if resid is not None:
-            pixel = tuple(map(tuple, np.argwhere(resid == self.beamImage)))
+            pixel = self.beammap_index.xy(np.atleast_1d(resid))
 
         x, y = zip(*pixel) if isinstance(pixel[0], tuple) else pixel
+        pixel_flags = self.beammap_index.flags.reshape(self.beamImage.shape)[x, y]
         if not flags:
-            return False if isinstance(x, int) else np.zeros_like(self._flagArray[x, y], dtype=bool)
+            return False if isinstance(x, int) else np.zeros_like(pixel_flags, dtype=bool)
 
         f = self.flags
         if len(set(f.names).difference(flags)) and not allow_unknown_flags:
-            return False if isinstance(x, int) else np.zeros_like(self._flagArray[x, y], dtype=bool)
+            return False if isinstance(x, int) else np.zeros_like(pixel_flags, dtype=bool)
 
         bitmask = f.bitmask(flags, unknown='ignore')
-        bits = self._flagArray[x, y] & bitmask
+        bits = pixel_flags & bitmask
         return bits == bitmask if all_flags else bits.astype(bool)
 
     def flag(self, flag: int, pixel=(slice(None), slice(None))):
@@ -549,6 +667,7 @@ class Photontable:
             raise ValueError('flag must be scalar or match the desired region selected by x & y coordinates')
         self._flagArray[pixel] |= flag
         self._flagArray.flush()
+        self._bmindex = None
 
     def unflag(self, flag, pixel=(slice(None), slice(None))):
         """
@@ -572,13 +691,140 @@ class Photontable:
             raise ValueError('flag must be scalar or match the desired region selected by x & y coordinates')
         self._flagArray[pixel] &= ~flag
         self._flagArray.flush()
+        self._bmindex = None
 
-    def query(self, startw=None, stopw=None, start=None, stopt=None, resid=None, intt=None, pixel=None, column=None):
+    @property
+    def time_flags(self):
+        """
+        The time-resolved flags of the file, a structured array of (resID, start, stop, flag) intervals during which
+        the flag bits apply to the resonator. Times are in photon time ticks and rows are sorted by resID then start.
+        Unlike the beammap flags these cover only part of the exposure.
+        """
+        if self._timeflags is None:
+            try:
+                with chunkread.HDF5_LOCK:
+                    self._timeflags = self.file.get_node('/beammap/timeflags').read()
+            except tables.NoSuchNodeError:
+                self._timeflags = np.zeros(0, dtype=tables.description.dtype_from_descr(self.TimeFlagDescription))
+        return self._timeflags
+
+    def _write_time_flags(self, rows):
+        try:
+            self.file.get_node('/beammap/timeflags')._f_remove()
+        except tables.NoSuchNodeError:
+            pass
+        self._timeflags = None
+        if not rows.size:
+            return
+        rows = rows[np.lexsort((rows['start'], rows['resID']))]
+        filt = tables.Filters(complevel=1, complib='blosc:lz4', shuffle=True, bitshuffle=False, fletcher32=False)
+        t = self.file.create_table('/beammap', 'timeflags', self.TimeFlagDescription, 'Time-resolved flags',
+                                   expectedrows=rows.size, filters=filt)
+        t.append(rows)
+        t.flush()
+
+    def flag_intervals(self, flag, resid, start, stop):
+        """
+        Applies flag to the resonators resid from start to stop (photon time ticks, stop exclusive) in the
+        time-resolved flags. Arguments may be scalars or equal length arrays.
+
+        Named flags must be converged to bitmask via self.flags.bitmask(flag names) first
+        """
+        if self.mode != 'write':
+            raise Exception("Must open file in write mode to do this!")
+        flag, resid, start, stop = np.broadcast_arrays(flag, resid, start, stop)
+        self.flags.valid(np.bitwise_or.reduce(flag.ravel(), initial=0), error=True)
+        rows = np.zeros(flag.size, dtype=self.time_flags.dtype)
+        for col, v in zip(('resID', 'start', 'stop', 'flag'), (resid, start, stop, flag)):
+            rows[col] = v.ravel()
+        self._write_time_flags(np.concatenate((self.time_flags, rows[rows['stop'] > rows['start']])))
+
+    def unflag_intervals(self, flag):
+        """
+        Resets the bit(s) of flag in all the time-resolved flags, dropping intervals left with no flags.
+
+        Named flags must be converged to bitmask via self.flags.bitmask(flag names) first
+        """
+        if self.mode != 'write':
+            raise Exception("Must open file in write mode to do this!")
+        self.flags.valid(flag, error=True)
+        rows = self.time_flags.copy()
+        rows['flag'] &= ~flag
+        self._write_time_flags(rows[rows['flag'] != 0])
+
+    def flagged_intervals(self, flags):
+        """
+        Return (resid, start, stop) arrays of the time intervals during which any of flags is set on a resonator.
+        Overlapping and adjoining intervals are merged; the result is sorted by resID then start.
+        """
+        rows = self.time_flags
+        if flags and rows.size:
+            rows = rows[(rows['flag'] & self.flags.bitmask(flags, unknown='ignore')) != 0]
+        else:
+            rows = rows[:0]
+        return _merge_intervals(rows['resID'], rows['start'], rows['stop'])
+
+    def interval_mask(self, photons, flags):
+        """Return a boolean array that is True for photons that arrived while any of flags was set on their resonator"""
+        resid, start, stop = self.flagged_intervals(flags)
+        if not resid.size:
+            return np.zeros(len(photons), dtype=bool)
+        # Intervals don't overlap, so the last interval starting at or before (resID, time) is the only candidate
+        key = resid.astype(np.uint64) << np.uint64(32) | start
+        ndx = np.searchsorted(key, photons['resID'].astype(np.uint64) << np.uint64(32) | photons['time'],
+                              side='right') - 1
+        found = np.maximum(ndx, 0)
+        return (ndx >= 0) & (resid[found] == photons['resID']) & (photons['time'] < stop[found])
+
+    def flagged_time(self, flags, edges):
+        """
+        Return an (x, y, bin) array of the time in seconds each pixel spent with any of flags set in the
+        time-resolved flags within each bin, or None if no such intervals exist.
+
+        :param edges: bin edges in photon time ticks
+        """
+        resid, start, stop = self.flagged_intervals(flags)
+        if not resid.size:
+            return None
+        edges = np.asarray(edges, dtype=float)
+        pix = self.beammap_index.pixel(resid)
+        flagged = np.zeros((self.beamImage.size, edges.size - 1))
+        block = max(2 ** 22 // edges.size, 1)
+        for i in range(0, resid.size, block):
+            s, e = start[i:i + block, None].astype(float), stop[i:i + block, None].astype(float)
+            overlap = np.clip(np.minimum(e, edges[1:]) - np.maximum(s, edges[:-1]), 0, None)
+            np.add.at(flagged, pix[i:i + block], overlap)
+        return flagged.reshape(self.beamImage.shape + (-1,)) / self.TICKS_PER_SEC
+
+    def flagged_anytime(self, flags, start=None, stop=None):
+        """
+        Return a boolean image that is True for pixels with any of flags set, in the pixel flags or for any part of start
+        to stop (seconds from the start of the file, default the whole exposure) in the time-resolved flags. For uses
+        that can only leave out whole pixels, e.g. per pixel masks and exposure maps.
+        """
+        mask = np.array(self.flagged(flags), dtype=bool)
+        resid, first, last = self.flagged_intervals(flags)
+        if resid.size:
+            hit = np.ones(resid.size, dtype=bool)
+            if start is not None:
+                hit &= last > start * self.TICKS_PER_SEC
+            if stop is not None:
+                hit &= first < stop * self.TICKS_PER_SEC
+            pix = self.beammap_index.pixel(resid[hit])
+            mask.reshape(-1)[pix[pix >= 0]] = True
+        return mask
+
+    @tracing.traced('photontable.query', counts=lambda q: dict(photons=len(q), bytes_read=q.nbytes))
+    def query(self, startw=None, stopw=None, start=None, stopt=None, resid=None, intt=None, pixel=None, column=None,
+              exclude_flags=None):
         """
         intt takes precedence, all none is the full file
 
         if a column is specified there is no need to do ['colname'] on the return
 
+        if exclude_flags is specified photons from pixels with any of the flags, or that arrived while any of the
+        flags was set in the time-resolved flags, are dropped from the result
+
         :param start:
         :param pixel:
         :param stopt:
@@ -586,12 +832,14 @@ class Photontable:
         :param startw: number or none
         :param stopw: number or none
         :param resid: number, list/array or None
+        :param exclude_flags: flag names or None
 
         pixel may be used and will be converted to the appropriate resid via the beamamp, resid takes precedence
         use caution with slices and large numbers of pixels!
 
         :return:
         """
+        cores.rebalance()  # Between queries is a safe point to resize the thread pools
         if pixel and not resid:
             resid = tuple(self.beamImage[pixel].ravel())
 
@@ -609,8 +857,40 @@ class Photontable:
         except TypeError:
             resid = (resid,)
 
+        def exclude(photons):
+            if not exclude_flags:
+                return photons
+            photons = self.filter_photons_by_flags(photons, disallowed=exclude_flags)
+            return np.ascontiguousarray(photons[column]) if column else photons
+
+        # The flag filter needs resID and time
+        field = None if exclude_flags else column
+
+        def select(photons):
+            return photons if field is None else np.ascontiguousarray(photons[field])
+
         if startw is None and stopw is None and start is None and stopt is None and not resid:
-            return self.photonTable.read(field=column)  # we need it all!
+            if self._reader is not None:
+                return exclude(select(self._reader.read()))
+            with chunkread.HDF5_LOCK:
+                photons = self.photonTable.read(field=field)  # we need it all!
+            return exclude(photons)
+
+        rows = self.resid_rows(build=False) if resid else None
+        if rows is not None:
+            resids, starts, stops = rows
+            wanted = np.unique(np.asarray(resid, dtype=np.uint32))
+            i = np.searchsorted(resids, wanted).clip(max=max(resids.size - 1, 0))
+            i = i[resids[i] == wanted] if resids.size else i[:0]
+            photons = self._reader.read(ranges=(starts[i], stops[i]))
+            return exclude(select(photons[_cut(photons, start, stopt, startw, stopw)]))
+
+        if not resid and self._reader is not None:
+            span = ((self.duration * self.TICKS_PER_SEC if stopt is None else stopt) - (start or 0))
+            if span >= SCAN_FRACTION * self.duration * self.TICKS_PER_SEC:
+                cut = lambda photons, _: photons[_cut(photons, start, stopt, startw, stopw)]
+                photons = self._reader.scan(cut)
+                return exclude(select(np.concatenate(photons) if photons else self._reader.read(0, 0)))
 
         res = '|'.join(['(resID=={})'.format(r) for r in map(int, resid)])
         res = '(' + res + ')' if '|' in res and res else res
@@ -659,14 +939,16 @@ class Photontable:
             return np.array([], dtype=mkidcore.binfile.mkidbin.PhotonNumpyType)
         else:
             tic = time.time()
-            try:
-                q = self.photonTable.read_where(query, field=column)
-            except SyntaxError:
-                raise
+            with chunkread.HDF5_LOCK:
+                try:
+                    q = self.photonTable.read_where(query, field=field)
+                except SyntaxError:
+                    raise
+                indices = tuple(self.photonTable.will_query_use_indexing(query))
+            q = exclude(q)
             toc = time.time()
             msg = 'Fetched {}/{} rows in {:.3f}s using indices {} for query {} \n\t st:{} et:{} sw:{} ew:{}'
-            getLogger(__name__).debug(msg.format(len(q), len(self.photonTable), toc - tic,
-                                                 tuple(self.photonTable.will_query_use_indexing(query)), query,
+            getLogger(__name__).debug(msg.format(len(q), len(self.photonTable), toc - tic, indices, query,
                                                  *map(lambda x: '{:.2f}'.format(x) if x is not None else 'None',
                                                       (start, stopt, startw, stopw))))
 
@@ -681,7 +963,8 @@ class Photontable:
         allowed: tuple
             collection of pixel flags to keep photons for
         disallowed: tuple
-            collection of pixel flags to remove photons for
+            collection of pixel flags to remove photons for, photons that arrived while one of the flags was set in
+            the time-resolved flags are also removed
 
         Return
         ------
@@ -691,8 +974,21 @@ class Photontable:
         if len(allowed) > 0:
             raise NotImplementedError
 
-        filtered = self.flagged(disallowed, self.xy(photons))
-        return photons[np.invert(filtered)]
+        return photons[np.invert(self.photon_mask(photons, disallowed))]
+
+    def photon_mask(self, photons, exclude_flags):
+        """
+        Return a boolean array that is True for photons from pixels with any of exclude_flags set, or that arrived
+        while any of exclude_flags was set in the time-resolved flags
+        """
+        if not exclude_flags:
+            return np.zeros(len(photons), dtype=bool)
+        bitmask = self.flags.bitmask(exclude_flags, unknown='ignore')
+        return self.beammap_index.photon_mask(photons, bitmask) | self.interval_mask(photons, exclude_flags)
+
+    def good_resids(self, exclude=None):
+        """Return the resIDs of the pixels without any of the flags in exclude set, in beammap order"""
+        return self.beammap_index.good_resids(self.flags.bitmask(exclude, unknown='ignore') if exclude else 0)
 
     def get_wcs(self, sample_times=None, derotate=True, wcs_timestep=None, cube_type=None, bins=None):
         """
@@ -733,23 +1029,27 @@ class Photontable:
             sample_times = np.arange(self.start_time, self.stop_time, wcs_timestep)
 
         start_time = sample_times[0]
-        ref_pixels = []
+        # The metadata only changes between states of the index, so a header and reference pixel are built once per
+        # distinct state spanned by the samples rather than once per sample
+        states, sample_state = np.unique(self.metadata_index.states(sample_times), return_inverse=True)
+        state_ref_pixels = []
         try:
-            for t in sample_times:
-                md = self.metadata(t)
+            for state in states:
+                md = self.metadata_index.at_state(state)
                 instrument = md['INSTRUME'].lower()
                 head = mkidcore.metadata.build_header(md, unknown_keys='ignore',
                                                       KEY_INFO=INSTRUMENT_KEY_MAP[instrument]['keys'],
                                                       TIME_KEYS=INSTRUMENT_KEY_MAP[instrument]['time'],
                                                       DEFAULT_CARDSET=INSTRUMENT_KEY_MAP[instrument]['card'],
                                                       TIME_KEY_BUILDER=INSTRUMENT_KEY_MAP[instrument]['builder'])
-                ref_pixels.append(compute_wcs_ref_pixel((md['E_CONEXX'], md['E_CONEXY']),
-                                                        reference_pixel=(head['E_PREFX'], head['E_PREFY']),
-                                                        reference=(head['E_CXREFX'], head['E_CXREFY']),
-                                                        conex_deltas=(md['E_DPDCX'], md['E_DPDCY'])))
+                state_ref_pixels.append(compute_wcs_ref_pixel((md['E_CONEXX'], md['E_CONEXY']),
+                                                              reference_pixel=(head['E_PREFX'], head['E_PREFY']),
+                                                              reference=(head['E_CXREFX'], head['E_CXREFY']),
+                                                              conex_deltas=(md['E_DPDCX'], md['E_DPDCY'])))
         except KeyError:
             getLogger(__name__).warning('Insufficient data to build a WCS solution, conex info missing')
             return None
+        ref_pixels = [state_ref_pixels[i] for i in sample_state.ravel()]
 
         cubeaxis = {}
         if cube_type in ('wave', 'time'):
@@ -843,6 +1143,7 @@ class Photontable:
 
         return {'spectrum': spectrum, 'wavelengths': bin_edges, 'nphotons': len(photons)}
 
+    @tracing.traced('photontable.get_fits')
     def get_fits(self, start=None, duration=None, weight=False, wave_start=None,
                  wave_stop=None, rate=True, cube_type=None, bin_width=None, bin_edges=None, derotate=True,
                  bin_type='energy', exclude_flags=pixelflags.PROBLEM_FLAGS, **kwargs):
@@ -875,6 +1176,7 @@ class Photontable:
         :param exclude_flags: int
             Specifies flags to exclude from the tallies
             flag definitions see 'h5FileFlags' in Headers/pipelineFlags.py
+            Photons within time-resolved flag intervals are dropped and rates use the unflagged time of each pixel
         :param wave_start:
         """
         if type(bin_edges) == np.ndarray:
@@ -918,8 +1220,12 @@ class Photontable:
             ycol = None
             bin_edges = self.nominal_wavelength_bins[[0, -1]]
             duration = self.duration
+        # Photons of flagged pixels are left out of the image below, so the photons need only be filtered when some
+        # flags cover just part of the exposure
+        timeflagged = bool(exclude_flags) and self.flagged_intervals(exclude_flags)[0].size > 0
         # Retrieval rate is about 2.27Mphot/s for queries in the 100-200M photon range
-        photons = self.query(start=start, intt=duration, startw=wave_start, stopw=wave_stop)
+        photons = self.query(start=start, intt=duration, startw=wave_start, stopw=wave_stop,
+                             exclude_flags=exclude_flags if timeflagged else None)
 
         weights = photons['weight'] if weight else None
         if weights is not None and (weights == 0).all():
@@ -934,10 +1240,9 @@ class Photontable:
 
         toc = time.time()
         xe = xedg[:-1]
-        for pixel, resID in np.ndenumerate(self.beamImage):
-            if self.flagged(exclude_flags, pixel):
-                continue
-            data[pixel] = hist[xe == resID]
+        good = ~self.flagged(exclude_flags).ravel()
+        data.reshape((self.beamImage.size,) + data.shape[2:])[good] = \
+            hist[np.searchsorted(xe, self.beamImage.ravel()[good])]
         data = np.moveaxis(data, -1, 0)
         toc2 = time.time()
         getLogger(__name__).debug(f'Histogram completed in {toc2 - tic:.2f} s, reformatting in {toc2 - toc:.2f}')
@@ -1017,11 +1322,25 @@ class Photontable:
         torate = 1 / duration if cube_type != 'time' else 1 / np.diff(bins)
         sci_data = data
         if rate:
-            sci_data = data.copy()
-            try:
-                sci_data *= torate
-            except:
-                sci_data *= torate[:, None, None]  # TODO this probably doesn't work for 4D
+            if cube_type == 'time':
+                flagged_time = self.flagged_time(exclude_flags, bin_edges)
+            else:
+                query_nfo = self._parse_query_range_info(start=start, intt=duration)
+                flagged_time = self.flagged_time(exclude_flags, np.array([query_nfo['relstart'],
+                                                                           query_nfo['relstop']]) * self.TICKS_PER_SEC)
+            if flagged_time is not None:
+                # Pixels with time-resolved flags were only exposed for the unflagged part of each bin
+                exposure = (np.diff(bins)[:, None, None] if cube_type == 'time' else duration) - \
+                           np.moveaxis(flagged_time, -1, 0)
+                if data.ndim == 2:
+                    exposure = exposure[0]
+                sci_data = np.divide(data, exposure, out=np.zeros_like(data), where=exposure > 0)
+            else:
+                sci_data = data.copy()
+                try:
+                    sci_data *= torate
+                except:
+                    sci_data *= torate[:, None, None]  # TODO this probably doesn't work for 4D
 
         hdul = fits.HDUList([fits.PrimaryHDU(header=header),
                              fits.ImageHDU(data=sci_data, header=hdr, name='SCIENCE'),
@@ -1034,10 +1353,11 @@ class Photontable:
         """
         Returns a requested entry from the obs file header
         """
-        if name not in self.file.root.photons.photontable.attrs:
-            raise KeyError(name)
-        # the implementation does not like missing get calls
-        x = getattr(self.file.root.photons.photontable.attrs, name)
+        with chunkread.HDF5_LOCK:
+            if name not in self.file.root.photons.photontable.attrs:
+                raise KeyError(name)
+            # the implementation does not like missing get calls
+            x = getattr(self.file.root.photons.photontable.attrs, name)
         if isinstance(x, mkidcore.metadata.MetadataSeries) and last_if_series:
             return x.values[-1]
         else:
@@ -1073,6 +1393,11 @@ class Photontable:
         with warnings.catch_warnings():
             warnings.filterwarnings("ignore", category=tables.NaturalNameWarning)
             setattr(self.file.root.photons.photontable.attrs, key, value)
+        self._mdcache = None
+        if key in self._metadata_table_keys():
+            self._metadata_dirty = True
+        if key == 'flags':
+            self._flagset = None
 
     def metadata(self, timestamp=None):
         """ Return an dict of key, value pairs associated with the dataset
@@ -1080,27 +1405,99 @@ class Photontable:
         if no timestamp is specified the first record for a key (if a series) is returned.
         if a timestamp is specified then the most recent preceeding record is returned
         """
+        return self.metadata_index.get(timestamp)
 
-        records = {}
+    @property
+    def metadata_index(self):
+        """
+        A MetadataIndex of the header, built on first use and rebuilt after the header is updated. In read mode
+        the index is shared by every Photontable of the same (unmodified) file in the process.
+        """
+        if self._mdcache is None:
+            if self.mode == 'write' or self.in_memory:
+                self._mdcache = self._read_metadata_index()
+            else:
+                self._mdcache = indexing.cached(('photontable',) + indexing.file_key(self.filename),
+                                                self._read_metadata_index)
+        return self._mdcache
 
-        for k in self.file.root.photons.photontable.attrs._f_list('user'):
-            data = getattr(self.file.root.photons.photontable.attrs, k)
+    def _metadata_table_keys(self):
+        """The header keys stored in the /metadata table, empty if there is none"""
+        with chunkread.HDF5_LOCK:
             try:
-                data = data.get(timestamp, preceeding=True)
-                records[k] = data
-            except AttributeError:
-                records[k] = data
-            except ValueError as e:
-                getLogger(__name__).warning(e)
-                pass  # no data
+                return set(self.file.get_node('/metadata/index').attrs.KEYS)
+            except tables.NoSuchNodeError:
+                return set()
+
+    def _read_metadata_index(self):
+        """
+        Build a MetadataIndex from the /metadata table, if it is current, and the header keys it doesn't hold (e.g.
+        those set by calibration steps), else from the photontable attributes
+        """
+        with chunkread.HDF5_LOCK:
+            attrs = self.file.root.photons.photontable.attrs
+            keys = attrs._f_list('user')
+            if not self._metadata_dirty:
+                try:
+                    table = self.file.get_node('/metadata/index')
+                    names = list(table.attrs.KEYS)
+                    if set(names) <= set(keys):
+                        records = table.read()
+                        extra = {k: getattr(attrs, k) for k in keys if k not in names}
+                        objects = self.file.get_node('/metadata/values').read() if '/metadata/values' in self.file \
+                            else []
+                        # Tables written before the typed columns pickle every value
+                        values = _metadata_values(records, objects) if 'kind' in table.colnames else objects
+                        return MetadataIndex.from_columns(names, records['key'], records['time'], values, extra=extra)
+                    getLogger(__name__).debug(f'Metadata table of {self.filename} is out of date, using the header')
+                except tables.NoSuchNodeError:
+                    pass
+            return MetadataIndex({k: getattr(attrs, k) for k in keys})
+
+    def write_metadata_table(self, keys=None):
+        """
+        Store the observing metadata in the header as a columnar (key, time, value) table under /metadata, with a
+        completely sorted index on time. Numbers, bools and strings are stored in typed columns and only other values
+        are pickled, so reading it avoids unpickling every record of the header's metadata series. Done automatically
+        when metadata is attached and when one of the stored keys is updated and the file is then closed or returned to
+        read mode. Other header keys are read from the header itself, so updating them doesn't rewrite the table.
 
-        return records
+        :param keys: the header keys to store, by default those already in the table or, if there is none, all of them
+        """
+        if self.mode != 'write':
+            raise IOError("Must open file in write mode to do this!")
+        attrs = self.file.root.photons.photontable.attrs
+        if keys is None:
+            keys = self._metadata_table_keys() or attrs._f_list('user')
+        self._metadata_dirty = False
+        names, key, time, values = MetadataIndex({k: getattr(attrs, k) for k in keys}).to_columns()
+        try:
+            self.file.remove_node('/metadata', recursive=True)
+        except tables.NoSuchNodeError:
+            pass
+        group = self.file.create_group('/', 'metadata', 'Observing Metadata')
+        kind, number, integer, text, objects = _metadata_columns(values)
+        description = dict(self.MetadataDescription.columns, text=tables.StringCol(max(text.itemsize, 1), pos=5))
+        table = self.file.create_table(group, name='index', description=description, title='Metadata records',
+                                       expectedrows=max(len(key), 1))
+        if len(key):
+            table.append(np.rec.fromarrays((key, time, kind, number, integer, text), dtype=table.dtype))
+        table.attrs.KEYS = names
+        table.cols.time.create_csindex()
+        table.flush()
+        if objects:
+            vlarray = self.file.create_vlarray(group, 'values', tables.ObjectAtom(), 'Metadata record values',
+                                               expectedrows=len(objects))
+            for v in objects:
+                vlarray.append(v)
+            vlarray.flush()
 
     def attach_observing_metadata(self, metadata):
         if self.mode != 'write':
             raise IOError("Must open file in write mode to do this!")
         for k, v in metadata.items():
             self.update_header(k, v)
+        self.write_metadata_table(self._metadata_table_keys() | set(metadata))
 
     @staticmethod
     def wavelength_bins(width=.1, start=700, stop=1500, energy=True):
@@ -1132,14 +1529,23 @@ class Photontable:
         """A resonator iterator excluding resonators flagged with any flags in exclude and selecting only pixels with
         all the flags in select (select=None|empty implies no restriction. set pixel=True to yield resID,(x,y) instead
         of resid"""
-        excludemask = self.flagged(exclude, all_flags=False)
-        selectmask = self.flagged(select, all_flags=False)
-        for pix, resid in np.ndenumerate(self.beamImage):
-            excl, sel = excludemask[pix], selectmask[pix]
-            if excl or (select and not sel):
-                continue
-            yield (pix, resid) if pixel else resid
-
-    def needed_ram(self):
-        amount = len(self.photonTable) * self.photonTable.dtype.itemsize * 3  # 25
-        return self.ram_manager(amount)
+        keep = ~self.flagged(exclude, all_flags=False)
+        if select:
+            keep &= self.flagged(select, all_flags=False)
+        keep = keep.ravel()
+        resids = self.beamImage.ravel()[keep]
+        if not pixel:
+            yield from resids.tolist()
+            return
+        x, y = np.unravel_index(np.flatnonzero(keep), self.beamImage.shape)
+        yield from zip(zip(x.tolist(), y.tolist()), resids.tolist())
+
+    def needed_ram(self, task='photontable'):
+        """
+        Return a context manager that reserves the RAM task needs to work with the whole table and records what it
+        actually used to refine later reservations (see mkidpipeline.utils.memory.predict_ram)
+        """
+        sizes = dict(photons=len(self.photonTable))
+        amount = pipeline_ram.predict_ram(task, len(self.photonTable) * self.photonTable.dtype.itemsize * 3,  # 25
+                                          **sizes)
+        return pipeline_ram.record_ram(task, reservation=self.ram_manager(amount), **sizes)
@@ -1,6 +1,5 @@
 from importlib import import_module
 import pkgutil
-import multiprocessing as mp
 import functools
 import mkidcore.config
 from mkidcore.pixelflags import FlagSet, BEAMMAP_FLAGS
@@ -8,6 +7,8 @@ from mkidcore.config import getLogger
 
 import mkidpipeline.config as config
 import mkidpipeline.steps
+from mkidpipeline.utils import cores, memory, pooling, tracing
+from mkidpipeline.utils.scheduling import Task, TaskGraph
 
 
 PIPELINE_STEPS = {'attachmeta': None}
@@ -44,6 +45,9 @@ PROBLEM_FLAGS = ('pixcal.hot', 'pixcal.cold', 'pixcal.dead', 'beammap.noDacTone'
                  'wavecal.not_enough_histogram_fits', 'wavecal.no_histograms',
                  'wavecal.not_attempted')
 
+# Steps whose fetch runs a pool of the step's ncpu, the fetches of the others use one CPU of this process
+POOLED_FETCHES = ('wavecal',)
+
 
 def _safe(func):
     @functools.wraps(func)
@@ -66,10 +70,14 @@ def _batch_apply_metadata(dset):
         getLogger(__name__).warning(f'Timeranges are not all backed by unique h5 files, {len(timeranges)-len(data)} '
                                     "will be superseded by another timerange's metadata.")
     for tr in data.values():
-        o = tr.photontable
-        o.enablewrite()
-        o.attach_observing_metadata(tr.metadata)
-        o.disablewrite()
+        _apply_metadata(tr)
+
+
+def _apply_metadata(tr):
+    o = tr.photontable
+    o.enablewrite()
+    o.attach_observing_metadata(tr.metadata)
+    o.disablewrite()
 
 
 def generate_default_config(instrument='MEC'):
@@ -88,15 +96,14 @@ def generate_default_config(instrument='MEC'):
 
 def batch_applier(step, obs, ncpu=None, unique_h5=True):
     if step == 'attachmeta':
-        _batch_apply_metadata(obs)
+        with tracing.span('attachmeta', task=True):
+            _batch_apply_metadata(obs)
         return
     if step == 'buildhdf':
         PIPELINE_STEPS['buildhdf'].buildtables(obs.input_timeranges, ncpu=ncpu)
         return
     if step == 'speccal':
         return
-    else:
-        func = PIPELINE_STEPS[step].apply
 
     if unique_h5:
         obs = {o.h5: o for o in obs}.values()
@@ -109,8 +116,93 @@ def batch_applier(step, obs, ncpu=None, unique_h5=True):
     ncpu = min(config.n_cpus_available(max=ncpu), len(obs))
     if ncpu == 1:
         for o in obs:
-            _safe(func)(o)
+            _run_task('apply', step, o)
+    else:
+        pooling.pool_map(functools.partial(_run_task, 'apply', step), set(obs), ncpu=ncpu, affinity=lambda o: o.h5)
+
+
+def _run_task(action, step, target):
+    """
+    Entry point of the tasks built by build_task_graph and of batch_applier, module level so that it can be sent to
+    pool workers
+    """
+    with cores.busy(), tracing.span(step if action is None else f'{step}.{action}', task=True,
+                                    target=getattr(target, 'id' if action == 'fetch' else 'h5', None)):
+        _run_action(action, step, target)
+
+
+def _run_action(action, step, target):
+    if action == 'fetch':
+        with memory.reservation_priority(memory.PRIORITY_CALIBRATION):  # Science data waits on these
+            PIPELINE_STEPS[step].fetch([target])
+        if step == 'wavecal':
+            PIPELINE_STEPS['wavecal']._loaded_solutions = {}  # See the matching note in mkidpipe
+    elif step == 'buildhdf':
+        PIPELINE_STEPS['buildhdf'].buildtables([target], ncpu=1)
+    elif step == 'attachmeta':
+        _apply_metadata(target)
     else:
-        pool = mp.Pool(processes=ncpu)
-        pool.map(func, set(obs))
-        pool.close()
+        _safe(PIPELINE_STEPS[step].apply)(target)
+
+
+def build_task_graph(outputs, flow=None):
+    """
+    Build the TaskGraph that takes the data of outputs through the steps of flow (default: config.config.flow).
+
+    Every h5 goes through its steps in flow order. The calibration product of a step is generated once all the h5s it is
+    made from have been through the preceding steps, and the step is applied to an h5 once that h5 has been through the
+    preceding steps and the calibration product it uses exists. Unlike running the steps one after another with
+    batch_applier nothing else waits.
+
+    Task keys are ('buildhdf'|'attachmeta', h5), ('fetch', step, calibration id) and ('apply', step, h5).
+    """
+    flow = config.config.flow if flow is None else flow
+    graph = TaskGraph()
+    timeranges = {tr.h5: tr for tr in outputs.input_timeranges}
+    last = {}  # The most recent task of each h5
+
+    for step in flow:
+        if step in ('buildhdf', 'attachmeta'):
+            for h5, tr in timeranges.items():
+                key = (step, h5)
+                graph.add(Task(key, _run_task, (None, step, tr), deps=[last[h5]] if h5 in last else [], affinity=h5))
+                last[h5] = key
+            continue
+
+        module = PIPELINE_STEPS[step]
+        fetched = {}
+        if hasattr(module, 'fetch') and hasattr(outputs, f'{step}s'):
+            cost = 1
+            if step in POOLED_FETCHES:
+                cost = config.n_cpus_available(max=config.config.get(f'{step}.ncpu', inherit=True))
+            for sd in getattr(outputs, f'{step}s'):
+                key = ('fetch', step, sd.id)
+                if sd.id in fetched:
+                    continue
+                deps = [last[tr.h5] for tr in sd.input_timeranges if tr.h5 in last]
+                # Generating solutions may need the GUI or the step's own pool so they run in this process
+                graph.add(Task(key, _run_task, ('fetch', step, sd), deps=deps, cost=cost, local=True))
+                fetched[sd.id] = key
+
+        if step == 'speccal' or not hasattr(module, 'apply'):
+            continue
+        for h5, o in {o.h5: o for o in getattr(outputs, f'to_{step}')}.items():
+            key = ('apply', step, h5)
+            deps = [last[h5]] if h5 in last else []
+            cal = getattr(o, step, None)
+            if cal and getattr(cal, 'id', None) in fetched:
+                deps.append(fetched[cal.id])
+            graph.add(Task(key, _run_task, ('apply', step, o), deps=deps, affinity=h5))
+            last[h5] = key
+    return graph
+
+
+def run_flow(outputs, flow=None, ncpu=None):
+    """
+    Run the pipeline steps of flow (default: config.config.flow) needed for outputs, starting every task as soon as
+    its inputs exist. See build_task_graph.
+    """
+    graph = build_task_graph(outputs, flow=flow)
+    ncpu = config.n_cpus_available(max=ncpu)
+    getLogger(__name__).info(f'Running {len(graph)} pipeline tasks on up to {ncpu} CPUs')
+    return graph.run(ncpu=ncpu)
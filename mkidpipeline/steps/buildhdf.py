@@ -2,7 +2,6 @@ import os
 import tables
 import time
 import numpy as np
-import multiprocessing as mp
 from mkidcore.corelog import getLogger
 from mkidcore.config import yaml
 import mkidcore.utils
@@ -12,7 +11,9 @@ from mkidcore.instruments import InstrumentInfo
 
 from mkidpipeline.photontable import Photontable
 import mkidpipeline.config
-from mkidpipeline.utils.memory import PIPELINE_MAX_RAM_GB, free_ram_gb, reserve_ram, release_ram
+from mkidpipeline.utils import pooling, tracing
+from mkidpipeline.utils.memory import (PIPELINE_MAX_RAM_GB, free_ram_gb, reserve_ram, release_ram, predict_ram,
+                                       record_ram)
 
 
 PHOTON_BIN_SIZE_BYTES = 8
@@ -20,25 +21,34 @@ PHOTON_BIN_SIZE_BYTES = 8
 
 class StepConfig(mkidpipeline.config.BaseStepConfig):
     yaml_tag = u'!buildhdf_cfg'
+    # nb these propagate to kwargs of build_pytables, as do shuffle and bitshuffle if set (e.g. by mkidpipe --autotune)
     REQUIRED_KEYS = (('remake', False, 'Remake H5 even if they exist'),
                      ('include_baseline', False, 'Include the baseline in H5 phase/wavelength column'),
-                     ('chunkshape', 250, 'HDF5 Chunkshape to use'),)  # nb propagates to kwargs of build_pytables
+                     ('chunkshape', 250, 'HDF5 Chunkshape to use'),
+                     ('complib', 'blosc:lz4', 'Compression library of the photon table'),
+                     ('complevel', 1, 'Compression level of the photon table'))
 
 
 mkidcore.config.yaml.register_class(StepConfig)
 
 
-def estimate_ram_gb(directory, start, inttime):
+def count_bin_photons(directory, start, inttime):
+    """Return an upper bound on the number of photons in the bin files covering the time range"""
     files = [os.path.join(directory, f'{t}.bin') for t in
              range(int(start - 1), int(np.ceil(start) + inttime + 1))]
     files = filter(os.path.exists, files)
-    n_max_photons = int(np.ceil(sum([os.stat(f).st_size for f in files]) / PHOTON_BIN_SIZE_BYTES))
-    return 4.75 * n_max_photons * PHOTON_BIN_SIZE_BYTES / 1024 ** 3  #4.75 is empirical fudge
+    return int(np.ceil(sum([os.stat(f).st_size for f in files]) / PHOTON_BIN_SIZE_BYTES))
+
+
+def estimate_ram_gb(directory, start, inttime):
+    n_max_photons = count_bin_photons(directory, start, inttime)
+    guess = 4.75 * n_max_photons * PHOTON_BIN_SIZE_BYTES  #4.75 is empirical fudge
+    return predict_ram('buildhdf', guess, photons=n_max_photons) / 1024 ** 3
 
 
 def _build_pytables(filename, bmap, instrument, datadir, starttime, inttime, include_baseline,
                     index=('ultralight', 6), timesort=False, chunkshape=250, shuffle=True, bitshuffle=False,
-                    ndx_shuffle=True, ndx_bitshuffle=False, data=None):
+                    ndx_shuffle=True, ndx_bitshuffle=False, data=None, complib='blosc:lz4', complevel=1):
 
     from mkidcore.binfile.mkidbin import extract
     from mkidpipeline.pipeline import PIPELINE_FLAGS, BEAMMAP_FLAGS    #here to prevent circular imports!
@@ -63,7 +73,8 @@ def _build_pytables(filename, bmap, instrument, datadir, starttime, inttime, inc
 
     h5file = tables.open_file(filename, mode="a", title="MKID Photon File")
     group = h5file.create_group("/", 'photons', 'Photon Information')
-    filter = tables.Filters(complevel=1, complib='blosc:lz4', shuffle=shuffle, bitshuffle=bitshuffle, fletcher32=False)
+    filter = tables.Filters(complevel=complevel, complib=complib, shuffle=shuffle, bitshuffle=bitshuffle,
+                            fletcher32=False)
     table = h5file.create_table(group, name='photontable', description=Photontable.PhotonDescription, title="Photon Datatable",
                                 expectedrows=len(photons), filters=filter, chunkshape=chunkshape)
     table.append(photons)
@@ -182,7 +193,7 @@ class HDFBuilder(object):
                 self.done = True
 
     def build(self, index=('ultralight', 6), timesort=False, chunkshape=250, shuffle=True, bitshuffle=False,
-              wait_for_ram=300, ndx_shuffle=True, ndx_bitshuffle=False, data=None):
+              wait_for_ram=300, ndx_shuffle=True, ndx_bitshuffle=False, data=None, complib='blosc:lz4', complevel=1):
         """
         wait_for_ram specifiies the number of seconds to wait for sufficient ram
 
@@ -202,10 +213,16 @@ class HDFBuilder(object):
                 reserved = reserve_ram(ram_est_gb * 1024 ** 3, timeout=wait_for_ram, id=self.h5file)
             else:
                 reserved = 0
-            _build_pytables(self.h5file, self.beammap, self.instrument, self.datadir, self.starttime, self.inttime,
-                            self.include_baseline,
-                            index=index, timesort=timesort, chunkshape=chunkshape, shuffle=shuffle,
-                            bitshuffle=bitshuffle, ndx_shuffle=ndx_shuffle, ndx_bitshuffle=ndx_bitshuffle, data=data)
+            nphotons = len(data) if data is not None else count_bin_photons(self.datadir, self.starttime, self.inttime)
+            with record_ram('buildhdf' if data is None else 'buildhdf.array', photons=nphotons), \
+                    tracing.span('buildhdf.build', task=True, h5=self.h5file) as span:
+                _build_pytables(self.h5file, self.beammap, self.instrument, self.datadir, self.starttime,
+                                self.inttime, self.include_baseline, index=index, timesort=timesort,
+                                chunkshape=chunkshape, shuffle=shuffle, bitshuffle=bitshuffle, ndx_shuffle=ndx_shuffle,
+                                ndx_bitshuffle=ndx_bitshuffle, data=data, complib=complib, complevel=complevel)
+                span.count('photons', nphotons)
+                span.count('bytes_read', nphotons * PHOTON_BIN_SIZE_BYTES if data is None else data.nbytes)
+                span.count('bytes_written', os.path.getsize(self.h5file))
         except TimeoutError:
             reserved = 0
             getLogger(__name__).error(f'Aborting build of {self.h5file} due to insufficient RAM '
@@ -236,11 +253,22 @@ def _runbuilder(b):
         getLogger(__name__).critical('Caught exception during run of {}'.format(b.h5file), exc_info=True)
 
 
-def buildfromarray(array, config=None, **kwargs):
+def buildfromarray(array, config=None, starttime=None, inttime=None, **kwargs):
+    """
+    Build an h5 from a photon array, returns the name of the file
+
+    starttime and inttime default to the span of the photon times, set them when the times are relative to the
+    start of the file (as they are in the h5) rather than absolute.
+    """
     cfg = mkidpipeline.config.PipelineConfigFactory(step_defaults=dict(buildhdf=StepConfig()), cfg=config, copy=True)
-    b = HDFBuilder(beammap=cfg.beammap, outdir=cfg.paths.out, starttime=array['time'].min()/1e6,
-                   inttime=(array['time'].max()-array['time'].min())/1e6, force=True, **kwargs)
+    if starttime is None:
+        starttime = array['time'].min()/1e6
+    if inttime is None:
+        inttime = (array['time'].max()-array['time'].min())/1e6
+    b = HDFBuilder(beammap=cfg.beammap, outdir=cfg.paths.out, starttime=starttime, inttime=inttime, force=True,
+                   **kwargs)
     b.run(data=array)
+    return b.h5file
 
 
 def buildtables(timeranges, config=None, ncpu=None, remake=None, **kwargs):
@@ -280,7 +308,5 @@ def buildtables(timeranges, config=None, ncpu=None, remake=None, **kwargs):
                 getLogger(__name__).error('Insufficient memory to process {}'.format(b.h5file))
         return timeranges
 
-    pool = mp.Pool(mkidpipeline.config.n_cpus_available(max=cfg.get('buildhdf.ncpu', inherit=True)))
-    pool.map(_runbuilder, builders)
-    pool.close()
-    pool.join()
+    pooling.pool_map(_runbuilder, builders, affinity=lambda b: b.h5file,
+                     ncpu=mkidpipeline.config.n_cpus_available(max=cfg.get('buildhdf.ncpu', inherit=True)))
@@ -10,19 +10,24 @@ Functions
 
     _increment_id    : Monkey patch for STScI drizzle class of drizzle package
     mp_worker       : Genereate a reduced, reformated photonlist
+    write_dither_cache : Store a reduced photonlist as a columnar file and a small metadata sidecar
+    map_dither_cache   : Memory map a reduced photonlist written by write_dither_cache
     load_data       : Consolidate all dither positions
+    load_cached_data : Map the consolidated dither positions from a previous load_data call
     form            : Takes in a MKIDDither object and drizzles the dithers onto a common sky grid
 """
 import os
 import numpy as np
 import time
-import multiprocessing as mp
 import matplotlib.pylab as plt
 from mpl_toolkits.axes_grid1 import make_axes_locatable
 from matplotlib.colors import LogNorm
 import pickle
 import hashlib
-from glob import glob
+import shutil
+import tempfile
+from collections import deque
+from concurrent.futures import ThreadPoolExecutor
 import getpass
 from mkidcore.metadata import MetadataSeries
 import astropy
@@ -37,13 +42,15 @@ import mkidcore.metadata
 from mkidcore.utils import mjd_to
 from mkidcore.corelog import getLogger
 from mkidcore.instruments import CONEX2PIXEL
-from mkidpipeline.photontable import Photontable
+from mkidpipeline.photontable import Photontable, open_photontable
 import mkidpipeline.config
+from mkidpipeline.utils import drizzling, pooling
 from mkidcore.utils import astropy_observer
 
 EXCLUDE = ('pixcal.dead', 'pixcal.hot', 'pixcal.cold', 'beammap.noDacTone', 'wavecal.bad', 'wavecal.failed_convergence',
            'wavecal.no_histograms', 'wavecal.not_attempted', 'flatcal.bad')  # fill with undesired flags
 PROBLEM_FLAGS = tuple()  # fill with flags that will break drizzler
+FITS_BLOCK = 2880  # FITS files are written in blocks of this many bytes
 
 
 class StepConfig(mkidpipeline.config.BaseStepConfig):
@@ -56,8 +63,12 @@ class StepConfig(mkidpipeline.config.BaseStepConfig):
                                            'use the CONEX position to calculate the WCS. Used for bench tests where '
                                            'data is not taken'),
                      ('save_steps', False, 'Save intermediate fits files where possible (only some modes)'),
-                     ('usecache', False, 'Cache photontable for subsequent runs'),
+                     ('usecache', False, 'Cache photontable data and drizzle footprints for subsequent runs'),
                      ('ncpu', 1, 'Number of CPUs to use'),
+                     ('event_drizzle', False, 'Drizzle photons directly onto the sky grid instead of first forming '
+                                              'detector frames. Much faster for fine time bins'),
+                     ('stream_output', False, 'Write the output FITS file as each dither is drizzled instead of '
+                                              'holding the full cube in memory. Adds an EXPOSURE extension'),
                      ('clearcache', False, 'Clear user cache on next run'))
 
 
@@ -250,19 +261,11 @@ class Canvas:
             getLogger(__name__).warning('MJD not present in metadata - make sure obslog is properly populated!')
         return mkidcore.metadata.build_header(meta, unknown_keys='warn')
 
-    def write(self, filename, overwrite=True, compress=False, cube_type=None, time_bin_edges=None, wvl_bin_edges=None):
-        """
-        Writes the drizzled output to a FITS file
-        :param filename: fully qualified file path
-        :param overwrite: if True will overwrite existing file of the same name
-        :param compress: If True will output a compressed GZ file instead of a FITS file
-        :param cube_type: Type of output cube, options are 'both', 'time', or 'wave'
-        :param time_bin_edges: temporal bin edges (in seconds) if cube_type is 'both' or 'time'
-        :param wvl_bin_edges: wavelength bin edges (in nm) if cube_type is 'both' or 'wave'
-        """
+    def _headers(self, wcs=None):
+        """Return the primary, science, and variance headers for the output, wcs defaults to self.wcs"""
         primary_header = self.header
-        primary_header.update(self.wcs.to_header())
-        primary_header['EXPTIME'] = self.average_nonzero_exp_time
+        primary_header.update((self.wcs if wcs is None else wcs).to_header())
+        primary_header['EXPTIME'] = getattr(self, 'average_nonzero_exp_time', 0.0)
         science_header = primary_header.copy()
         science_header['WCSTIME'] = (self.drizzle_params.wcs_timestep, '')
         science_header['PIXFRAC'] = (self.drizzle_params.pixfrac, '')
@@ -270,7 +273,10 @@ class Canvas:
 
         variance_header = science_header.copy()
         variance_header['UNIT'] = 'photon'
+        return primary_header, science_header, variance_header
 
+    @staticmethod
+    def _bin_hdus(cube_type=None, time_bin_edges=None, wvl_bin_edges=None):
         bin_hdu = []
         if cube_type in ('both', 'time'):
             hdu = fits.TableHDU.from_columns(np.recarray(shape=time_bin_edges.shape, buf=time_bin_edges,
@@ -285,6 +291,29 @@ class Canvas:
                                              name='CUBE_EDGES')
             hdu.header.append(fits.Card('UNIT', 'nm', comment='Bin unit'))
             bin_hdu.append(hdu)
+        return bin_hdu
+
+    @staticmethod
+    def _fits_filename(filename, compress=False):
+        if compress:
+            filename = filename + '.gz'
+
+        if not (filename.lower().endswith('.fits') or filename.lower().endswith('.fits.gz')):
+            filename += '.fits'
+        return filename
+
+    def write(self, filename, overwrite=True, compress=False, cube_type=None, time_bin_edges=None, wvl_bin_edges=None):
+        """
+        Writes the drizzled output to a FITS file
+        :param filename: fully qualified file path
+        :param overwrite: if True will overwrite existing file of the same name
+        :param compress: If True will output a compressed GZ file instead of a FITS file
+        :param cube_type: Type of output cube, options are 'both', 'time', or 'wave'
+        :param time_bin_edges: temporal bin edges (in seconds) if cube_type is 'both' or 'time'
+        :param wvl_bin_edges: wavelength bin edges (in nm) if cube_type is 'both' or 'wave'
+        """
+        primary_header, science_header, variance_header = self._headers()
+        bin_hdu = self._bin_hdus(cube_type, time_bin_edges, wvl_bin_edges)
         if self.rate:
             hdul = fits.HDUList([fits.PrimaryHDU(header=primary_header),
                                  fits.ImageHDU(name='cps', data=self.cps, header=science_header),
@@ -294,22 +323,106 @@ class Canvas:
                                  fits.ImageHDU(name='counts', data=self.counts, header=science_header),
                                  fits.ImageHDU(name='variance', data=self.counts, header=variance_header)] + bin_hdu)
 
-        if compress:
-            filename = filename + '.gz'
-
-        if not (filename.lower().endswith('.fits') or filename.lower().endswith('.fits.gz')):
-            filename += '.fits'
-
+        filename = self._fits_filename(filename, compress)
         hdul.writeto(filename, overwrite=overwrite)
         getLogger(__name__).info('FITS file {} saved'.format(filename))
 
+    def stream(self, filename, shape, wcs=None, overwrite=True, cube_type=None, time_bin_edges=None,
+               wvl_bin_edges=None):
+        """
+        Preallocate the FITS file write would create for output of the given shape, plus an EXPOSURE extension, and
+        return it as a StreamedFits so the output can be filled in as it is drizzled. Compression is not supported.
+        :param wcs: WCS of the output (defaults to self.wcs)
+        See write for the other parameters
+        """
+        primary_header, science_header, variance_header = self._headers(wcs=wcs)
+        exposure_header = science_header.copy()
+        exposure_header['UNIT'] = 's'
+        images = [('cps' if self.rate else 'counts', science_header, shape), ('variance', variance_header, shape),
+                  ('exposure', exposure_header, shape)]
+        return StreamedFits(self._fits_filename(filename), primary_header, images,
+                            tables=self._bin_hdus(cube_type, time_bin_edges, wvl_bin_edges), overwrite=overwrite)
+
+
+class StreamedFits:
+    """
+    A FITS file preallocated on disk with float32 image extensions that are written through memory maps, so output
+    larger than RAM can be filled in plane by plane. Extensions are available by (lower case) name, e.g. f['cps'].
+    """
+
+    def __init__(self, filename, primary_header, images, tables=(), overwrite=True):
+        """
+        :param filename: fully qualified file path
+        :param primary_header: header of the (dataless) primary HDU
+        :param images: list of (name, header, shape) for the image extensions
+        :param tables: list of additional (small) HDUs to place after the images
+        :param overwrite: if True will overwrite existing file of the same name
+        """
+        if os.path.exists(filename) and not overwrite:
+            raise OSError(f'{filename} already exists')
+        self.filename = filename
+        self._layout = []
+        with open(filename, 'wb') as f:
+            f.write(fits.PrimaryHDU(header=primary_header).header.tostring().encode())
+            for name, header, shape in images:
+                # A broadcast single element array gives astropy the shape and type without allocating the data
+                hdu = fits.ImageHDU(data=np.broadcast_to(np.zeros(1, dtype='>f4'), shape), header=header, name=name)
+                f.write(hdu.header.tostring().encode())
+                offset = f.tell()
+                nbytes = int(np.prod(shape)) * 4
+                f.seek(offset + -(-nbytes // FITS_BLOCK) * FITS_BLOCK - 1)
+                f.write(b'\0')
+                self._layout.append((name.lower(), offset, tuple(shape)))
+        if tables:
+            with fits.open(filename, mode='append') as hdul:
+                for hdu in tables:
+                    hdul.append(hdu)
+        self._data = {name: np.memmap(filename, dtype='>f4', mode='r+', offset=offset, shape=shape)
+                      for name, offset, shape in self._layout}
+
+    def __getitem__(self, name):
+        return self._data[name.lower()]
+
+    def flush(self):
+        for d in self._data.values():
+            d.flush()
+
+    def close(self, **header_updates):
+        """Flush the data and apply header_updates (e.g. EXPTIME) to the primary and image headers"""
+        self.flush()
+        self._data = {}
+        if header_updates:
+            with fits.open(self.filename, mode='update', memmap=True) as hdul:
+                for hdu in hdul[:len(self._layout) + 1]:
+                    for k, v in header_updates.items():
+                        hdu.header[k] = v
+        getLogger(__name__).info('FITS file {} saved'.format(self.filename))
+
+    def open(self):
+        """Return read only memory maps of the image extensions"""
+        return {name: np.memmap(self.filename, dtype='>f4', mode='r', offset=offset, shape=shape)
+                for name, offset, shape in self._layout}
+
+
+def _ordered_map(func, items, nthreads):
+    """Yield func(item) for each item in order, computed in nthreads threads with at most 2 results per thread held"""
+    with ThreadPoolExecutor(max_workers=nthreads) as pool:
+        pending = deque()
+        for item in items:
+            pending.append(pool.submit(func, item))
+            if len(pending) >= 2 * nthreads:
+                yield pending.popleft().result()
+        while pending:
+            yield pending.popleft().result()
+
 
 class Drizzler(Canvas):
     """
     Generate a 2D-4D hypercube from a set dithered dataset. The cube size is ntimes * ndithers * nwvlbins * nPixRA * nPixDec.
     """
     def __init__(self, dithers_data, drizzle_params, wvl_bin_width=0.0 * u.nm, time_bin_width=0.0, wvl_min=700.0 * u.nm,
-                 wvl_max=1500 * u.nm, adi_mode=False, rate=True):
+                 wvl_max=1500 * u.nm, adi_mode=False, rate=True, ncpu=1, footprints=None,
+                 event_mode=False, wvl_bin_edges=None):
         """
         :param dithers_data: list of dictionaries of relevant input data and parameters (see output of load_data)
         :param drizzle_params: DrizzleParams object
@@ -319,17 +432,29 @@ class Drizzler(Canvas):
         :param wvl_max: maximum wavelength to use
         :param adi_mode: If True will not subtract off the calculated parallactic angle to preserve field rotation
         :param rate: If True output will be in photons/s else in photons
+        :param ncpu: number of threads to use when drizzling
+        :param footprints: drizzling.FootprintCache to use, if None footprints are only cached in memory
+        :param event_mode: If True drizzle each photon directly instead of histogramming it into detector frames first
+        :param wvl_bin_edges: astropy.units.Quantity - increasing wavelength bin edges, overrides wvl_bin_width, wvl_min,
+        and wvl_max. The WCS of the output assumes the spacing of the first bin.
         """
         super().__init__(dithers_data, drizzle_params=drizzle_params, canvas_shape=drizzle_params.canvas_shape,
                          rate=rate)
         self.drizzle_params = drizzle_params
         self.pixfrac = drizzle_params.pixfrac
+        self.ncpu = ncpu
+        self.footprints = footprints if footprints is not None else drizzling.FootprintCache()
+        self.event_mode = event_mode
+        # The detector frames from make_cube are indexed [photon_pixels[0], photon_pixels[1]]
+        self.frame_shape = (self.shape[1], self.shape[0])
         self.time_bin_width = time_bin_width
         wvl_span = wvl_max.to(u.nm).value - wvl_min.to(u.nm).value
         self.timebins = None
         self.wvl_bin_edges = None
         # get wavelength bins to use
-        if wvl_bin_width.to(u.nm).value > wvl_span:
+        if wvl_bin_edges is not None:
+            self.wvl_bin_edges = wvl_bin_edges.to(u.nm).value
+        elif wvl_bin_width.to(u.nm).value > wvl_span:
             getLogger(__name__).info('Wavestep larger than entire wavelength range - using whole wavelength range '
                                      'instead')
             self.wvl_bin_edges = np.array([wvl_min.to(u.nm).value, wvl_max.to(u.nm).value])
@@ -367,86 +492,37 @@ class Drizzler(Canvas):
         self.counts = None
         self.expmap = None
 
-    def run(self, apply_weight=True):
+    def run(self, apply_weight=True, output_file=None, cube_type=None):
         """
         Runs the drizzling code
         :param apply_weight: If True will weight each pixel by its weight from the photon table.
+        :param output_file: If given the output is written to this FITS file as each dither is drizzled instead of
+        being held in memory (see write). counts, expmap, and cps (if rate) are then read only memory maps of the file.
+        :param cube_type: Type of output cube when streaming to output_file, options are 'both', 'time', or 'wave'
         """
-        tic = time.clock()
+        if output_file:
+            return self._run_streamed(output_file, apply_weight=apply_weight, cube_type=cube_type)
+
+        tic = time.perf_counter()
 
         nexp_time = len(self.timebins) - 1
         nwvls = len(self.wvl_bin_edges) - 1
         ndithers = len(self.dithers_data)
 
-        # use exp_timestep for final spacing
-        # TODO this looks like it might be backwards from docs in ra/dec of canvas shape
-        self.cps = np.zeros((nexp_time * ndithers, nwvls) + self.canvas_shape[::-1])
-        expmap = np.zeros((nexp_time * ndithers, nwvls) + self.canvas_shape[::-1])
-        for pos, dither_photons in enumerate(self.dithers_data):  # iterate over dithers
-            dithhyper = np.zeros((nexp_time, nwvls) + self.canvas_shape[::-1], dtype=np.float32)
-            dithexp = np.zeros((nexp_time, nwvls) + self.canvas_shape[::-1], dtype=np.float32)
-
-            for wcs_i, wcs_sol in enumerate(dither_photons['obs_wcs_seq']):  # iterate through each of the wcs time spacing
-                if wcs_i >= len(self.wcs_times) - 1 and len(self.wcs_times) != 1:
-                    break
-                wcs_sol.pixel_shape = self.shape
-                # the sky grid ref and dither ref should match (crpix varies between dithers)
-                if not np.allclose(wcs_sol.wcs.crval, self.wcs.wcs.crval, rtol=1e-4):
-                    getLogger(__name__).critical('sky grid ref and dither ref do not match '
-                                                 '(crval varies between dithers)!')
-                    raise RuntimeError('sky grid ref and dither ref do not match (crval varies between dithers)!')
-
-                if len(self.timebins) <= len(self.wcs_times):
-                    time_bins = np.array([self.wcs_times[wcs_i], self.wcs_times[wcs_i + 1]])
-                else:
-                    if len(self.wcs_times) == 1:
-                        time_bins = self.timebins
-                    else:
-                        idx = np.where(
-                            (self.timebins >= self.wcs_times[wcs_i]) & (self.timebins <= self.wcs_times[wcs_i + 1]))
-                        time_bins = self.timebins[idx]
-                counts = self.make_cube(dither_photons, time_bins, self.wvl_bin_edges, apply_weight=apply_weight)
-                expin = time_bins[1] - time_bins[0]
-                cps = counts / expin  # scale this frame by its exposure time
-                # get exposure bin of current wcs time
-                wcs_time = self.wcs_times[wcs_i]
-                iwcs = np.where([(wcs_time >= self.timebins[i]) & (wcs_time < self.timebins[i + 1]) for i in
-                                 range(len(self.timebins) - 1)])[0][0]
-                for it in range(len(time_bins) - 1):  # iterate over time step - > 1 if timestep < wcs_timestep
-                    for n_wvl in range(nwvls):  # iterate over wavelengths
-                        # create a new drizzle object for each time (and wavelength) frame
-                        #TODO Add README disclaimer or go to multi extension:
-                        # in adi mode the companion will appear to move on sky because a common wcs is being used
-                        # in reality the detector mapping is changing
-                        driz = stdrizzle.Drizzle(outwcs=self.wcs, pixfrac=self.pixfrac)
-                        inwht = cps[it, n_wvl].astype(bool).astype(int)
-                        driz.add_image(cps[it, n_wvl], wcs_sol, expin=expin, inwht=inwht, in_units='cps')
-                        # for a single wcs timestep
-                        dithhyper[iwcs + it, n_wvl, :, :] += driz.outsci * driz.outexptime  # sum all counts in same exposure bin
-                        used_exptimes = np.full(np.shape(driz.outsci), driz.outexptime)
-                        whtmask = driz.outsci == 0
-                        used_exptimes[whtmask] = 0
-                        dithexp[iwcs + it, n_wvl, :, :] += used_exptimes
-
-            # for the whole dither pos
-            if len(self.wcs_times) > len(self.timebins):
-                wcs_per_timebin = (len(self.wcs_times) - 1) / nexp_time
-                #TODO check why/if this is necessary?
-                dithhyper = dithhyper / wcs_per_timebin
-
-            self.cps[pos * nexp_time: (pos + 1) * nexp_time] = dithhyper / dithexp
-            expmap[pos * nexp_time: (pos + 1) * nexp_time] = dithexp
-
-        self.cps[np.isnan(self.cps)] = 0
-        expmap[np.isnan(expmap)] = 0
-
-        getLogger(__name__).debug(f'Image load done in {time.clock() - tic:.1f} s')
-
         if nexp_time == 1 and self.time_bin_width == 0:
-            counts = np.sum(self.cps * expmap, axis=0)
-            expmap = np.sum(expmap, axis=0)
-            self.cps = counts / expmap
-            self.cps[np.isnan(self.cps)] = 0
+            counts, expmap = drizzling.tree_sum(self._drizzle_dithers(apply_weight=apply_weight, collapse=True))
+            with np.errstate(divide='ignore', invalid='ignore'):
+                self.cps = np.nan_to_num(counts / expmap)
+        else:
+            # use exp_timestep for final spacing
+            # TODO this looks like it might be backwards from docs in ra/dec of canvas shape
+            self.cps = np.zeros((nexp_time * ndithers, nwvls) + self.canvas_shape[::-1])
+            expmap = np.zeros((nexp_time * ndithers, nwvls) + self.canvas_shape[::-1])
+            for pos, (dithcps, dithexp) in enumerate(self._drizzle_dithers(apply_weight=apply_weight)):
+                self.cps[pos * nexp_time: (pos + 1) * nexp_time] = dithcps
+                expmap[pos * nexp_time: (pos + 1) * nexp_time] = dithexp
+
+        getLogger(__name__).debug(f'Image load done in {time.perf_counter() - tic:.1f} s')
 
         if nwvls == 1:
             self.cps = np.squeeze(self.cps)
@@ -456,6 +532,173 @@ class Drizzler(Canvas):
         self.counts = self.cps * expmap
         self.average_nonzero_exp_time = expmap[expmap > 0].mean()
 
+    def _drizzle_dithers(self, apply_weight=True, collapse=False):
+        """
+        Drizzle the dithers in parallel, yielding (cps, exposure) for each in dither order.
+
+        Each worker drizzles whole dithers into its own partial canvases, so nothing is shared between threads
+        and the output does not depend on scheduling. Threads left over when there are fewer dithers than CPUs
+        are used for the wcs timesteps of each dither. At most two results per worker are held waiting to be consumed.
+        The binning (drizzling.histogramdd) and the sparse drizzle products release the GIL, so the threads run in
+        parallel.
+
+        :param apply_weight: If True will weight each pixel by its weight from the photon table.
+        :param collapse: If True yield the (float64) counts and exposure summed over time instead, stacked in one
+        array for drizzling.tree_sum to reduce as they arrive
+        """
+        nworkers = max(min(self.ncpu, len(self.dithers_data)), 1)
+        ncpu = max(self.ncpu // nworkers, 1)
+
+        def work(dither_photons):
+            dithhyper, dithexp = self._drizzle_dither(dither_photons, apply_weight=apply_weight, ncpu=ncpu)
+            with np.errstate(divide='ignore', invalid='ignore'):
+                dithcps = np.nan_to_num(dithhyper / dithexp)
+            if collapse:
+                return np.stack(((dithcps * dithexp).sum(axis=0, dtype=float), dithexp.sum(axis=0, dtype=float)))
+            return dithcps, dithexp
+
+        if nworkers == 1:
+            yield from map(work, self.dithers_data)
+        else:
+            yield from _ordered_map(work, self.dithers_data, nworkers)
+
+    def _drizzle_dither(self, dither_photons, apply_weight=True, ncpu=None):
+        """
+        Drizzle a single dither position onto the canvas. Its wcs timesteps are drizzled in up to ncpu threads and
+        added to the canvas in order, so the result does not depend on scheduling.
+        :param dither_photons: dictionary of relevant input data for a single dither position
+        :param apply_weight: If True will weight each pixel by its weight from the photon table.
+        :param ncpu: number of threads to use, defaults to self.ncpu
+        :return: (ntime, nwvl, canvas y, canvas x) drizzled counts and exposure time
+        """
+        ncpu = self.ncpu if ncpu is None else ncpu
+        nexp_time = len(self.timebins) - 1
+        nwvls = len(self.wvl_bin_edges) - 1
+        dithhyper = np.zeros((nexp_time, nwvls) + self.canvas_shape[::-1], dtype=np.float32)
+        dithexp = np.zeros((nexp_time, nwvls) + self.canvas_shape[::-1], dtype=np.float32)
+
+        # iterate through each of the wcs time spacing
+        steps = [(wcs_i, wcs_sol) for wcs_i, wcs_sol in enumerate(dither_photons['obs_wcs_seq'])
+                 if wcs_i < len(self.wcs_times) - 1 or len(self.wcs_times) == 1]
+        nthreads = max(min(ncpu, len(steps)), 1)
+        step_ncpu = max(ncpu // nthreads, 1)
+
+        def work(step):
+            return self._drizzle_step(dither_photons, *step, apply_weight=apply_weight, ncpu=step_ncpu)
+
+        if nthreads == 1:
+            results = map(work, steps)
+        else:
+            results = _ordered_map(work, steps, nthreads)
+        for iwcs, counts, exposure in results:
+            dithhyper[iwcs: iwcs + len(counts)] += counts  # sum all counts in same exposure bin
+            dithexp[iwcs: iwcs + len(counts)] += exposure
+
+        # for the whole dither pos
+        if len(self.wcs_times) > len(self.timebins):
+            wcs_per_timebin = (len(self.wcs_times) - 1) / nexp_time
+            #TODO check why/if this is necessary?
+            dithhyper = dithhyper / wcs_per_timebin
+
+        return dithhyper, dithexp
+
+    def _drizzle_step(self, dither_photons, wcs_i, wcs_sol, apply_weight=True, ncpu=1):
+        """
+        Drizzle the photons of one wcs timestep of a dither
+        :return: (first exposure bin, (ntime, nwvl, canvas y, canvas x) counts, exposure time) to add to the dither
+        """
+        wcs_sol.pixel_shape = self.shape
+        # the sky grid ref and dither ref should match (crpix varies between dithers)
+        if not np.allclose(wcs_sol.wcs.crval, self.wcs.wcs.crval, rtol=1e-4):
+            getLogger(__name__).critical('sky grid ref and dither ref do not match '
+                                         '(crval varies between dithers)!')
+            raise RuntimeError('sky grid ref and dither ref do not match (crval varies between dithers)!')
+
+        if len(self.timebins) <= len(self.wcs_times):
+            time_bins = np.array([self.wcs_times[wcs_i], self.wcs_times[wcs_i + 1]])
+        else:
+            if len(self.wcs_times) == 1:
+                time_bins = self.timebins
+            else:
+                idx = np.where(
+                    (self.timebins >= self.wcs_times[wcs_i]) & (self.timebins <= self.wcs_times[wcs_i + 1]))
+                time_bins = self.timebins[idx]
+        expin = time_bins[1] - time_bins[0]
+        # get exposure bin of current wcs time
+        wcs_time = self.wcs_times[wcs_i]
+        iwcs = np.where([(wcs_time >= self.timebins[i]) & (wcs_time < self.timebins[i + 1]) for i in
+                         range(len(self.timebins) - 1)])[0][0]
+        #TODO Add README disclaimer or go to multi extension:
+        # in adi mode the companion will appear to move on sky because a common wcs is being used
+        # in reality the detector mapping is changing
+        # The footprint only depends on the wcs so compute it once and drizzle every time (if timestep <
+        # wcs_timestep) and wavelength frame through it in one pass
+        footprint = self.footprints.get(wcs_sol, self.wcs, self.frame_shape, self.canvas_shape[::-1],
+                                        pixfrac=self.pixfrac)
+        ntime = len(time_bins) - 1
+        nwvls = len(self.wvl_bin_edges) - 1
+        if self.event_mode:
+            counts = self.drizzle_events(dither_photons, time_bins, footprint, apply_weight=apply_weight, ncpu=ncpu)
+            return iwcs, counts, np.where(counts == 0, 0, expin)  # as for frames below
+
+        counts = self.make_cube(dither_photons, time_bins, self.wvl_bin_edges, apply_weight=apply_weight)
+        cps = counts / expin  # scale this frame by its exposure time
+        outsci = drizzling.drizzle_planes(footprint, cps.reshape((-1,) + cps.shape[-2:]),
+                                          self.canvas_shape[::-1], expin=expin, ncpu=ncpu)
+        outsci = outsci.reshape((ntime, nwvls) + self.canvas_shape[::-1])
+        return iwcs, outsci * expin, np.where(outsci == 0, 0, expin)
+
+    def _run_streamed(self, output_file, apply_weight=True, cube_type=None):
+        """
+        Runs the drizzling code writing each dither to output_file as it completes. Only the collapsed output
+        (a single time bin) is accumulated in memory. See run.
+        """
+        tic = time.perf_counter()
+
+        nexp_time = len(self.timebins) - 1
+        nwvls = len(self.wvl_bin_edges) - 1
+        ndithers = len(self.dithers_data)
+        collapse = nexp_time == 1 and self.time_bin_width == 0
+
+        # Same layout as the in memory output, including its squeeze of length one axes
+        lead = ((nexp_time * ndithers,) if not collapse else ()) + (nwvls,)
+        if nwvls == 1:
+            lead = tuple(n for n in lead if n != 1)
+        full_shape = (nexp_time * ndithers if not collapse else 1, nwvls) + self.canvas_shape[::-1]
+
+        cube_wcs = self.generate_wcs(wave=nwvls != 1, time=nexp_time != 1)
+        out = self.stream(output_file, lead + self.canvas_shape[::-1], wcs=cube_wcs, cube_type=cube_type,
+                          time_bin_edges=self.timebins, wvl_bin_edges=self.wvl_bin_edges)
+        sci, var, expmap = (out[k].reshape(full_shape) for k in ('cps' if self.rate else 'counts', 'variance',
+                                                                  'exposure'))
+        exp_sum, exp_n = 0.0, 0
+        if collapse:
+            total, total_exp = drizzling.tree_sum(self._drizzle_dithers(apply_weight=apply_weight, collapse=True))
+            with np.errstate(divide='ignore', invalid='ignore'):
+                sci[0] = np.nan_to_num(total / total_exp) if self.rate else total
+            var[0] = total
+            expmap[0] = total_exp
+            exp_sum, exp_n = total_exp.sum(), np.count_nonzero(total_exp)
+        else:
+            for pos, (dithcps, dithexp) in enumerate(self._drizzle_dithers(apply_weight=apply_weight)):
+                sl = slice(pos * nexp_time, (pos + 1) * nexp_time)
+                var[sl] = dithcps * dithexp
+                sci[sl] = dithcps if self.rate else var[sl]
+                expmap[sl] = dithexp
+                exp_sum += dithexp.sum(dtype=float)
+                exp_n += np.count_nonzero(dithexp)
+                out.flush()
+
+        getLogger(__name__).debug(f'Image load done in {time.perf_counter() - tic:.1f} s')
+
+        self.wcs = cube_wcs
+        self.average_nonzero_exp_time = exp_sum / exp_n if exp_n else 0.0
+        out.close(EXPTIME=self.average_nonzero_exp_time)
+        maps = out.open()
+        self.cps = maps['cps'] if self.rate else None
+        self.counts = maps['variance']
+        self.expmap = maps['exposure']
+
     def make_cube(self, dither_photons, time_bins, wvl_bins, apply_weight=False):
         """
         Creates a 4D image cube for the duration of the wcs timestep range or finer sampled if timestep is
@@ -472,14 +715,52 @@ class Drizzler(Canvas):
                          (dither_photons['timestamps'] <= time_bins[-1]))
         if weights is not None:
             weights = weights[timespan_mask]
-        sample = np.vstack((dither_photons['timestamps'][timespan_mask],
-                            dither_photons['wavelengths'][timespan_mask],
-                            dither_photons['photon_pixels'][0][timespan_mask],
-                            dither_photons['photon_pixels'][1][timespan_mask]))
+        sample = (dither_photons['timestamps'][timespan_mask], dither_photons['wavelengths'][timespan_mask],
+                  dither_photons['photon_pixels'][0][timespan_mask], dither_photons['photon_pixels'][1][timespan_mask])
 
-        bins = np.array([time_bins, wvl_bins, range(self.shape[1] + 1), range(self.shape[0] + 1)])
-        hypercube, _ = np.histogramdd(sample.T, bins, weights=weights)
-        return hypercube
+        bins = (time_bins, wvl_bins, np.arange(self.shape[1] + 1), np.arange(self.shape[0] + 1))
+        # As np.histogramdd, but without holding the GIL so that the threads of _drizzle_dithers bin in parallel
+        return drizzling.histogramdd(sample, bins, weights=weights)
+
+    def drizzle_events(self, dither_photons, time_bins, footprint, apply_weight=False, ncpu=None):
+        """
+        Drizzle the photons of one wcs timestep directly onto the canvas, skipping the detector frames of make_cube.
+        The result is that of drizzling the make_cube frames, except that input pixels flagged in the dither's
+        bad_pixel_mask are also left out.
+
+        :param dither_photons: dictionary of relevant input data for a single dither position
+        :param time_bins: array of time bin edges (in seconds)
+        :param footprint: sparse footprint of the wcs solution valid for time_bins
+        :param apply_weight: If True will weight each photon by its weight from the photon table.
+        :param ncpu: number of threads to use, defaults to self.ncpu
+        :return: (ntime, nwvl, canvas y, canvas x) counts
+        """
+        ntime = len(time_bins) - 1
+        nwvls = len(self.wvl_bin_edges) - 1
+        time_bins = time_bins * 1e6
+        timestamps = dither_photons['timestamps']
+        x, y = dither_photons['photon_pixels']
+        # same bin semantics as np.histogramdd in make_cube, the last bins are closed
+        it = np.searchsorted(time_bins, timestamps, side='right') - 1
+        it[timestamps == time_bins[-1]] = ntime - 1
+        iw = np.searchsorted(self.wvl_bin_edges, dither_photons['wavelengths'], side='right') - 1
+        iw[dither_photons['wavelengths'] == self.wvl_bin_edges[-1]] = nwvls - 1
+        use = ((it >= 0) & (it < ntime) & (iw >= 0) & (iw < nwvls) & (x < self.frame_shape[0]) &
+               (y < self.frame_shape[1]))
+
+        coverage = None
+        if dither_photons.get('bad_pixel_mask') is not None:
+            coverage = np.zeros(self.frame_shape)
+            mask = np.asarray(dither_photons['bad_pixel_mask'])
+            nx, ny = min(mask.shape[0], self.frame_shape[0]), min(mask.shape[1], self.frame_shape[1])
+            coverage[:nx, :ny] = ~mask[:nx, :ny]
+            coverage = coverage.ravel()
+
+        weights = dither_photons['weight'][use] if apply_weight else None
+        counts, _ = drizzling.drizzle_events(footprint, x[use] * self.frame_shape[1] + y[use],
+                                             it[use] * nwvls + iw[use], ntime * nwvls, weights=weights,
+                                             coverage=coverage, ncpu=self.ncpu if ncpu is None else ncpu)
+        return counts.reshape((ntime, nwvls) + self.canvas_shape[::-1])
 
     def generate_wcs(self, wave=True, time=True):
         """
@@ -597,7 +878,62 @@ def debug_dither_image(dithers_data, drizzle_params, save=None, weight=True):
     else:
         plt.show(block=True)
 
-def mp_worker(file, startw, stopw, startt, intt, adi_mode, wcs_timestep, md, exclude_flags=()):
+# The per photon columns of a mp_worker result and the type they are cached as, all else goes in the sidecar
+_CACHE_COLUMNS = (('timestamps', np.uint32), ('wavelengths', np.float32), ('weight', np.float32), ('x', np.int32),
+                  ('y', np.int32))
+
+
+def write_dither_cache(data, stem):
+    """
+    Store an mp_worker result as stem.cols, the photon columns back to back, and stem.pkl, a small pickle of
+    everything else (WCS sequence, metadata, masks) plus the column layout. The sidecar is written last so its
+    presence marks a complete cache entry.
+
+    :param data: dictionary returned by mp_worker
+    :param stem: path without extension for the cache files
+    :return: stem
+    """
+    columns = dict(timestamps=data['timestamps'], wavelengths=data['wavelengths'], weight=data['weight'],
+                   x=data['photon_pixels'][0], y=data['photon_pixels'][1])
+    layout, offset = [], 0
+    with open(stem + '.cols.tmp', 'wb') as f:
+        for name, dtype in _CACHE_COLUMNS:
+            col = np.ascontiguousarray(columns[name], dtype=dtype)
+            col.tofile(f)
+            layout.append((name, col.dtype.str, offset, col.size))
+            offset += col.nbytes
+    os.replace(stem + '.cols.tmp', stem + '.cols')
+
+    sidecar = {k: v for k, v in data.items() if k not in columns and k != 'photon_pixels'}
+    sidecar['columns'] = layout
+    with open(stem + '.pkl.tmp', 'wb') as f:
+        pickle.dump(sidecar, f, protocol=pickle.HIGHEST_PROTOCOL)
+    os.replace(stem + '.pkl.tmp', stem + '.pkl')
+    return stem
+
+
+def map_dither_cache(stem):
+    """
+    Memory map a cache entry written by write_dither_cache, returning a dictionary in the form of a mp_worker result.
+    Photon columns are read only np.memmap, nothing is deserialized beyond the small sidecar.
+    """
+    with open(stem + '.pkl', 'rb') as f:
+        data = pickle.load(f)
+    cols = {}
+    for name, dtype, offset, size in data.pop('columns'):
+        cols[name] = (np.memmap(stem + '.cols', dtype=dtype, mode='r', offset=offset, shape=(size,)) if size else
+                      np.zeros(0, dtype=dtype))
+    data.update(timestamps=cols['timestamps'], wavelengths=cols['wavelengths'], weight=cols['weight'],
+                photon_pixels=(cols['x'], cols['y']))
+    return data
+
+
+def _cache_stems(cache_dir, filenames):
+    return [os.path.join(cache_dir, f'{i:03d}_{os.path.splitext(os.path.basename(f))[0]}')
+            for i, f in enumerate(filenames)]
+
+
+def mp_worker(file, startw, stopw, startt, intt, adi_mode, wcs_timestep, md, exclude_flags=(), cache=None):
     """
     Uses photontable.query to retrieve all photons in a wavelength range defined by startw and stopw in a timerange
     defined by start time startt and duration intt. Culls photons affected by exclude_flags.
@@ -612,10 +948,12 @@ def mp_worker(file, startw, stopw, startt, intt, adi_mode, wcs_timestep, md, exc
     :param wcs_timestep: cadence at which to calculate discrete WCS solutions
     :param md: observational metadata
     :param exclude_flags: list of pixel flags to exclude from analysis
+    :param cache: if set, the result is written with write_dither_cache to this stem and only the file and cache
+    stem are returned, keeping the photons out of the (pickled) return value
     :return: dictionary of relevant data and parameters
     """
     getLogger(__name__).debug(f'Fetching data from {file}')
-    pt = Photontable(file)
+    pt = open_photontable(file)
     if startt + intt > pt.duration:
         getLogger(__name__).warning(f'Specified start ({startt}s) and duration ({intt}s) exceed the full length of the '
                                     f'photontable ({pt.duration}s).')
@@ -654,21 +992,30 @@ def mp_worker(file, startw, stopw, startt, intt, adi_mode, wcs_timestep, md, exc
 
     exclude_flags += EXCLUDE
     photons = pt.filter_photons_by_flags(photons, disallowed=exclude_flags)
+    # Coverage and exposure are per pixel, so pixels flagged for part of the interval are left out entirely
+    bad = pt.flagged_anytime(exclude_flags, startt, startt + intt)
+    pix = pt.beammap_index.pixel(photons['resID'])
+    photons = photons[(pix >= 0) & ~bad.reshape(-1)[pix]]
     getLogger(__name__).info(f"Removed {num_unfiltered - len(photons)} photons "
                              f"from {num_unfiltered} total from bad pix")
     xy = pt.xy(photons)
     wcs_times = pt.start_time + np.arange(startt, startt + intt, wcs_timestep)  # This is in unixtime
     wcs = pt.get_wcs(derotate=not adi_mode, sample_times=wcs_times)
     del pt
-    return {'file': file, 'timestamps': photons["time"], 'wavelengths': photons["wavelength"],
-            'weight': photons['weight'], 'photon_pixels': xy, 'obs_wcs_seq': wcs, 'duration': intt, 'metadata': md}
+    data = {'file': file, 'timestamps': photons["time"], 'wavelengths': photons["wavelength"],
+            'weight': photons['weight'], 'photon_pixels': xy, 'obs_wcs_seq': wcs, 'duration': intt, 'metadata': md,
+            'bad_pixel_mask': bad}
+    if cache:
+        return {'file': file, 'cache': write_dither_cache(data, cache)}
+    return data
 
 
 def load_data(dither, wvl_min, wvl_max, startt, duration, wcs_timestep, adi_mode=False, ncpu=1,
-              exclude_flags=()):
+              exclude_flags=(), cache_dir=None):
     """
-    Load the photons either by querying the photontables in parrallel or loading from pkl if it exists. The wcs
-    solutions are added to this photon data dictionary but will likely be integrated into photontable.py directly
+    Load the photons either by querying the photontables in parrallel (in threads if the photontables support concurrent
+    reads, see Photontable.concurrent_reads) or mapping them from cache_dir if it exists. The
+    wcs solutions are added to this photon data dictionary but will likely be integrated into photontable.py directly
     :param dither: MKIDDither, contains the lists of observations and metadata for a set of dithers
     :param wvl_min: minimum wavelength (in nm)
     :param wvl_max: maximum wavelength (in nm)
@@ -679,28 +1026,42 @@ def load_data(dither, wvl_min, wvl_max, startt, duration, wcs_timestep, adi_mode
     for ADI analysis
     :param ncpu: number of CPUs to use for multiprocessing
     :param exclude_flags: list of pixelflags to be excluded from analysis
+    :param cache_dir: directory in which to store the loaded data (see write_dither_cache) for later runs
     :return: list of dictionaries of relevant data and parameters
     """
     begin = time.time()
     filenames = [o.h5 for o in dither.obs]
-    meta = [Photontable(o.h5).metadata() for o in dither.obs]
+    pts = [Photontable(o.h5) for o in dither.obs]
+    meta = [pt.metadata() for pt in pts]
+    # Threads can read the photontables at once and hand the photons back without pickling them
+    threaded = ncpu >= 2 and cache_dir is None and all(pt.concurrent_reads for pt in pts)
+    del pts
     if not filenames:
         getLogger(__name__).info('No photontables found')
 
+    tmp_dir = None
+    if cache_dir is None and ncpu >= 2 and not threaded:
+        # Have the workers hand back files rather than pickling whole photon lists back to us
+        tmp_dir = cache_dir = tempfile.mkdtemp(prefix=f'drizzler_{getpass.getuser()}_',
+                                               dir=mkidpipeline.config.config.paths.tmp)
+    if cache_dir is not None:
+        os.makedirs(cache_dir, exist_ok=True)
+        stems = _cache_stems(cache_dir, filenames)
+    else:
+        stems = [None] * len(filenames)
+
     offsets = [o.start - int(o.start) for o in dither.obs]  # How many seconds into the h5 does valid data start
-    if ncpu < 2:
-        dithers_data = []
-        for file, offset, md in zip(filenames, offsets, meta):
-            data = mp_worker(file, wvl_min, wvl_max, startt + offset, duration, adi_mode, wcs_timestep, md,
-                             exclude_flags)
-            dithers_data.append(data)
+    args = [(file, wvl_min, wvl_max, startt + offset, duration, adi_mode, wcs_timestep, md, exclude_flags, stem)
+            for file, offset, md, stem in zip(filenames, offsets, meta, stems)]
+    if threaded:
+        with ThreadPoolExecutor(max_workers=ncpu) as pool:
+            dithers_data = list(pool.map(lambda a: mp_worker(*a), args))
     else:
-        # TODO result of mp_worker too big, causes issues with multiprocessing when pickling
-        p = mp.Pool(ncpu)
-        processes = [p.apply_async(mp_worker, (file, wvl_min, wvl_max, startt + offsett, duration, adi_mode,
-                                               wcs_timestep, md, exclude_flags))
-                     for file, offsett, md in zip(filenames, offsets, meta)]
-        dithers_data = [res.get() for res in processes]
+        dithers_data = pooling.pool_map(mp_worker, args, ncpu=ncpu, affinity=lambda a: a[0], star=True)
+
+    dithers_data = [map_dither_cache(d['cache']) if 'cache' in d else d for d in dithers_data]
+    if tmp_dir is not None:
+        shutil.rmtree(tmp_dir, ignore_errors=True)  # the mapped files stay valid until unmapped
 
     dithers_data.sort(key=lambda k: filenames.index(k['file']))
 
@@ -709,10 +1070,19 @@ def load_data(dither, wvl_min, wvl_max, startt, duration, wcs_timestep, adi_mode
     return dithers_data
 
 
+def load_cached_data(dither, cache_dir):
+    """Map the data cached in cache_dir by load_data for dither, raises IOError if it is missing or incomplete"""
+    filenames = [o.h5 for o in dither.obs]
+    stems = _cache_stems(cache_dir, filenames)
+    if not all(os.path.exists(stem + '.pkl') for stem in stems):
+        raise IOError(f'No complete drizzler cache in {cache_dir}')
+    return [map_dither_cache(stem) for stem in stems]
+
+
 def form(dither, mode='drizzler', wave_start=None, wave_stop=None, start=0, duration=None, pixfrac=.5,
          wvl_bin_width=0.0 * u.nm, time_bin_width=0.0, wcs_timestep=1., usecache=True, ncpu=None,
          exclude_flags=PROBLEM_FLAGS + EXCLUDE, whitelight=False, adi_mode=False, debug_dither_plot=False,
-         rate=True, output_file='', weight=False, **kwargs):
+         rate=True, output_file='', weight=False, wvl_bin_edges=None, **kwargs):
     """
     Takes in a MKIDDither object and drizzles each frame onto a common sky grid.
     :param dither: MKIDDither, contains the lists of observations and metadata for a set of dithers
@@ -736,6 +1106,8 @@ def form(dither, mode='drizzler', wave_start=None, wave_stop=None, start=0, dura
     :param debug_dither_plot: Plot the location of frames with simple boxes for calibration/debugging purposes
     :param output_file: Name of the output save file
     :param weight: If True will apply weight column of the photontable to the dither frames
+    :param wvl_bin_edges: astropy.units.Quantity - explicit (e.g. energy spaced) wavelength bin edges, overrides
+    wvl_bin_width. wave_start and wave_stop default to the outer edges
     :returns: drizzle : DrizzledData. Contains maps and metadata from the drizzled data
     """
     dcfg = mkidpipeline.config.PipelineConfigFactory(step_defaults=dict(drizzler=StepConfig()), ncpu=ncpu, cfg=None,
@@ -745,6 +1117,10 @@ def form(dither, mode='drizzler', wave_start=None, wave_stop=None, start=0, dura
     if mode not in ('drizzle'):
         raise ValueError('mode must be: drizzle')
 
+    if wvl_bin_edges is not None:
+        wave_start = wvl_bin_edges[0] if wave_start is None else wave_start
+        wave_stop = wvl_bin_edges[-1] if wave_stop is None else wave_stop
+
     dither_inttime = min(dither.inttime)
 
     # if no duration specified, use whole dither integration time
@@ -773,39 +1149,41 @@ def form(dither, mode='drizzler', wave_start=None, wave_stop=None, start=0, dura
 
     getLogger(__name__).debug('Loading data')
     dithers_data = None
+    footprints = None
     if usecache:
         settings = (tuple(o.h5 for o in dither.obs), dither.name, wave_start.value, wave_stop.value, start,
                     drizzle_params.inttime, drizzle_params.wcs_timestep, exclude_flags, adi_mode)
         setting_hash = hashlib.md5(str(settings).encode()).hexdigest()
-        pkl_save = os.path.join(mkidpipeline.config.config.paths.tmp,
-                                f'drizzler_{getpass.getuser()}_{dither.name}_{setting_hash}.pkl')
+        cache_dir = os.path.join(mkidpipeline.config.config.paths.tmp,
+                                 f'drizzler_{getpass.getuser()}_{dither.name}_{setting_hash}')
+        # Footprints depend only on the WCS solutions, pixfrac, and canvas, so they are shared between outputs
+        footprints = drizzling.FootprintCache(os.path.join(mkidpipeline.config.config.paths.tmp,
+                                                           f'drizzler_{getpass.getuser()}_footprints'))
 
         if dcfg.drizzler.clearcache:
-            getLogger(__name__).info('Clearing drizzler cache')
-            for f in glob(os.path.join(mkidpipeline.config.config.paths.tmp, f'drizzler_{getpass.getuser()}_*.pkl')):
-                try:
-                    os.remove(f)
-                except IOError:
-                    getLogger(__name__).error(f'Unable to remove {f} from cache')
+            # Only this output's data, other runs may be using theirs. Footprints are keyed by their geometry so are
+            # never stale, a run that finds one removed just recomputes it.
+            getLogger(__name__).info(f'Clearing drizzler cache {cache_dir}')
+            footprints.clear()
+            try:
+                shutil.rmtree(cache_dir)
+            except FileNotFoundError:
+                pass
+            except IOError:
+                getLogger(__name__).error(f'Unable to remove {cache_dir} from cache')
         else:
             try:
-                with open(pkl_save, 'rb') as f:
-                    dithers_data = pickle.load(f)
-                    getLogger(__name__).info(f'Using cached data {pkl_save}')
+                dithers_data = load_cached_data(dither, cache_dir)
+                getLogger(__name__).info(f'Using cached data {cache_dir}')
             except IOError:
                 pass
 
     if dithers_data is None:
         dithers_data = load_data(dither, wave_start, wave_stop, start, drizzle_params.inttime,
                                  drizzle_params.wcs_timestep, ncpu=ncpu, exclude_flags=exclude_flags,
-                                 adi_mode=adi_mode)
+                                 adi_mode=adi_mode, cache_dir=cache_dir if usecache else None)
         if usecache:
-            try:
-                with open(pkl_save, 'wb') as handle:
-                    getLogger(__name__).info(f'Saved data cache to {pkl_save}')
-                    pickle.dump(dithers_data, handle, protocol=pickle.HIGHEST_PROTOCOL)
-            except IOError:
-                getLogger(__name__).warning(f'Unable to write cache {pkl_save}', exc_info=True)
+            getLogger(__name__).info(f'Saved data cache to {cache_dir}')
 
     total_photons = sum([len(dither_data['timestamps']) for dither_data in dithers_data])
 
@@ -820,21 +1198,28 @@ def form(dither, mode='drizzler', wave_start=None, wave_stop=None, start=0, dura
     getLogger(__name__).debug('Initializing drizzler core')
     getLogger(__name__).debug('Running Drizzler')
     driz = Drizzler(dithers_data, drizzle_params, wvl_bin_width=wvl_bin_width, time_bin_width=time_bin_width,
-                    wvl_min=wave_start, wvl_max=wave_stop, adi_mode=adi_mode, rate=rate)
+                    wvl_min=wave_start, wvl_max=wave_stop, adi_mode=adi_mode, rate=rate, ncpu=ncpu,
+                    footprints=footprints, event_mode=dcfg.drizzler.event_drizzle, wvl_bin_edges=wvl_bin_edges)
 
-    if time_bin_width != 0.0 and wvl_bin_width != 0.0 * u.nm:
+    wave_cube = wvl_bin_width != 0.0 * u.nm or (wvl_bin_edges is not None and len(wvl_bin_edges) > 2)
+    if time_bin_width != 0.0 and wave_cube:
         cube_type = 'both'
     elif time_bin_width != 0.0:
         cube_type = 'time'
-    elif wvl_bin_width != 0.0 * u.nm:
+    elif wave_cube:
         cube_type = 'wave'
     else:
         cube_type = None
     time_bin_edges = driz.timebins
     wvl_bin_edges = driz.wvl_bin_edges
     getLogger(__name__).debug('Drizzling...')
-    driz.run(apply_weight=weight)
-    if output_file:
+    if output_file and dcfg.drizzler.stream_output:
+        getLogger(__name__).debug(f'Streaming fits cube of type {cube_type}.')
+        driz.run(apply_weight=weight, output_file=output_file, cube_type=cube_type)
+    else:
+        driz.run(apply_weight=weight)
+    getLogger(__name__).debug(f'Drizzle footprints: {driz.footprints.hits} cached, {driz.footprints.misses} computed')
+    if output_file and not dcfg.drizzler.stream_output:
         getLogger(__name__).debug(f'Writing fits cube of type {cube_type}.')
         driz.write(output_file, cube_type=cube_type, time_bin_edges=time_bin_edges, wvl_bin_edges=wvl_bin_edges)
     getLogger(__name__).info('Finished')
@@ -1,5 +1,4 @@
 import os
-import multiprocessing as mp
 import time
 import matplotlib.pyplot as plt
 import numpy as np
@@ -8,9 +7,10 @@ from mpl_toolkits.axes_grid1 import make_axes_locatable
 
 import mkidpipeline.definitions as definitions
 from mkidpipeline.steps import wavecal
-from mkidpipeline.photontable import Photontable
+from mkidpipeline.photontable import Photontable, open_photontable
 from mkidcore.corelog import getLogger
 import mkidpipeline.config
+from mkidpipeline.utils import memory, pooling, tracing
 from mkidpipeline.config import H5Subset
 from mkidcore.pixelflags import FlagSet
 import warnings
@@ -89,6 +89,9 @@ FLAGS = FlagSet.define(
     ('not_all_weights_valid', 1, 'at least one of the wavelength weights is invalid')
 )
 
+# Rows of the photon table processed per block when applying a flat, ~20 bytes per row
+APPLY_BLOCK_ROWS = 10_000_000
+
 PROBLEM_FLAGS = ('pixcal.dead', 'beammap.noDacTone', 'wavecal.bad', 'wavecal.failed_convergence',
                  'wavecal.no_histograms', 'wavecal.not_attempted', 'flatcal.bad')
 
@@ -289,7 +292,7 @@ class WhiteCalibrator(FlatCalibrator):
         else:
             time_edges = np.arange(self.cfg.flatcal.nchunks + 1, dtype=float) * self.cfg.flatcal.chunk_time
 
-        pt = Photontable(self.h5s.timerange.h5)
+        pt = open_photontable(self.h5s.timerange.h5)
         if not pt.wavelength_calibrated:
             raise RuntimeError('Photon data is not wavelength calibrated.')
 
@@ -309,7 +312,9 @@ class WhiteCalibrator(FlatCalibrator):
         getLogger(__name__).info(f'Loaded spectral cubes')
         self.spectral_cube = cps_cube_list  # n_times, x, y, n_wvls
         self.int_time = time_edges[1] - time_edges[0]
-        self.mask = pt.flagged(PROBLEM_FLAGS)[..., None] * np.ones(self.wavelengths.size, dtype=bool)
+        # Pixels flagged for only part of the exposure are left out too, their weights would rest on less data
+        self.mask = (pt.flagged_anytime(PROBLEM_FLAGS, time_edges[0], time_edges[-1])[..., None] *
+                     np.ones(self.wavelengths.size, dtype=bool))
 
 
 class LaserCalibrator(FlatCalibrator):
@@ -361,7 +366,7 @@ class LaserCalibrator(FlatCalibrator):
 
             getLogger(__name__).info(f'Loaded {wvl.value:.1f} nm spectral cube')
             cps_cube_list[:, :, :, w_idx] = hdul['SCIENCE'].data
-            self.mask[:, :, w_idx] = pt.flagged(PROBLEM_FLAGS)
+            self.mask[:, :, w_idx] = pt.flagged_anytime(PROBLEM_FLAGS, 0, flat_duration[w_idx])
         self.spectral_cube = cps_cube_list
         self.int_time = self.cfg.flatcal.chunk_time
         # self.mask = pt.flagged(PROBLEM_FLAGS)[..., None] * np.ones(self.wavelengths.size, dtype=bool)
@@ -381,6 +386,7 @@ class FlatSolution(object):
         self.flat_flags = flat_flags
         self.flat_weight_err = flat_weight_err
         self.coeff_array = coeff_array
+        self._coeffs = None
         self._file_path = os.path.abspath(file_path) if file_path is not None else file_path
         # if we've specified a file load it without overloading previously set arguments
         if self._file_path is not None:
@@ -427,6 +433,7 @@ class FlatSolution(object):
         self.flat_weight_err = self.npz['flat_weight_err']
         self.wavelengths = self.npz['wavelengths']
         self.flat_flags = self.npz['flat_flags']
+        self._coeffs = None  # lookup tables are rebuilt on next use
         if overload:  # properties grab from self.npz if set to none
             for attr in keys:
                 setattr(self, attr, None)
@@ -434,13 +441,64 @@ class FlatSolution(object):
         self.name = os.path.splitext(os.path.basename(file_path))[0]  # new name for saving
         getLogger(__name__).info("Complete")
 
+    def _build_lookup(self):
+        """
+        Build the resID -> row lookup table and the dense (npixel, power + 1) coefficient array used by get and
+        evaluate. Rows are in beammap raveled order, so row = x * ny + y.
+        """
+        beammap = np.asarray(self.beammap).astype(int)
+        coeffs = np.asarray(self.coeff_array, dtype=float)
+        self._coeffs = np.ascontiguousarray(coeffs.reshape(-1, coeffs.shape[-1]))
+        self._has_soln = (self._coeffs != 0).any(axis=1)
+        flat = beammap.ravel()
+        order = np.argsort(flat, kind='stable')
+        # for non unique resIDs the first occurrence in beammap order wins, as before
+        keep = np.ones(order.size, dtype=bool)
+        keep[1:] = flat[order][1:] != flat[order][:-1]
+        self._lut_resids = flat[order][keep]
+        self._lut_rows = order[keep]
+
+    def rows(self, resids):
+        """Return the coefficient row for each resID in resids, -1 where the resID is not in the beammap"""
+        if getattr(self, '_coeffs', None) is None:
+            self._build_lookup()
+        resids = np.asarray(resids)
+        ind = np.searchsorted(self._lut_resids, resids).clip(max=self._lut_resids.size - 1)
+        return np.where(self._lut_resids[ind] == resids, self._lut_rows[ind], -1)
+
+    def has_solution(self, resids):
+        """Return a boolean array that is True where a resID has a (non-zero) flat solution"""
+        rows = self.rows(resids)
+        return (rows >= 0) & self._has_soln[rows]
+
     def get(self, pixel=None, res_id=None):
         if not pixel and not res_id:
             raise ValueError('Need to specify either resID or pixel coordinates')
-        for pix, res in np.ndenumerate(self.beammap):
-            if res == res_id or pix == pixel:  # in case of non unique resIDs
-                coeffs = self.coeff_array[pix[0], pix[1]]
-                return np.poly1d(coeffs)
+        if getattr(self, '_coeffs', None) is None:
+            self._build_lookup()
+        if res_id is not None:
+            row = int(self.rows(res_id))
+            if row < 0:
+                return None
+        else:
+            row = np.ravel_multi_index(pixel, self.beammap.shape)
+        return np.poly1d(self._coeffs[row])
+
+    def evaluate(self, resids, wavelengths):
+        """
+        Vectorized evaluation of the flat weight for each (resID, wavelength) pair, e.g. for a block of the
+        resID and wavelength columns of a photon table. Returns NaN for resIDs without a flat solution.
+        """
+        rows = self.rows(resids)
+        valid = (rows >= 0) & self._has_soln[rows]
+        coeffs = self._coeffs[rows]
+        wavelengths = np.asarray(wavelengths, dtype=float)
+        weights = np.zeros(wavelengths.shape)
+        for i in range(coeffs.shape[1]):  # Horner's method, highest power first as in np.poly1d
+            weights *= wavelengths
+            weights += coeffs[:, i]
+        weights[~valid] = np.nan
+        return weights
 
     def plot_summary(self, save_plot=True):
         """ Writes a summary plot of the Flat Fielding """
@@ -508,7 +566,8 @@ class FlatSolution(object):
 
 def _run(flattner):
     getLogger(__name__).debug('Calling run on {}'.format(flattner))
-    flattner.run()
+    with memory.reservation_priority(memory.PRIORITY_CALIBRATION):
+        flattner.run()
 
 
 def load_solution(sc, singleton_ok=True):
@@ -559,14 +618,7 @@ def fetch(solution_descriptors, config=None, ncpu=None, remake=False):
         return solutions
 
     poolsize = mkidpipeline.config.n_cpus_available(max=min(fcfg.get('flatcal.ncpu', inherit=True), len(flattners)))
-    if poolsize == 1:
-        for f in flattners:
-            f.run()
-    else:
-        pool = mp.Pool(poolsize)
-        pool.map(_run, flattners)
-        pool.close()
-        pool.join()
+    pooling.pool_map(_run, flattners, ncpu=poolsize)
 
     return solutions
 
@@ -610,42 +662,43 @@ def apply(o: definitions.MKIDObservation, config=None):
         mask = (calsoln.flat_flags & flag.bitmask) > 0
         of.flag(mask * of.flags.bitmask([f'flatcal.{flag.name}'], unknown='warn'))
 
-    n_todo = len(list(of.resonators(exclude=PROBLEM_FLAGS)))
+    good = of.good_resids(PROBLEM_FLAGS)
+    n_todo = good.size
     if not n_todo:
         getLogger(__name__).warning(f'Done. There were no unflagged pixels.')
         return
 
     getLogger(__name__).info(f'Applying flat weights to {n_todo} unflagged pixels ('
                              f'{100 * (n_todo / calsoln.beammap.size):.2f} % of pixels).')
-    with of.needed_ram():
-        counter = 0
-        for pixel, resid in of.resonators(exclude=PROBLEM_FLAGS, pixel=True):
-            soln = calsoln.get(pixel=pixel, res_id=resid)
-            if not soln:
-                counter += 1
-                getLogger(__name__).debug('No flat calibration for good pixel {}'.format(resid))
-                continue
-            indices = of.photonTable.get_where_list('resID==resid')
-            if not indices.size:
-                continue
-
+    has_soln = calsoln.has_solution(good)
+    for resid in good[~has_soln]:
+        getLogger(__name__).debug('No flat calibration for good pixel {}'.format(resid))
+    to_apply = np.sort(good[has_soln])
+
+    with of.needed_ram('flatcal.apply'):
+        # Process the table in blocks of whole columns rather than querying pixel by pixel, the table need not be
+        # sorted by resID for this to be efficient.
+        nrows = len(of.photonTable)
+        block = max(of.photonTable.chunkshape[0], (APPLY_BLOCK_ROWS // of.photonTable.chunkshape[0]) *
+                    of.photonTable.chunkshape[0])
+        for start in range(0, nrows, block):
             tic2 = time.time()
-
-            if (np.diff(indices) == 1).all():  # This takes ~300s for ALL photons combined on a 70Mphot file.
-                wave = of.photonTable.read(start=indices[0], stop=indices[-1] + 1, field='wavelength')
-                weights = soln(wave) * of.photonTable.read(start=indices[0], stop=indices[-1] + 1, field='weight')
-                weights = weights.clip(0)  # enforce positive weights only
-                of.photonTable.modify_column(start=indices[0], stop=indices[-1] + 1, column=weights, colname='weight')
-            else:  # This takes 3.5s per pixel on a 70 Mphot file!!!
-                # raise NotImplementedError('This code path is impractically slow at present.')
-                getLogger(__name__).debug('Using modify_coordinates')
-                rows = of.photonTable.read_coordinates(indices)
-                rows['weight'] *= soln(rows['wavelength'])
-                of.photonTable.modify_coordinates(indices, rows)
-                getLogger(__name__).debug('Flat weights updated in {:.2f}s'.format(time.time() - tic2))
-    getLogger(__name__).info(f'No flat calibration for '
-                             f'{(counter / len(list(of.resonators(exclude=PROBLEM_FLAGS, pixel=True)))) * 100:.2f} % '
-                             f'good pixels ')
+            stop = min(start + block, nrows)
+            rows = of.photonTable.read(start=start, stop=stop)
+            # Photons from times a good pixel had a problem flag are excluded downstream, so they aren't weighted
+            use = np.isin(rows['resID'], to_apply) & ~of.interval_mask(rows, PROBLEM_FLAGS)
+            if not use.any():
+                continue
+            weights = rows['weight']
+            weights[use] *= calsoln.evaluate(rows['resID'][use], rows['wavelength'][use])
+            weights[use] = weights[use].clip(0)  # enforce positive weights only
+            of.photonTable.modify_column(start=start, stop=stop, column=weights, colname='weight')
+            tracing.count('photons', rows.size)
+            tracing.count('bytes_read', rows.nbytes)
+            tracing.count('bytes_written', weights.nbytes)
+            getLogger(__name__).debug(f'Flat weights updated for rows {start}-{stop} in {time.time() - tic2:.2f}s')
+        of.photonTable.flush()
+    getLogger(__name__).info(f'No flat calibration for {(1 - has_soln.mean()) * 100:.2f} % good pixels ')
     of.update_header('flatcal', calsoln.name)
     try:
         assert calsoln.name == o.flatcal.id.strip('.npz')  #DO NOT REMOVE
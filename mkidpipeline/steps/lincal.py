@@ -15,6 +15,7 @@ import mkidpipeline.definitions as definitions
 from mkidcore.corelog import getLogger
 import mkidpipeline.config
 from mkidpipeline.photontable import Photontable
+from mkidpipeline.utils import tracing
 
 
 class StepConfig(mkidpipeline.config.BaseStepConfig):
@@ -59,7 +60,8 @@ def apply(o: definitions.MKIDTimerange, config=None):
     of.photonTable.autoindex = False
     tic = time.time()
 
-    n_to_do = np.count_nonzero(~of.flagged(PROBLEM_FLAGS, all_flags=False))
+    good = of.good_resids(PROBLEM_FLAGS)
+    n_to_do = good.size
     lastpct = 0
 
     if cfg.get('lincal.ncpu') > 1:
@@ -70,7 +72,7 @@ def apply(o: definitions.MKIDTimerange, config=None):
 
     #Not ram intensive ~250MB peak
 
-    for done, resid in bar(enumerate(of.resonators(exclude=PROBLEM_FLAGS))):
+    for done, resid in bar(enumerate(good)):
         indices = of.photonTable.get_where_list('resID==resid')
         if not indices.size:
             continue
@@ -92,11 +94,17 @@ def apply(o: definitions.MKIDTimerange, config=None):
             new = of.photonTable.read(start=indices[0], stop=indices[-1] + 1, field='weight')
             new *= calculate_weights(times, cfg.lincal.dt, cfg.instrument.deadtime_us)
             of.photonTable.modify_column(start=indices[0], stop=indices[-1] + 1, column=new, colname='weight')
+            tracing.count('photons', new.size)
+            tracing.count('bytes_read', times.nbytes + new.nbytes)
+            tracing.count('bytes_written', new.nbytes)
         else:
             getLogger(__name__).warning('Using modify_coordinates, this is very slow')
             photons = of.photonTable.read_coordinates(indices)
             photons['weight'] *= calculate_weights(photons['time'], cfg.lincal.dt, cfg.instrument.deadtime_us)
             of.photonTable.modify_coordinates(indices, photons)
+            tracing.count('photons', photons.size)
+            tracing.count('bytes_read', photons.nbytes)
+            tracing.count('bytes_written', photons.nbytes)
 
         pct = np.round(done/n_to_do, 2)
         if pct and lastpct != pct and pct % .1 == 0:
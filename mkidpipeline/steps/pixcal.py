@@ -18,6 +18,10 @@ times the standard deviation of the pixels in that window, the pixel is flagged
 `n_sigma` times the standard deviation above the filtered image. If so, then that pixel is flagged as `hot`. Conversely,
 if that pixel has counts lower than `n_sigma` times the standard deviation of the filtered image, the pixel is flagged
 as `cold`. If the pixel has identically 0 counts then it is flagged as `dead`
+
+Each method is run on every `step` long time slice of the exposure. Pixels that are bad in every slice have the flag set
+in the beammap flags. The remaining bad slices are stored as run-length encoded time intervals in the h5's time-resolved
+flags, so only the photons that arrived while the pixel was bad are excluded by queries and FITS generation.
 """
 
 import warnings
@@ -58,7 +62,8 @@ class StepConfig(mkidpipeline.config.BaseStepConfig):
                      ('remake', False, 'Remake the calibration even if it exists'),
                      ('n_sigma', 5.0, 'number of standard deviations above/below the expected value for which a pixel'
                                       ' will be flagged as hot/cold'),
-                     ('plots', 'none', 'none|last|all')
+                     ('plots', 'none', 'none|last|all'),
+                     ('ncpu', 1, 'Number of threads to split the time slices over')
                      )
 
 
@@ -67,7 +72,92 @@ FLAGS = FlagSet.define(('hot', 1, 'Hot pixel'),
                        ('dead', 3, 'Dead pixel'))
 
 
-def threshold(image, dead_mask=None, fwhm=4, box_size=5, n_sigma=5.0, max_iter=5, mu=None):
+def _as_stack(image, dead_mask):
+    """
+    Return image as a float (n_slice, n_row, n_col) stack with the dead pixels set to NaN, a per-slice dead mask and
+    whether image was a single 2D image. A float64 stack is modified in place.
+    """
+    if dead_mask is None:
+        getLogger(__name__).warning('No dead mask provided - if the image contains dead pixels, the amount of hot and '
+                                    'cold pixels may be overestimated!')
+        dead_mask = np.zeros(np.shape(image)[-2:], dtype=bool)
+    elif not dead_mask.any():
+        getLogger(__name__).warning('Dead pixel mask all False! Make sure you expect no dead pixels in the '
+                                    'array or that you are specifying the correct beammap for this dataset!')
+    single = np.ndim(image) == 2
+    raw_image = np.asarray(image, dtype=float)
+    if single:
+        raw_image = raw_image[None]
+    raw_image[:, dead_mask] = np.nan
+    dead = np.repeat(dead_mask[None], len(raw_image), axis=0)
+    return raw_image, dead, single
+
+
+def _empty_slices(raw_image):
+    """Slices that consist entirely of pixels with 0 counts"""
+    empty = np.nansum(raw_image, axis=(1, 2)) <= 0
+    if empty.any():
+        getLogger(__name__).warning(f'{empty.sum()} time slice(s) consist entirely of pixels with 0 counts')
+    return empty
+
+
+def _iterate(raw_image, active, max_iter, detect):
+    """
+    Iteratively flag the slices of raw_image (n_slice, n_row, n_col) listed in active. Each iteration calls
+    detect(images, slices) on the slices that have not yet converged, ORs the returned (hot, cold) masks into the
+    previous ones and NaNs the flagged pixels. A slice stops iterating once an iteration no longer changes its masks.
+
+    :return: hot mask, cold mask, number of iterations performed for each slice
+    """
+    hot_mask = np.zeros(raw_image.shape, dtype=bool)
+    cold_mask = np.zeros(raw_image.shape, dtype=bool)
+    num_iter = np.zeros(len(raw_image), dtype=int)
+    for iteration in range(max_iter):
+        if not active.size:
+            break
+        getLogger(__name__).info(f'Performing iteration: {iteration + 1} on {active.size} time slice(s)')
+        hot, cold = detect(raw_image[active], active)
+        hot |= hot_mask[active]
+        cold |= cold_mask[active]
+        num_iter[active] = iteration + 1
+        # If no change between between this and the last iteration then stop iterating that slice
+        changed = (hot != hot_mask[active]).any(axis=(1, 2)) | (cold != cold_mask[active]).any(axis=(1, 2))
+        hot_mask[active] = hot
+        cold_mask[active] = cold
+        active = active[changed]
+        # Set all detected bad pixels to NaN for the next iteration
+        images = raw_image[active]
+        images[hot_mask[active] | cold_mask[active]] = np.nan
+        raw_image[active] = images
+    # Make sure a pixel is not simultaneously hot and cold
+    assert ~(hot_mask & cold_mask).any()
+    return hot_mask, cold_mask, num_iter
+
+
+def _fill_nans(images, box_size, ncpu):
+    """Remove all the NaNs in the images by replacing them with the mean of the surrounding box_size x box_size box"""
+    with warnings.catch_warnings():
+        warnings.filterwarnings("ignore", category=RuntimeWarning)
+        nan_fixed_image = smoothing.map_slices(lambda x: smoothing.replace_nan_stack(x, box_size=box_size),
+                                               images, ncpu=ncpu)
+    assert np.all(np.isfinite(nan_fixed_image))
+    return nan_fixed_image
+
+
+def _median_filter(images, box_size, ncpu):
+    """Each pixel takes the median of itself and the surrounding box_size x box_size box, slice by slice"""
+    return smoothing.map_slices(lambda x: spfilters.median_filter(x, (1, box_size, box_size), mode='mirror'),
+                                images, ncpu=ncpu)
+
+
+def _result(hot_mask, cold_mask, dead_mask, raw_image, num_iter, single):
+    if single:
+        return {'hot': hot_mask[0], 'cold': cold_mask[0], 'dead': dead_mask[0], 'masked_image': raw_image[0],
+                'num_iter': int(num_iter[0])}
+    return {'hot': hot_mask, 'cold': cold_mask, 'dead': dead_mask, 'masked_image': raw_image, 'num_iter': num_iter}
+
+
+def threshold(image, dead_mask=None, fwhm=4, box_size=5, n_sigma=5.0, max_iter=5, mu=None, ncpu=1):
     """
     Compares the ratio of flux in each pixel to the median of the flux in an enclosing box. If the ratio is too high
      -- i.e. the flux is too tightly distributed compared to a Gaussian PSF of the expected FWHM -- then the pixel is
@@ -82,7 +172,8 @@ def threshold(image, dead_mask=None, fwhm=4, box_size=5, n_sigma=5.0, max_iter=5
     If the threshold is *lower* than the background, then set it equal to the background level instead
     (a pixel below the background level is unlikely to be hot!)
 
-    :param image: 2D image array of photons (in counts)
+    :param image: 2D image array of photons (in counts) or a (time, x, y) stack of them, each slice is treated
+     independently
     :param dead_mask: boolean dead pixel mask
     :param fwhm: estimated full-width-half-max of the PSF (in pixels)
     :param box_size: in pixels
@@ -91,6 +182,7 @@ def threshold(image, dead_mask=None, fwhm=4, box_size=5, n_sigma=5.0, max_iter=5
     :param max_iter: maximum number of iterations
     :param mu: average expected number of counts for exposure - used to generate Poisson probability of getting a
     certain number of photons in a given pixel
+    :param ncpu: number of threads to split the time slices over
     :return:
     A dictionary containing the result and various diagnostics. Keys are:
     'hot': boolean mask of hot pixels
@@ -98,99 +190,71 @@ def threshold(image, dead_mask=None, fwhm=4, box_size=5, n_sigma=5.0, max_iter=5
     'masked_image': The hot and dead pixel masked image
     'input_image': original input image
     'num_iter': number of iterations performed.
+    For a stack each entry has a leading time axis.
     """
-    if not dead_mask.any():
-        getLogger(__name__).warning('Dead pixel mask all False! Make sure you expect no dead pixels in the '
-                                    'array or that you are specifying the correct beammap for this dataset!')
-    raw_image = image
+    raw_image, dead_mask, single = _as_stack(image, dead_mask)
     # Approximate peak/median ratio for an ideal (Gaussian) PSF sampled at
     # pixel locations corresponding to the median kernel used with the real data.
     gauss_array = fitting.gaussian_psf(fwhm, box_size)
     max_ratio = np.max(gauss_array) / np.median(gauss_array)
 
-    # turn dead pixel values into NaNs
-    if dead_mask is not None:
-        raw_image[dead_mask] = np.nan
-    else:
-        getLogger(__name__).warning('No dead mask provided - if the image contains dead pixels, the amount of hot and '
-                                    'cold pixels may be overestimated!')
-        dead_mask = np.zeros_like(raw_image, dtype=bool)
+    active = np.flatnonzero(~_empty_slices(raw_image))
     # get median count rate for Poisson distribution if one not given. Minimum value of 1
     if mu is None:
-        mu = np.max((np.nanmedian(raw_image), 1))
+        with warnings.catch_warnings():
+            warnings.filterwarnings("ignore", category=RuntimeWarning)
+            mu = np.maximum(np.nanmedian(raw_image, axis=(1, 2)), 1)
+    mu = np.broadcast_to(mu, (len(raw_image),))
 
-    # Initialise a mask for hot pixels (all False) for comparison on each iteration.
-    reference_hot_mask = np.zeros_like(raw_image, dtype=bool)
-    reference_cold_mask = np.zeros_like(raw_image, dtype=bool)
-    hot_mask = np.zeros_like(raw_image, dtype=bool)
-    cold_mask = np.zeros_like(raw_image, dtype=bool)
+    # If threshold or standard deviation values are below what makes sense given Poisson statistics then modify
+    poisson_threshold = np.max(poisson.interval(0.95, mu=mu), axis=0)[:, None, None]
+    poisson_std = poisson.std(mu=mu)[:, None, None]
 
-    if raw_image[np.isfinite(raw_image)].sum() <= 0:
-        getLogger(__name__).warning('Entire image consists of pixels with 0 counts')
-        iteration = -1
-    else:
-        for iteration in range(max_iter):
-            getLogger(__name__).info(f'Performing iteration: {iteration + 1}')
-            with warnings.catch_warnings():
-                warnings.filterwarnings("ignore", category=RuntimeWarning)
-                nan_fixed_image = smoothing.replace_nan(raw_image, mode='mean', box_size=box_size)
-            assert np.all(np.isfinite(nan_fixed_image))
-            median_filter_image = spfilters.median_filter(nan_fixed_image, box_size, mode='mirror')
-            median_bkgd = np.nanmedian(raw_image)
-
-            # Estimate the background std. dev.
-            std_filter_image = smoothing.nearest_n_robust_sigma_filter(raw_image, n=box_size ** 2 - 1)
-
-            threshold = max_ratio * median_filter_image - (max_ratio - 1) * median_bkgd
-            idx = np.where(threshold < median_bkgd)
-            threshold[idx] = median_bkgd
-
-            # If threshold or standard deviation values are below what makes sense given Poisson statistics then modify
-            poisson_threshold = np.max(poisson.interval(0.95, mu=mu))
-            poisson_std = poisson.std(mu=mu)
-            std_filter_image[std_filter_image < poisson_std] = poisson_std
-            threshold[threshold < poisson_threshold] = poisson_threshold
-
-            hot_difference_image = raw_image - threshold
-            cold_difference_image = raw_image - median_filter_image
-
-            # Any pixel that has a peak/median ratio more than n_sigma above the maximum ratio should be flagged as hot
-            # Any pixel that has a value less than n_sigma below the median should be flagged as cold
-            hot_mask = (hot_difference_image > (n_sigma * std_filter_image)) | reference_hot_mask
-            cold_mask = (cold_difference_image < -(n_sigma * std_filter_image)) | reference_cold_mask
-
-            # If no change between between this and the last iteration then stop iterating
-            if np.all(hot_mask == reference_hot_mask) and np.all(cold_mask == reference_cold_mask):
-                break
-
-            reference_cold_mask = np.copy(cold_mask)
-            reference_hot_mask = np.copy(hot_mask)
-            raw_image[hot_mask] = np.nan
-            raw_image[cold_mask] = np.nan
-            if iteration == max_iter:
-                getLogger(__name__).info(
-                    f'Reached max number of iterations ({max_iter}) - Increase max iterations to ensure'
-                    ' all hot pixels are masked or check your data for excessive'
-                    ' outliers')
-        # make sure a pixel is not simultaneously hot and cold
-        assert ~(hot_mask & cold_mask).any()
-    getLogger(__name__).info(f'Masked {len(hot_mask[hot_mask != False])} hot pixels,'
-                             f' {len(cold_mask[cold_mask != False])} cold pixels,'
-                             f' {len(dead_mask[dead_mask != False])} dead pixels')
-    return {'hot': hot_mask, 'cold': cold_mask, 'dead': dead_mask, 'masked_image': raw_image,
-            'num_iter': iteration + 1}
-
-
-def median(image, dead_mask=None, box_size=5, n_sigma=5.0, max_iter=5):
+    def detect(images, slices):
+        nan_fixed_image = _fill_nans(images, box_size, ncpu)
+        median_filter_image = _median_filter(nan_fixed_image, box_size, ncpu)
+        median_bkgd = np.nanmedian(images, axis=(1, 2))[:, None, None]
+
+        # Estimate the background std. dev.
+        std_filter_image = smoothing.nearest_n_robust_sigma_filter_stack(images, n=box_size ** 2 - 1, ncpu=ncpu)
+
+        threshold = max_ratio * median_filter_image - (max_ratio - 1) * median_bkgd
+        threshold = np.where(threshold < median_bkgd, median_bkgd, threshold)
+
+        std_filter_image = np.where(std_filter_image < poisson_std[slices], poisson_std[slices], std_filter_image)
+        threshold = np.where(threshold < poisson_threshold[slices], poisson_threshold[slices], threshold)
+
+        hot_difference_image = images - threshold
+        cold_difference_image = images - median_filter_image
+
+        # Any pixel that has a peak/median ratio more than n_sigma above the maximum ratio should be flagged as hot
+        # Any pixel that has a value less than n_sigma below the median should be flagged as cold
+        return (hot_difference_image > (n_sigma * std_filter_image),
+                cold_difference_image < -(n_sigma * std_filter_image))
+
+    hot_mask, cold_mask, num_iter = _iterate(raw_image, active, max_iter, detect)
+    if (num_iter == max_iter).any():
+        getLogger(__name__).info(f'Reached max number of iterations ({max_iter}) in {(num_iter == max_iter).sum()} '
+                                 f'time slice(s) - Increase max iterations to ensure all hot pixels are masked or '
+                                 f'check your data for excessive outliers')
+    getLogger(__name__).info(f'Masked {hot_mask.sum()} hot pixels,'
+                             f' {cold_mask.sum()} cold pixels,'
+                             f' {dead_mask.sum()} dead pixels')
+    return _result(hot_mask, cold_mask, dead_mask, raw_image, num_iter, single)
+
+
+def median(image, dead_mask=None, box_size=5, n_sigma=5.0, max_iter=5, ncpu=1):
     """
     Passes a box_size by box_size moving box over the entire array and checks if the pixel at the center of that window
     has counts higher than the median plus n_sigma times the standard deviation of the pixels in that window
 
-    :param image: 2D image array of photons (in counts)
+    :param image: 2D image array of photons (in counts) or a (time, x, y) stack of them, each slice is treated
+     independently
     :param box_size: in pixels
     :param n_sigma: number of standard deviations above/below the expected value for which a pixel will be flagged as
      'hot'/'cold'
     :param max_iter: maximum number of iterations
+    :param ncpu: number of threads to split the time slices over
 
     :return:
     A dictionary containing the result and various diagnostics. Keys are:
@@ -199,74 +263,39 @@ def median(image, dead_mask=None, box_size=5, n_sigma=5.0, max_iter=5):
     'masked_image': The hot and dead pixel masked image
     'input_image': original input image
     'num_iter': number of iterations performed.
+    For a stack each entry has a leading time axis.
     """
-    if not dead_mask.any():
-        getLogger(__name__).warning('Dead pixel mask all False! Make sure you expect no dead pixels in the '
-                                    'array or that you are specifying the correct beammap for this dataset!')
-    raw_image = image
-
     # Assume everything with 0 counts is a dead pixel, turn dead pixel values into NaNs
-    raw_image[dead_mask] = np.nan
-
-    # Initialise a mask for hot pixels (all False) for comparison on each iteration.
-    reference_hot_mask = np.zeros(shape=np.shape(raw_image), dtype=bool)
-    hot_mask = np.zeros(shape=np.shape(raw_image), dtype=bool)
-    reference_cold_mask = np.zeros(shape=np.shape(raw_image), dtype=bool)
-    cold_mask = np.zeros(shape=np.shape(raw_image), dtype=bool)
-
-    # Initialise some arrays with NaNs in case they don't get filled out during the iteration
-    median_filter_image = np.zeros_like(raw_image)
-    median_filter_image.fill(np.nan)
-    iteration = -1
-
-    if raw_image[np.isfinite(raw_image)].sum() <= 0:
-        getLogger(__name__).warning('Entire image consists of pixels with 0 counts')
-        dead_mask = np.ones_like(raw_image, dtype=bool)
-        iteration = -1
-    else:
-        for iteration in range(max_iter):
-            getLogger(__name__).info(f'Performing iteration: {iteration + 1}')
-            # Remove all the NaNs in an image and calculate a median filtered image
-            # each pixel takes the median of itself and the surrounding box_size x box_size box.
-            with warnings.catch_warnings():
-                warnings.filterwarnings("ignore", category=RuntimeWarning)
-                nan_fixed_image = smoothing.replace_nan(raw_image, mode='mean', box_size=box_size)
-            assert np.all(np.isfinite(nan_fixed_image))
-            median_filter_image = spfilters.median_filter(nan_fixed_image, box_size, mode='mirror')
-            func = lambda x: np.nanstd(x) * _stddev_bias_corr((~np.isnan(x)).sum())
-            std_filter_image = spfilters.generic_filter(nan_fixed_image, func, box_size, mode='mirror')
-
-            hot_threshold = median_filter_image + (n_sigma * std_filter_image)
-            cold_threshold = median_filter_image - (n_sigma * std_filter_image)
-
-            hot_mask = (raw_image > hot_threshold) | reference_hot_mask
-            cold_mask = (raw_image < cold_threshold) | reference_cold_mask
-
-            # If no change between between this and the last iteration then stop iterating
-            if np.all(hot_mask == reference_hot_mask) and np.all(cold_mask == reference_cold_mask): break
-
-            # Otherwise update 'reference_hot_mask' and set all detected bad pixels to NaN for the next iteration
-            reference_hot_mask = np.copy(hot_mask)
-            raw_image[hot_mask] = np.nan
-
-            reference_cold_mask = np.copy(cold_mask)
-            raw_image[cold_mask] = np.nan
-
-        # Make sure a pixel is not simultaneously hot and cold
-        assert ~(hot_mask & cold_mask).any()
-    getLogger(__name__).info(f'Masked {len(hot_mask[hot_mask != False])} hot pixels and'
-                             f' {len(hot_mask[cold_mask != False])} cold pixels')
-    return {'hot': hot_mask, 'cold': cold_mask, 'dead': dead_mask, 'masked_image': raw_image,
-            'num_iter': iteration + 1}
-
-
-def laplacian(image, dead_mask=None, box_size=5, n_sigma=5.0, max_iter=5):
+    raw_image, dead_mask, single = _as_stack(image, dead_mask)
+    empty = _empty_slices(raw_image)
+    dead_mask[empty] = True
+    # The nan fixed image is finite so every window holds box_size**2 pixels
+    std_corr = _stddev_bias_corr(box_size ** 2)
+
+    def detect(images, slices):
+        nan_fixed_image = _fill_nans(images, box_size, ncpu)
+        median_filter_image = _median_filter(nan_fixed_image, box_size, ncpu)
+        std_filter_image = smoothing.map_slices(lambda x: smoothing.std_filter_nan_stack(x, size=box_size),
+                                                nan_fixed_image, ncpu=ncpu) * std_corr
+
+        hot_threshold = median_filter_image + (n_sigma * std_filter_image)
+        cold_threshold = median_filter_image - (n_sigma * std_filter_image)
+        return images > hot_threshold, images < cold_threshold
+
+    hot_mask, cold_mask, num_iter = _iterate(raw_image, np.flatnonzero(~empty), max_iter, detect)
+    getLogger(__name__).info(f'Masked {hot_mask.sum()} hot pixels and {cold_mask.sum()} cold pixels')
+    return _result(hot_mask, cold_mask, dead_mask, raw_image, num_iter, single)
+
+
+def laplacian(image, dead_mask=None, box_size=5, n_sigma=5.0, max_iter=5, ncpu=1):
     """
-    :param image: 2D image array of photons (in counts)
+    :param image: 2D image array of photons (in counts) or a (time, x, y) stack of them, each slice is treated
+     independently
     :param box_size: in pixels
     :param n_sigma: number of standard deviations above/below the expected value for which a pixel will be flagged as
      'hot'/'cold'
     :param max_iter: maximum number of iterations
+    :param ncpu: number of threads to split the time slices over
     :return:
     A dictionary containing the result and various diagnostics. Keys are:
     'hot': boolean mask of hot pixels
@@ -274,60 +303,31 @@ def laplacian(image, dead_mask=None, box_size=5, n_sigma=5.0, max_iter=5):
     'masked_image': The hot and dead pixel masked image
     'input_image': original input image
     'num_iter': number of iterations performed.
+    For a stack each entry has a leading time axis.
     """
-    if not dead_mask.any():
-        getLogger(__name__).warning('Dead pixel mask all False! Make sure you expect no dead pixels in the '
-                                    'array or that you are specifying the correct beammap for this dataset!')
-    raw_image = image
-
     # Assume everything with 0 counts is a dead pixel, turn dead pixel values into NaNs
-    raw_image[dead_mask] = np.nan
-
-    # Initialise a mask for hot pixels (all False)
-    reference_hot_mask = np.zeros(shape=np.shape(raw_image), dtype=bool)
-    hot_mask = np.zeros(shape=np.shape(raw_image), dtype=bool)
-    reference_cold_mask = np.zeros(shape=np.shape(raw_image), dtype=bool)
-    cold_mask = np.zeros(shape=np.shape(raw_image), dtype=bool)
-
-    # In the case that *all* the pixels are dead, return a bad_mask where all the pixels are flagged as DEAD
-    if raw_image[np.isfinite(raw_image)].sum() <= 0:
-        getLogger(__name__).warning('Entire image consists of pixels with 0 counts')
-        dead_mask = np.ones_like(raw_image, dtype=bool)
-        iteration = -1
-    else:
-        for iteration in range(max_iter):
-            getLogger(__name__).info(f'Performing iteration: {iteration + 1}')
-            # Remove all the NaNs in an image and calculate a median filtered image
-            # each pixel takes the median of itself and the surrounding box_size x box_size box.
-            with warnings.catch_warnings():
-                warnings.filterwarnings("ignore", category=RuntimeWarning)
-                nan_fixed_image = smoothing.replace_nan(raw_image, mode='mean', box_size=box_size)
-            assert np.all(np.isfinite(nan_fixed_image))
-            laplacian_filter_image = spfilters.laplace(nan_fixed_image)
-            # TODO check below
-            hot_threshold = -(laplacian_filter_image + n_sigma * np.std(laplacian_filter_image))
-            cold_threshold = -(laplacian_filter_image - n_sigma * np.std(laplacian_filter_image))
-
-            hot_mask = (laplacian_filter_image < hot_threshold) | reference_hot_mask
-            cold_mask = (laplacian_filter_image > cold_threshold) | reference_cold_mask
-
-            # If no change between between this and the last iteration then stop iterating
-            if np.all(hot_mask == reference_hot_mask) and np.all(cold_mask == reference_cold_mask):
-                break
-
-            # Otherwise update 'reference_hot_mask' and set all detected bad pixels to NaN for the next iteration
-            reference_hot_mask = np.copy(hot_mask)
-            raw_image[hot_mask] = np.nan
-
-            reference_cold_mask = np.copy(cold_mask)
-            raw_image[cold_mask] = np.nan
-
-        # Make sure a pixel is not simultaneously hot and cold
-        assert ~(hot_mask & cold_mask).any()
-    getLogger(__name__).info(f'Masked {len(hot_mask[hot_mask != False])} hot pixels and'
-                             f' {len(hot_mask[cold_mask != False])} cold pixels')
-    return {'hot': hot_mask, 'cold': cold_mask, 'dead': dead_mask, 'masked_image': raw_image,
-            'num_iter': iteration + 1}
+    raw_image, dead_mask, single = _as_stack(image, dead_mask)
+    # In the case that *all* the pixels of a slice are dead, flag all of them as DEAD
+    empty = _empty_slices(raw_image)
+    dead_mask[empty] = True
+
+    def laplace(x):
+        # spfilters.laplace of each slice, i.e. without the second derivative along time
+        return (spfilters.correlate1d(x, [1, -2, 1], axis=1, mode='reflect') +
+                spfilters.correlate1d(x, [1, -2, 1], axis=2, mode='reflect'))
+
+    def detect(images, slices):
+        nan_fixed_image = _fill_nans(images, box_size, ncpu)
+        laplacian_filter_image = smoothing.map_slices(laplace, nan_fixed_image, ncpu=ncpu)
+        laplacian_std = np.std(laplacian_filter_image, axis=(1, 2))[:, None, None]
+        # TODO check below
+        hot_threshold = -(laplacian_filter_image + n_sigma * laplacian_std)
+        cold_threshold = -(laplacian_filter_image - n_sigma * laplacian_std)
+        return laplacian_filter_image < hot_threshold, laplacian_filter_image > cold_threshold
+
+    hot_mask, cold_mask, num_iter = _iterate(raw_image, np.flatnonzero(~empty), max_iter, detect)
+    getLogger(__name__).info(f'Masked {hot_mask.sum()} hot pixels and {cold_mask.sum()} cold pixels')
+    return _result(hot_mask, cold_mask, dead_mask, raw_image, num_iter, single)
 
 
 def plot_summary(masks, save_name=None):
@@ -360,7 +360,31 @@ def plot_summary(masks, save_name=None):
     return axes_list
 
 
-def _compute_mask(pt, method, step, startt, stopt, methodkw, weight, n_sigma):
+def _run_length_encode(masks, edges):
+    """
+    Run-length encode a (time, x, y) boolean mask stack into the intervals of consecutive masked time slices of each
+    pixel.
+
+    :param edges: the time bin edges of the slices
+    :return: flat pixel index, start edge, stop edge of each interval, ordered by pixel then time
+    """
+    masks = masks.reshape(len(masks), -1).T
+    padded = np.zeros((masks.shape[0], masks.shape[1] + 2), dtype=np.int8)
+    padded[:, 1:-1] = masks
+    change = np.diff(padded, axis=1)
+    pixel, first = np.nonzero(change == 1)
+    _, end = np.nonzero(change == -1)
+    edges = np.asarray(edges)
+    return pixel, edges[first], edges[end]
+
+
+def _compute_mask(pt, method, step, startt, stopt, methodkw, weight, n_sigma, ncpu=1):
+    """
+    Find the hot, cold, and dead pixels in each step long time slice of the photontable
+
+    :return: the combined (x, y, 3) hot, cold, dead mask (any slice), the metadata to record, the (time, x, y, 3)
+     per-slice masks and the time bin edges of the slices
+    """
     try:
         func = globals()[method]
     except KeyError:
@@ -369,20 +393,17 @@ def _compute_mask(pt, method, step, startt, stopt, methodkw, weight, n_sigma):
     # Generate a stack of bad pixel mask, one for each time step
     img = pt.get_fits(start=startt, duration=stopt - startt, weight=weight, rate=False, cube_type='time',
                       bin_width=step, exclude_flags=tuple())
-    masks = np.zeros(img['SCIENCE'].data.shape + (3,), dtype=bool)
+    edges = img['CUBE_EDGES'].data.edges
     dead_mask = pt.flagged('beammap.noDacTone')
-    for i, (sl, each_time) in enumerate(zip(img['SCIENCE'].data, img['CUBE_EDGES'].data.edges[:-1])):
-        getLogger(__name__).info(f'Processing time slice: {each_time} - {each_time + step} s')
-        result = func(sl, n_sigma=n_sigma, dead_mask=dead_mask, **methodkw)
-        masks[i, :, :, 0] = result['hot']
-        masks[i, :, :, 1] = result['cold']
-        masks[i, :, :, 2] = result['dead']
+    getLogger(__name__).info(f'Processing {len(edges) - 1} time slices of {step} s')
+    result = func(img['SCIENCE'].data, n_sigma=n_sigma, dead_mask=dead_mask, ncpu=ncpu, **methodkw)
+    masks = np.stack((result['hot'], result['cold'], result['dead']), axis=-1)
     mask = masks.any(axis=0)  # all hot, all cold, or all dead
     meta = {'pixcal.method': method, 'pixcal.step': step}
     for k in methodkw:
         meta[f'pixcal.m_{k}'] = methodkw[k]
 
-    return mask, meta
+    return mask, meta, masks, edges
 
 
 def fetch(o, startt, stopt, config=None):
@@ -399,7 +420,8 @@ def fetch(o, startt, stopt, config=None):
 
     exclude = [k[0] for k in StepConfig.REQUIRED_KEYS]
     methodkw = {k: cfg.pixcal.get(k) for k in cfg.pixcal.keys() if k not in exclude}
-    return _compute_mask(pt, method, step, startt, stopt, methodkw, cfg.pixcal.use_weight, cfg.pixcal.n_sigma)
+    return _compute_mask(pt, method, step, startt, stopt, methodkw, cfg.pixcal.use_weight, cfg.pixcal.n_sigma,
+                         ncpu=mkidpipeline.config.n_cpus_available(max=cfg.get('pixcal.ncpu', inherit=True)))
 
 
 def apply(o, config=None):
@@ -409,17 +431,27 @@ def apply(o, config=None):
         return
 
     pt = Photontable(o.h5)
-    with pt.needed_ram():
-        mask, meta = fetch(pt, o.start, o.stop, config=config)
+    with pt.needed_ram('pixcal.apply'):
+        mask, meta, masks, edges = fetch(pt, o.start, o.stop, config=config)
     if mask is None:
         return
     tic = time.time()
     getLogger(__name__).info(f'Applying pixel mask to {o}')
+    # Pixels bad in every time slice are flagged for the whole exposure, the rest only for the slices they were bad in
+    whole = masks.all(axis=0)
+    bits = [pt.flags.bitmask(f) for f in ('pixcal.hot', 'pixcal.cold', 'pixcal.dead')]
+    intervals = []
+    for i, bit in enumerate(bits):
+        pixel, start, stop = _run_length_encode(masks[..., i] & ~whole[..., i], edges)
+        intervals.append((np.full(pixel.size, bit), pt.beamImage.ravel()[pixel], start, stop))
+    flag, resid, start, stop = map(np.concatenate, zip(*intervals))
     pt.enablewrite()
     pt.unflag(pt.flags.bitmask(('pixcal.hot', 'pixcal.cold', 'pixcal.dead')))
-    pt.flag(pt.flags.bitmask('pixcal.hot') * mask[..., 0] +
-            pt.flags.bitmask('pixcal.cold') * mask[..., 1] +
-            pt.flags.bitmask('pixcal.dead') * mask[..., 2])
+    pt.unflag_intervals(pt.flags.bitmask(('pixcal.hot', 'pixcal.cold', 'pixcal.dead')))
+    pt.flag(bits[0] * whole[..., 0] + bits[1] * whole[..., 1] + bits[2] * whole[..., 2])
+    pt.flag_intervals(flag, resid, np.round(start * pt.TICKS_PER_SEC), np.round(stop * pt.TICKS_PER_SEC))
+    getLogger(__name__).info(f'Flagged {whole.any(axis=-1).sum()} pixels for the whole exposure and '
+                             f'{resid.size} pixel time intervals')
     pt.attach_observing_metadata(meta)
     pt.update_header('pixcal', True)
     pt.disablewrite()
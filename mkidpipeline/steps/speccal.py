@@ -48,7 +48,7 @@ from mkidpipeline.utils.resampling import rebin
 from mkidpipeline.utils.fitting import fit_blackbody
 from mkidpipeline.utils.smoothing import gaussian_convolution
 from mkidpipeline.utils.interpolating import interpolate_image
-from mkidpipeline.utils.photometry import get_aperture_radius, aper_photometry, astropy_psf_photometry, \
+from mkidpipeline.utils.photometry import get_aperture_radius, cube_aper_photometry, astropy_psf_photometry, \
     mec_measure_satellite_spot_flux
 from mkidpipeline.steps.drizzler import form
 from mkidpipeline.photontable import Photontable
@@ -245,19 +245,18 @@ class SpectralCalibrator:
             hdul = pt.get_fits(weight=True, rate=True, cube_type='wave',
                                bin_edges=self.wvl_bin_edges, bin_type='energy')
             cube = hdul['SCIENCE'].data
+            cube_wcs = self.wcs[0]
         else:
-            cube = []
-            for wvl in range(len(self.wvl_bin_edges) - 1):
-                getLogger(__name__).info('using wavelength range {} - {}'
-                                         .format(self.wvl_bin_edges[wvl].to(u.nm).value,
-                                                 self.wvl_bin_edges[wvl + 1].to(u.nm).value))
-                drizzled = form(self.data, mode='drizzle', wave_start=self.wvl_bin_edges[wvl],
-                                wave_stop=self.wvl_bin_edges[wvl + 1], pixfrac=0.5,
-                                wcs_timestep=1, exclude_flags=PROBLEM_FLAGS, usecache=False,
-                                duration=min([o.duration for o in self.data.obs]), ncpu=self.ncpu,
-                                derotate=not self.use_satellite_spots)
-                getLogger(__name__).info(('finished image {}/ {}'.format(wvl + 1.0, len(self.wvl_bin_edges) - 1)))
-                cube.append(drizzled.cps)
+            # A single drizzle of all the wavelength bins, the dithers are loaded and their footprints computed once
+            getLogger(__name__).info('drizzling {} wavelength bins from {} - {}'
+                                     .format(len(self.wvl_bin_edges) - 1, self.wvl_bin_edges[0].to(u.nm).value,
+                                             self.wvl_bin_edges[-1].to(u.nm).value))
+            drizzled = form(self.data, mode='drizzle', wvl_bin_edges=self.wvl_bin_edges, pixfrac=0.5,
+                            wcs_timestep=1, exclude_flags=PROBLEM_FLAGS, usecache=False,
+                            duration=min([o.duration for o in self.data.obs]), ncpu=self.ncpu,
+                            derotate=not self.use_satellite_spots)
+            cube = np.reshape(drizzled.cps, (-1,) + drizzled.cps.shape[-2:])
+            cube_wcs = drizzled.wcs.celestial
         self.cube = np.array(cube, dtype=np.double)
         n_wvl_bins = len(self.wvl_bin_edges) - 1
 
@@ -280,20 +279,15 @@ class SpectralCalibrator:
             except ValueError:
                 getLogger(__name__).warning('Aperture for the speccal must be in the format (x/RA, y/DEC, r) OR '
                                             'satellite, instead got {self.aperture}')
-            for i in np.arange(n_wvl_bins):
-                frame = cube[i, :, :]
-                if self.interpolation is not None:
-                    frame = interpolate_image(frame, method=self.interpolation)
-                if not r:
-                    rad = get_aperture_radius(wvl_bin_centers[i], self.platescale)
-                else:
-                    rad = r
-                self.aperture_radius[i] = rad
-                # TODO if x in ra and dec convert to x,y coordinates
-                wcs = drizzled.wcs
-                x, y = wcs.all_world2pix(x, y)
-                obj_flux = aper_photometry(frame, (x, y), rad)
-                self.mkid[1][i] = obj_flux
+            if self.interpolation is not None:
+                cube = np.array([interpolate_image(frame, method=self.interpolation) for frame in cube])
+            if not r:
+                self.aperture_radius[:] = [get_aperture_radius(wvl, self.platescale) for wvl in wvl_bin_centers]
+            else:
+                self.aperture_radius[:] = r
+            # TODO if x in ra and dec convert to x,y coordinates
+            x, y = cube_wcs.all_world2pix(x, y, 0)
+            self.mkid[1] = cube_aper_photometry(cube, (x, y), self.aperture_radius)
         return self.mkid
 
     def load_standard_spectrum(self):
@@ -5,6 +5,7 @@ from logging import getLogger
 import numpy as np
 import multiprocessing as mp
 import time
+from concurrent.futures import ThreadPoolExecutor
 from distutils.spawn import find_executable
 import progressbar as pb
 import scipy
@@ -24,10 +25,12 @@ from mkidcore.objects import Beammap
 from mkidcore.pixelflags import FlagSet
 import mkidpipeline.config
 import mkidpipeline.photontable as photontable
+from mkidpipeline.utils.sharedphotons import SharedPhotons
 
 log = pipelinelog.getLogger('mkidpipeline.steps.wavecal', setup=False)
 
 import mkidpipeline.utils.wavecal_models as wm
+import mkidpipeline.utils.tracing as tracing
 
 """
 The wavecal step uses a series of laser exposures to calculate the relationship between the phase response of an MKID 
@@ -67,7 +70,9 @@ class StepConfig(mkidpipeline.config.BaseStepConfig):
                                                                      'attempt to fit to the phase-energy relationship'),
                      ('dt', 500, 'ignore photons which arrive this many microseconds from another photon (number)'),
                      ('ncpu', 1, 'Number of cores to use for fetching'),
-                     ('parallel_prefetch', False, 'use shared memory to load ALL the photon data into ram'))
+                     ('parallel_prefetch', False, 'use shared memory to load ALL the photon data into ram'),
+                     ('threaded_histograms', True, 'compute the phase histograms in threads sharing the h5s rather '
+                                                   'than in worker processes, if the h5s support concurrent reads'))
 
 
 FLAGS = FlagSet.define(
@@ -92,7 +97,7 @@ class Configuration:
                  darks=None, beammap=None, outdir='',
                  histogram_model_names=('GaussianAndExponential',), bin_width=2, histogram_fit_attempts=3,
                  calibration_model_names=('Quadratic', 'Linear'), dt=500,  parallel_prefetch=False,
-                 summary_plot=True, templarfile='', max_count_rate=2000, ncpu=1):
+                 summary_plot=True, templarfile='', max_count_rate=2000, ncpu=1, threaded_histograms=True):
         """ darks should be a dict with fully qualified h5 paths to background files. wavelengths are keys.
         missing darks are fine
         If specified cfg should be a fully configured PipeConfig with a .wavecal attribute
@@ -116,6 +121,7 @@ class Configuration:
         self.dt = float(dt)
         self.parallel = ncpu > 1
         self.parallel_prefetch = parallel_prefetch
+        self.threaded_histograms = threaded_histograms
         self.summary_plot = summary_plot
 
         if cfg is None:
@@ -132,6 +138,7 @@ class Configuration:
             self.dt = float(cfg.wavecal.dt)
             self.parallel = self.ncpu>1
             self.parallel_prefetch = cfg.wavecal.parallel_prefetch
+            self.threaded_histograms = cfg.wavecal.threaded_histograms
             self.summary_plot = str(cfg.wavecal.plots).lower() in ('all', 'summary')
 
         if self.beammap.frequencies is None:
@@ -245,21 +252,20 @@ class Calibrator(object):
         # load in all the data from h5 files into shared memory if requested
         if parallel and self.cfg.parallel_prefetch:
             log.info("Prefetching ALL data")
-            self._shared_tables = {w: photontable.load_shareable_photonlist(f)
-                                   for w, f in self.cfg.h5_file_names.items()}
-            for w in self._shared_tables:
-                if self.cfg.darks.get(w, None) is not None:
-                    self._shared_tables[w] = (self._shared_tables[w],
-                                              photontable.load_shareable_photonlist(self.cfg.darks[w].h5))
-                else:
-                    self._shared_tables[w] = (self._shared_tables[w], None)
+            self._shared_tables = {}
+            for w, f in self.cfg.h5_file_names.items():
+                dark = self.cfg.darks.get(w, None)
+                self._shared_tables[w] = (SharedPhotons.open(f), SharedPhotons.open(dark.h5) if dark else None)
 
         # run the main methods
         try:
             log.info("Computing phase histograms")
             self._run("make_histograms", pixels=pixels, wavelengths=wavelengths, parallel=parallel, verbose=verbose)
 
-            del self._shared_tables
+            for shared in (self._shared_tables or {}).values():
+                for store in shared:
+                    if store is not None:
+                        store.close()
             self._shared_tables = None
 
             log.info("Fitting phase histograms")
@@ -326,11 +332,11 @@ class Calibrator(object):
                             bkgd_phase_list = bg.query(pixel=tuple(pixel), column='wavelength')
                             bkgd_phase_list = bkgd_phase_list[bkgd_phase_list < 0]
                     else:
-                        table_data, bg = self._shared_tables[wavelength].data
-                        photon_list = table_data[table_data['resID'] == self.solution.beam_map[tuple(pixel)]]
+                        pt, bg = self._shared_tables[wavelength]
+                        photon_list = pt.query(resid=self.solution.beam_map[tuple(pixel)])
 
                         if bg is not None:
-                            bkgd_phase_list = bg['wavelength'][bg['resID'] == self.solution.beam_map[tuple(pixel)]]
+                            bkgd_phase_list = bg.query(resid=self.solution.beam_map[tuple(pixel)], column='wavelength')
                             bkgd_phase_list = bkgd_phase_list[bkgd_phase_list < 0]
 
                     # check for enough photons
@@ -595,11 +601,39 @@ class Calibrator(object):
             raise error
 
     def _run(self, method, pixels=None, wavelengths=None, verbose=False, parallel=True):
-        if parallel:
+        if parallel and method == 'make_histograms' and self._threadable(wavelengths):
+            self._threaded(method, pixels=pixels, wavelengths=wavelengths, verbose=verbose)
+        elif parallel:
             self._parallel(method, pixels=pixels, wavelengths=wavelengths, verbose=verbose)
         else:
             getattr(self, method)(pixels=pixels, wavelengths=wavelengths, verbose=verbose)
 
+    def _threadable(self, wavelengths):
+        """True if the h5s of wavelengths can be read by many threads at once, see Photontable.concurrent_reads"""
+        if self._shared_tables is not None or not getattr(self.cfg, 'threaded_histograms', False):
+            return False
+        wavelengths = self.solution._parse_wavelengths(wavelengths)
+        pts = [self.fetch_obsfile(w, background=bg) for w in wavelengths for bg in (False, True)]
+        return all(pt is None or pt.concurrent_reads for pt in pts)
+
+    def _threaded(self, method, pixels=None, wavelengths=None, verbose=False):
+        """Run method on groups of pixels in threads that share the h5s this process has open"""
+        pixels, wavelengths = self._setup(pixels, wavelengths)
+        for w in wavelengths:  # Each pixel's photons are then read directly, rather than through the h5 indices
+            for pt in (self.fetch_obsfile(w), self.fetch_obsfile(w, background=True)):
+                if pt is not None:
+                    pt.resid_rows()
+        log.info("Using {} threads".format(self.cfg.ncpu))
+        chunk_size = max(1, pixels.shape[1] // (10 * self.cfg.ncpu))
+        groups = [pixels[:, ii: ii + chunk_size] for ii in range(0, pixels.shape[1], chunk_size)]
+        self._update_progress(number=pixels.shape[1], initialize=True, verbose=verbose)
+        with ThreadPoolExecutor(max_workers=self.cfg.ncpu) as pool:
+            work = lambda group: getattr(self, method)(pixels=group, wavelengths=wavelengths, verbose=False)
+            for group, _ in zip(groups, pool.map(work, groups)):
+                for _ in group.T:
+                    self._update_progress(verbose=verbose)
+        self._update_progress(finish=True, verbose=verbose)
+
     def _parallel(self, method, pixels=None, wavelengths=None, verbose=False):
         # configure number of processes
         n_data = pixels.shape[1]
@@ -2697,7 +2731,7 @@ def apply(o):
     obs.photonTable.autoindex = False  # Don't reindex every time we change column
 
     tic = time.time()
-    with obs.needed_ram():
+    with obs.needed_ram('wavecal.apply'):
         flags = obs.flags
         for pixel, resid in obs.resonators(pixel=True):
             obs.unflag(flags.bitmask([f for f in flags.names if f.startswith('wavecal')], unknown='ignore'),
@@ -2718,11 +2752,17 @@ def apply(o):
                 phase = obs.photonTable.read(start=indices[0], stop=indices[-1] + 1, field='wavelength')
                 obs.photonTable.modify_column(start=indices[0], stop=indices[-1] + 1, column=calibration(phase),
                                               colname='wavelength')
+                tracing.count('photons', phase.size)
+                tracing.count('bytes_read', phase.nbytes)
+                tracing.count('bytes_written', phase.nbytes)
             else:  # This takes 3.5s on a 70Mphot file!!!
                 getLogger(__name__).warning('Using modify_coordinates, this is very slow')
                 phase = obs.photonTable.read_coordinates(indices)
                 phase['wavelength'] = calibration(phase['wavelength'])
                 obs.photonTable.modify_coordinates(indices, phase)
+                tracing.count('photons', phase.size)
+                tracing.count('bytes_read', phase.nbytes)
+                tracing.count('bytes_written', phase.nbytes)
             tic2 = time.time()
             getLogger(__name__).debug('Wavelength updated in {:.2f}s'.format(time.time() - tic2))
 
@@ -1,57 +1,384 @@
+#!/usr/bin/env python3
+"""
+Benchmarks of building, querying and calibrating photontables, on synthetic data
+
+    python benchmark.py -o results.json [--duration 60] [--rate 200] [--npix 4000] [-k query]
+    python benchmark.py --compare baseline.json results.json
+
+A science exposure (calibrated wavelengths), a raw science exposure (phases) and a raw laser exposure are generated
+with mkidpipeline.utils.synthetic and built with buildhdf.buildfromarray in a scratch directory, then each benchmark is
+run --repeat times. Benchmarks that modify a table (the calibration applies) start each repeat from a fresh copy of it.
+The wavecal and flatcal applies need a solution file and are only run when one is given.
+
+The ingest benchmarks write --ingest seconds of synthetic .bin files and time parsing them (utils.binparse.ParsedBin)
+and building an h5 from them with buildhdf, reporting bins/s as well as photons/s.
+
+The drizzle benchmarks bin the science photons into the frames of DRIZZLE_STEPS wcs timesteps, as the drizzler does,
+in --drizzle-threads threads with np.histogramdd and with utils.drizzling.histogramdd. Compare runs with different
+--drizzle-threads for how each scales.
+
+Results are written as JSON with the git commit they were run on, so a run can be compared against a baseline from
+another commit: --compare prints the ratio of the median times of the benchmarks in both and exits with status 1 if any
+is slower than --threshold allows.
+"""
 import os
-os.environ['NUMEXPR_MAX_THREADS'] = '32'
-os.environ['NUMEXPR_NUM_THREADS'] = '16'
-os.environ["TMPDIR"] = '/scratch/tmp/'
-
-import tables.index
-tables.index.profile = True
-
-from photontable import Photontable
-
-
-
-#@profile
-def tsectest(f):
-    of = Photontable(f)
-    # p=LineProfiler(of.photonTable._where)
-    # p.enable()
-    of.query(start=0, intt=30)
-
-    #All the time is in the tables.tableextension.Row iterator returned by table._where,
-    # p.disable()
-    # p.dump_stats('benchmark.py.lpstats')
-    # p.print_stats()
-
-
-tsectest('/scratch/baileyji/mec/out/1545544477_slowtest.h5')
-
-
-# from mkidpipeline.hdf.photontable import Photontable
-# import mkidpipeline.config
-# mkidpipeline.config.logtoconsole()
-# f='/mnt/data0/isabel/highcontrastimaging/Jan2019Run/20190112/Trapezium/trap_ditherwavecalib/1547374834.h5'
-# obsfile = Photontable(f)
-# obsfile.get_fits(start=0, duration=30, weight=True, scaleByEffInt=False)
-# #2019-02-15 16:54:41,351 DEBUG Feteched 27438555/27438555 rows in 111.714s using indices ('Time',) for query (Time < stopt)
-#
-#
-# f='/scratch/baileyji/mec/out/1545545212_slowtest.h5'
-# obsfile = Photontable(f,mode='w')
-# obsfile.get_fits(start=0, duration=30, weight=True, scaleByEffInt=False)
-# #2019-02-15 17:13:18,137 DEBUG Feteched 34003232/72271775 rows in 863.709s using indices ('Time',) for query (Time < stopt)
-#
-# obsfile.photonTable.autoindex=0
-# r0=obsfile.photonTable[:1]
-# obsfile.photonTable.modify_rows(0,1,rows=r0)
-# obsfile.photonTable.cols._g_col('time').index
-# #2019-02-15 17:47:49,351 DEBUG Feteched 34003232/72271775 rows in 824.571s using indices () for query (Time < stopt)
-#
-#
-# f='/scratch/baileyji/mec/out/1545544477_slowtest.h5'
-# obsfile = Photontable(f,mode='w')
-# obsfile.get_fits(start=0, duration=30, weight=True, scaleByEffInt=False)
-# #2019-02-15 16:58:02,389 DEBUG Feteched 33126732/70860428 rows in 15.331s using indices () for query (Time < stopt)
-# #obsfile.photonTable.cols._g_col('time').index shows dirty
-# obsfile.photonTable.reindex_dirty()
-# #2019-02-15 17:50:12,871 DEBUG Feteched 33126732/70860428 rows in 12.114s using indices ('Time',) for query (Time < stopt)
-#
+import sys
+import json
+import time
+import shutil
+import argparse
+import platform
+import tempfile
+import subprocess
+from datetime import datetime
+from concurrent.futures import ThreadPoolExecutor
+
+import numpy as np
+import tables
+import pkg_resources as pkg
+
+import mkidpipeline.config as config
+import mkidpipeline.definitions as definitions
+import mkidpipeline.pipeline as pipe
+from mkidpipeline.photontable import Photontable, close_photontables
+from mkidpipeline.steps import buildhdf, cosmiccal, flatcal, lincal, pixcal, wavecal
+from mkidpipeline.utils import drizzling, synthetic
+from mkidpipeline.utils.binparse import ParsedBin
+from mkidpipeline.utils.memory import PeakSampler
+from mkidcore.corelog import getLogger
+
+# Start times of the synthetic exposures, the h5s are named for them
+START = {'science': 1600000000, 'raw': 1600010000, 'laser': 1600020000, 'bins': 1600030000}
+# Number of wcs timesteps the drizzle benchmarks split the exposure into
+DRIZZLE_STEPS = 32
+
+
+def git_commit():
+    """Return (commit, True if the tree has uncommitted changes) of the repository this file is in"""
+    here = os.path.dirname(os.path.abspath(__file__))
+    try:
+        commit = subprocess.run(['git', 'rev-parse', 'HEAD'], cwd=here, capture_output=True, text=True,
+                                check=True).stdout.strip()
+        dirty = bool(subprocess.run(['git', 'status', '--porcelain', '--untracked-files=no'], cwd=here,
+                                    capture_output=True, text=True).stdout.strip())
+    except (OSError, subprocess.CalledProcessError):
+        return None, None
+    return commit, dirty
+
+
+def configure(workdir, ncpu=1):
+    """Configure the pipeline with default settings and paths in workdir"""
+    cfg = pipe.generate_default_config(instrument='MEC')
+    for k in ('data', 'database', 'out', 'tmp'):
+        os.makedirs(os.path.join(workdir, k), exist_ok=True)
+        cfg.update(f'paths.{k}', os.path.join(workdir, k))
+    cfg.update('ncpu', ncpu)
+    cfg.update('pixcal.plots', 'none')
+    file = os.path.join(workdir, 'pipe.yaml')
+    with open(file, 'w') as f:
+        config.yaml.dump(cfg, f)
+    return config.configure_pipeline(file)
+
+
+class Benchmark:
+    def __init__(self, name, run, setup=None, files=None):
+        """
+        :param name: name of the benchmark in the results
+        :param run: callable doing the timed work, returns the number of photons it processed
+        :param setup: optional callable run before each repeat, not timed
+        :param files: number of bin files the benchmark reads, to report bins/s
+        """
+        self.name = name
+        self.run = run
+        self.setup = setup
+        self.files = files
+
+    def __call__(self, repeat):
+        walls, photons, peak = [], None, 0
+        for _ in range(repeat):
+            if self.setup is not None:
+                self.setup()
+            sampler = PeakSampler()
+            tic = time.perf_counter()
+            try:
+                photons = self.run()
+            except Exception as e:
+                sampler.stop()
+                getLogger(__name__).error(f'Benchmark {self.name} failed', exc_info=True)
+                return dict(error=f'{type(e).__name__}: {e}')
+            walls.append(time.perf_counter() - tic)
+            sampler.stop()
+            peak = max(peak, sampler.peak)
+            close_photontables()
+        median = float(np.median(walls))
+        return dict(wall=walls, best=min(walls), median=median, photons=photons, peak_rss=peak,
+                    mphot_per_s=photons / median / 1e6 if photons and median else None,
+                    bins_per_s=self.files / median if self.files and median else None)
+
+
+def build(kind, photons, duration, **build_kwargs):
+    """Build a synthetic exposure into paths.out and attach its metadata, returns the MKIDTimerange"""
+    tr = definitions.MKIDTimerange(name=kind, start=START[kind], duration=duration)
+    buildhdf.buildfromarray(photons, starttime=tr.start, inttime=duration, **build_kwargs)
+    pipe._apply_metadata(tr)
+    return tr
+
+
+def restorer(tr, pristine):
+    """Return a function that replaces the h5 of tr with the pristine copy"""
+    def restore():
+        close_photontables()
+        shutil.copyfile(pristine, tr.h5)
+    return restore
+
+
+def benchmarks(trs, photons, duration, wavecal_solution=None, flatcal_solution=None, build_kwargs=None):
+    """Return the list of Benchmarks for the built exposures trs and their photon arrays"""
+    sci, raw, laser = trs['science'], trs['raw'], trs['laser']
+    build_kwargs = build_kwargs or {}
+    pristine = {k: tr.h5 + '.pristine' for k, tr in trs.items()}
+    for k, tr in trs.items():
+        shutil.copyfile(tr.h5, pristine[k])
+
+    def open_sci():
+        return Photontable(sci.h5)
+
+    rng = np.random.default_rng(0)
+    pt = open_sci()
+    resids = np.array(list(pt.resonators()))
+    some_resids = np.sort(rng.choice(resids, min(100, resids.size), replace=False))
+    pixel = tuple(int(x) for x in np.argwhere(pt.beamImage == some_resids[0])[0])
+    del pt
+
+    def query(**kwargs):
+        return lambda: open_sci().query(**kwargs).size
+
+    def per_resid(tr, n=200):
+        """Read the photons of each of n pixels one at a time, the access pattern of the wavecal fetch"""
+        def run():
+            pt = Photontable(tr.h5)
+            return sum(pt.query(resid=r).size for r in resids[:n])
+        return run
+
+    def get_fits(**kwargs):
+        def run():
+            pt = open_sci()
+            pt.get_fits(**kwargs)
+            return len(pt.photonTable)
+        return run
+
+    def rebuild(kind):
+        def run():
+            buildhdf.buildfromarray(photons[kind], starttime=START[kind] + 1, inttime=duration, **build_kwargs)
+            return photons[kind].size
+        return run
+
+    def apply(step, tr, kind, **kwargs):
+        def run():
+            for k, v in kwargs.items():
+                setattr(tr, k, v)
+            step.apply(tr)
+            return photons[kind].size
+        return Benchmark(f'{step.__name__.split(".")[-1]}.apply', run, setup=restorer(tr, pristine[kind]))
+
+    t0 = duration / 3
+    ret = [Benchmark('buildhdf.science', rebuild('science')),
+           Benchmark('buildhdf.laser', rebuild('laser')),
+           Benchmark('query.all', query()),
+           Benchmark('query.time', query(start=t0, intt=duration / 10)),
+           Benchmark('query.wavelength', query(startw=1000, stopw=1100)),
+           Benchmark('query.time_wavelength', query(start=t0, intt=duration / 10, startw=1000, stopw=1100)),
+           Benchmark('query.pixel', query(pixel=pixel)),
+           Benchmark('query.resids', query(resid=some_resids)),
+           Benchmark('query.good', query(exclude_flags=pipe.PROBLEM_FLAGS)),
+           Benchmark('query.per_resid', per_resid(sci)),
+           Benchmark('query.per_resid_laser', per_resid(laser)),
+           Benchmark('get_fits.image', get_fits()),
+           Benchmark('get_fits.time_cube', get_fits(cube_type='time', bin_width=duration / 30)),
+           Benchmark('get_fits.wave_cube', get_fits(cube_type='wave', bin_width=.1)),
+           apply(pixcal, sci, 'science'),
+           apply(cosmiccal, sci, 'science'),
+           apply(lincal, sci, 'science')]
+    if wavecal_solution:
+        ret.append(apply(wavecal, raw, 'raw', wavecal=_Solution(wavecal_solution)))
+    if flatcal_solution:
+        ret.append(apply(flatcal, sci, 'science', flatcal=flatcal_solution))
+    return ret
+
+
+def ingest_benchmarks(bindir, start, duration, nphotons):
+    """Return the Benchmarks of reading duration seconds of bin files starting at start from bindir"""
+    files = [os.path.join(bindir, f'{t}.bin') for t in range(start, start + duration)]
+    cfg = config.config
+    shape = np.shape(cfg.beammap.residmap)[::-1]
+
+    def parse():
+        return ParsedBin(files, pix_shape=shape).tot_photons
+
+    def build():
+        buildhdf.HDFBuilder(datadir=bindir, outdir=cfg.paths.out, beammap=cfg.beammap, instrument=cfg.instrument,
+                            starttime=start, inttime=duration, force=True).run()
+        return nphotons
+
+    return [Benchmark('ingest.parse', parse, files=duration),
+            Benchmark('ingest.buildhdf', build, files=duration)]
+
+
+def drizzle_benchmarks(photons, duration, nthreads):
+    """Return the Benchmarks of binning photons into the frames of each wcs timestep in nthreads threads"""
+    residmap = np.asarray(config.config.beammap.residmap)
+    order = np.argsort(residmap.ravel())
+    pixel = order[np.searchsorted(residmap.ravel()[order], photons['resID'])]
+    columns = (photons['time'], photons['wavelength']) + np.unravel_index(pixel, residmap.shape)
+    steps = np.linspace(0, duration * 1e6, DRIZZLE_STEPS + 1)
+    edges = (np.linspace(950, 1375, 11), np.arange(residmap.shape[0] + 1), np.arange(residmap.shape[1] + 1))
+
+    def binner(histogramdd):
+        def step(i):
+            use = (columns[0] >= steps[i]) & (columns[0] <= steps[i + 1])
+            return histogramdd([c[use] for c in columns], (steps[i:i + 2],) + edges)
+
+        def run():
+            with ThreadPoolExecutor(max_workers=nthreads) as pool:
+                list(pool.map(step, range(DRIZZLE_STEPS)))
+            return photons.size
+        return run
+
+    return [Benchmark('drizzle.bin_numpy', binner(lambda c, e: np.histogramdd(np.vstack(c).T, e)[0])),
+            Benchmark('drizzle.bin', binner(drizzling.histogramdd))]
+
+
+class _Solution:
+    """Stands in for the calibration definition of an observation, which the applies only use for its path and id"""
+    def __init__(self, path):
+        self.path = path
+        self.id = os.path.basename(path)
+
+
+def run(args):
+    workdir = args.workdir or tempfile.mkdtemp(prefix='mkidbench_')
+    configure(workdir)
+    getLogger(__name__).info(f'Benchmarking in {workdir}')
+    beammap = config.config.beammap
+    common = dict(rate=args.rate, npix=args.npix, cosmic_rate=args.cosmic_rate, seed=args.seed)
+    photons = {'science': synthetic.photon_list(beammap, args.duration, **common),
+               'raw': synthetic.photon_list(beammap, args.duration, calibrated=False, **common),
+               'laser': synthetic.photon_list(beammap, args.duration, kind='laser', calibrated=False, **common)}
+    build_kwargs = {}
+    if args.chunkshape:
+        build_kwargs['chunkshape'] = args.chunkshape
+    trs = {k: build(k, p, args.duration, **build_kwargs) for k, p in photons.items()}
+    built = {k: dict(photons=int(p.size), bytes=os.path.getsize(trs[k].h5)) for k, p in photons.items()}
+
+    todo = benchmarks(trs, photons, args.duration, wavecal_solution=args.wavecal, flatcal_solution=args.flatcal,
+                      build_kwargs=build_kwargs)
+    if args.ingest:
+        bindir = os.path.join(config.config.paths.data, 'bins')
+        detector = synthetic.Detector(beammap, rate=args.rate, npix=args.npix, seed=args.seed)
+        nbin = synthetic.write_bins(bindir, START['bins'], args.ingest, detector, cosmic_rate=args.cosmic_rate)
+        built['bins'] = dict(photons=nbin, bytes=sum(e.stat().st_size for e in os.scandir(bindir)))
+        todo += ingest_benchmarks(bindir, START['bins'], args.ingest, nbin)
+    todo += drizzle_benchmarks(photons['science'], args.duration, args.drizzle_threads)
+
+    results = {}
+    try:
+        for b in todo:
+            if args.k and not any(k in b.name for k in args.k):
+                continue
+            getLogger(__name__).info(f'Running {b.name}')
+            results[b.name] = b(args.repeat)
+            print(_format_result(b.name, results[b.name]), flush=True)
+    finally:
+        close_photontables()
+        if not args.keep and not args.workdir:
+            shutil.rmtree(workdir, ignore_errors=True)
+
+    commit, dirty = git_commit()
+    record = dict(commit=commit, dirty=dirty, date=datetime.now().isoformat(timespec='seconds'),
+                  host=platform.node(), python=platform.python_version(), numpy=np.__version__,
+                  tables=tables.__version__, cpus=os.cpu_count(),
+                  settings=dict(duration=args.duration, rate=args.rate, npix=args.npix, cosmic_rate=args.cosmic_rate,
+                                seed=args.seed, repeat=args.repeat, chunkshape=args.chunkshape, ingest=args.ingest,
+                                drizzle_threads=args.drizzle_threads),
+                  tables_built=built,
+                  results=results)
+    with open(args.out, 'w') as f:
+        json.dump(record, f, indent=1)
+    print(f'Results written to {args.out}')
+    return record
+
+
+def _format_result(name, r):
+    if 'error' in r:
+        return f'{name:<28}failed: {r["error"]}'
+    rate = f'{r["mphot_per_s"]:9.2f}' if r['mphot_per_s'] else f'{"-":>9}'
+    bins = f'{r["bins_per_s"]:9.1f}' if r['bins_per_s'] else f'{"-":>9}'
+    return f'{name:<28}{r["median"]:10.3f}{r["best"]:10.3f}{rate}{bins}{r["peak_rss"] / 1024 ** 3:10.2f}'
+
+
+def compare(baseline, new, threshold=.1):
+    """
+    Print the benchmarks of two result files side by side, return the names of those whose median time grew by more
+    than the threshold fraction
+    """
+    with open(baseline) as f:
+        a = json.load(f)
+    with open(new) as f:
+        b = json.load(f)
+    print(f'baseline {a["commit"]}{" (dirty)" if a["dirty"] else ""} {a["date"]} on {a["host"]}')
+    print(f'new      {b["commit"]}{" (dirty)" if b["dirty"] else ""} {b["date"]} on {b["host"]}')
+    if a['settings'] != b['settings']:
+        print(f'Settings differ: {a["settings"]} vs {b["settings"]}')
+    print(f'{"benchmark":<28}{"base (s)":>10}{"new (s)":>10}{"ratio":>8}')
+    slower = []
+    for name in list(dict.fromkeys(list(a['results']) + list(b['results']))):
+        ra, rb = a['results'].get(name, {}), b['results'].get(name, {})
+        if 'median' not in ra or 'median' not in rb:
+            print(f'{name:<28}{ra.get("median", "-"):>10}{rb.get("median", "-"):>10}')
+            continue
+        ratio = rb['median'] / ra['median'] if ra['median'] else np.inf
+        mark = ''
+        if ratio > 1 + threshold:
+            slower.append(name)
+            mark = '  slower'
+        elif ratio < 1 / (1 + threshold):
+            mark = '  faster'
+        print(f'{name:<28}{ra["median"]:10.3f}{rb["median"]:10.3f}{ratio:8.2f}{mark}')
+    return slower
+
+
+def parse():
+    parser = argparse.ArgumentParser(description='MKID Pipeline benchmarks on synthetic data')
+    parser.add_argument('-o', dest='out', type=str, default='benchmark.json', help='JSON file for the results')
+    parser.add_argument('--duration', type=float, default=30, help='Length of the synthetic exposures (s)')
+    parser.add_argument('--rate', type=float, default=30, help='Mean count rate of a pixel (photons/s)')
+    parser.add_argument('--npix', type=int, default=None, help='Number of illuminated pixels (default all good)')
+    parser.add_argument('--cosmic-rate', dest='cosmic_rate', type=float, default=.05,
+                        help='Cosmic ray bursts per second')
+    parser.add_argument('--seed', type=int, default=0, help='Seed of the synthetic data')
+    parser.add_argument('--repeat', type=int, default=3, help='Times to run each benchmark')
+    parser.add_argument('--chunkshape', type=int, default=None, help='Chunkshape of the built tables')
+    parser.add_argument('--ingest', type=int, default=10, help='Seconds of bin files for the ingest benchmarks')
+    parser.add_argument('--drizzle-threads', dest='drizzle_threads', type=int, default=1,
+                        help='Threads for the drizzle benchmarks')
+    parser.add_argument('-k', nargs='*', default=None, help='Only run benchmarks whose names contain one of these')
+    parser.add_argument('--wavecal', type=str, default=None, help='A wavecal solution to benchmark applying')
+    parser.add_argument('--flatcal', type=str, default=None, help='A flatcal solution to benchmark applying')
+    parser.add_argument('--workdir', type=str, default=None, help='Build the tables here and keep them')
+    parser.add_argument('--keep', action='store_true', help='Keep the scratch directory')
+    parser.add_argument('--compare', nargs=2, default=None, metavar=('BASELINE', 'NEW'),
+                        help='Compare two result files and exit')
+    parser.add_argument('--threshold', type=float, default=.1,
+                        help='Fractional slowdown of a median time that --compare reports as a regression')
+    return parser.parse_args()
+
+
+if __name__ == '__main__':
+    args = parse()
+    if args.compare:
+        sys.exit(1 if compare(*args.compare, threshold=args.threshold) else 0)
+    getLogger('mkidcore', setup=True, configfile=pkg.resource_filename('mkidpipeline', './config/logging.yaml'))
+    getLogger('mkidpipeline').setLevel('WARNING')
+    getLogger(__name__).setLevel('INFO')
+    print(f'{"benchmark":<28}{"median (s)":>10}{"best (s)":>10}{"Mphot/s":>9}{"bins/s":>9}{"RSS (GB)":>10}')
+    run(args)
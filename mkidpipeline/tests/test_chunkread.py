@@ -0,0 +1,96 @@
+"""Tests of mkidpipeline.utils.chunkread.ChunkReader against PyTables, run with pytest or as a script"""
+import os
+import tempfile
+
+import numpy as np
+import pytest
+import tables
+
+from mkidpipeline.utils import chunkread
+
+PHOTON_DTYPE = np.dtype([('resID', np.uint32), ('time', np.uint32), ('wavelength', np.float32),
+                         ('weight', np.float32)])
+NROWS = 100003  # not a multiple of the chunk size, so the last chunk is partial
+CHUNKROWS = 997
+
+
+def _photons():
+    rng = np.random.default_rng(7)
+    photons = np.zeros(NROWS, dtype=PHOTON_DTYPE)
+    photons['resID'] = np.sort(rng.integers(10000, 10500, NROWS))
+    photons['time'] = rng.integers(0, 10 ** 7, NROWS)
+    photons['wavelength'] = rng.uniform(700, 1500, NROWS)
+    photons['weight'] = rng.uniform(0, 1, NROWS)
+    return photons
+
+
+def _check(filters):
+    photons = _photons()
+    with tempfile.TemporaryDirectory() as d:
+        filename = os.path.join(d, 'photons.h5')
+        with tables.open_file(filename, 'w') as f:
+            f.create_table('/', 'photontable', photons, chunkshape=(CHUNKROWS,), filters=filters)
+        with tables.open_file(filename) as f:
+            table = f.root.photontable
+            if not chunkread.supported(table):
+                pytest.skip(f'ChunkReader does not support {filters} with this PyTables')
+            reader = chunkread.ChunkReader(table)
+            try:
+                assert (reader.read() == table.read()).all()
+                for start, stop in ((0, 1), (5, CHUNKROWS + 3), (CHUNKROWS, 2 * CHUNKROWS), (NROWS - 10, NROWS + 5)):
+                    assert (reader.read(start, stop) == table.read(start, stop)).all(), (start, stop)
+                ranges = [(3, 400), (50000, 50000), (61000, 61020), (NROWS - 2, NROWS)]
+                expected = np.concatenate([table.read(a, b) for a, b in ranges])
+                assert (reader.read(ranges=ranges) == expected).all()
+                starts, stops = np.array([a for a, _ in ranges]), np.array([b for _, b in ranges])
+                assert (reader.read(ranges=(starts, stops)) == expected).all()
+                assert reader.read(ranges=[]).size == 0
+
+                condition = '(time >= 2000000) & (time < 5000000) & (wavelength < 1000)'
+                selected = reader.scan(lambda rows, first: rows[(rows['time'] >= 2000000) & (rows['time'] < 5000000) &
+                                                                (rows['wavelength'] < 1000)], block_rows=5000)
+                assert (np.concatenate(selected) == table.read_where(condition)).all()
+                firsts = reader.scan(lambda rows, first: (first, rows.size), start=10, stop=30000, block_rows=5000)
+                assert sum(n for _, n in firsts) == 30000 - 10 and firsts[0][0] == 10
+            finally:
+                reader.close()
+
+
+def test_blosc():
+    pytest.importorskip('numcodecs')
+    _check(tables.Filters(complevel=1, complib='blosc:lz4', shuffle=True))
+
+
+def test_blosc_zstd_bitshuffle():
+    pytest.importorskip('numcodecs')
+    _check(tables.Filters(complevel=5, complib='blosc:zstd', shuffle=False, bitshuffle=True))
+
+
+def test_uncompressed():
+    _check(tables.Filters(complevel=0))
+
+
+def test_unsupported():
+    with tempfile.TemporaryDirectory() as d:
+        filename = os.path.join(d, 'photons.h5')
+        with tables.open_file(filename, 'w') as f:
+            table = f.create_table('/', 'photontable', _photons()[:100], filters=tables.Filters(complevel=1,
+                                                                                                 complib='zlib'))
+            assert not chunkread.supported(table)
+            try:
+                chunkread.ChunkReader(table)
+            except ValueError:
+                pass
+            else:
+                raise AssertionError('A zlib table must be refused')
+
+
+if __name__ == '__main__':
+    for name, test in list(globals().items()):
+        if name.startswith('test_'):
+            try:
+                test()
+            except pytest.skip.Exception as e:
+                print(f'{name} skipped: {e}')
+            else:
+                print(f'{name} passed')
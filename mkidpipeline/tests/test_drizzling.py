@@ -0,0 +1,70 @@
+"""Tests of mkidpipeline.utils.drizzling, run with pytest or as a script"""
+import os
+import tempfile
+
+import numpy as np
+from astropy.wcs import WCS
+
+from mkidpipeline.utils import drizzling
+
+
+def _wcs(angle, shift=(0, 0)):
+    wcs = WCS(naxis=2)
+    wcs.wcs.ctype = ['RA---TAN', 'DEC--TAN']
+    wcs.wcs.crval = [150, 2]
+    wcs.wcs.crpix = [10 + shift[0], 12 + shift[1]]
+    wcs.wcs.cdelt = [-1e-5, 1e-5]
+    wcs.wcs.pc = [[np.cos(angle), -np.sin(angle)], [np.sin(angle), np.cos(angle)]]
+    return wcs
+
+
+def test_footprint_cache():
+    in_wcs, out_wcs = _wcs(0.4, (1.3, -0.7)), _wcs(0)
+    with tempfile.TemporaryDirectory() as d:
+        cache = drizzling.FootprintCache(d)
+        footprint = cache.get(in_wcs, out_wcs, (20, 25), (30, 30), pixfrac=0.8)
+        assert (cache.hits, cache.misses) == (0, 1)
+        assert cache.get(in_wcs, out_wcs, (20, 25), (30, 30), pixfrac=0.8) is footprint
+        assert (cache.hits, cache.misses) == (1, 1)
+
+        # A new cache finds the footprint on disk
+        disk = drizzling.FootprintCache(d)
+        assert (disk.get(in_wcs, out_wcs, (20, 25), (30, 30), pixfrac=0.8) != footprint).nnz == 0
+        assert (disk.hits, disk.misses) == (1, 0)
+
+        # A truncated file, e.g. from a run that was killed as it wrote, is a miss and is rewritten
+        file, = [os.path.join(d, f) for f in os.listdir(d)]
+        with open(file, 'rb+') as f:
+            f.truncate(os.path.getsize(file) // 2)
+        truncated = drizzling.FootprintCache(d)
+        assert (truncated.get(in_wcs, out_wcs, (20, 25), (30, 30), pixfrac=0.8) != footprint).nnz == 0
+        assert (truncated.hits, truncated.misses) == (0, 1)
+        assert (drizzling.FootprintCache(d).get(in_wcs, out_wcs, (20, 25), (30, 30), pixfrac=0.8) != footprint).nnz == 0
+
+        cache.clear()
+        assert not os.listdir(d)
+
+
+def test_histogramdd():
+    rng = np.random.default_rng(17)
+    n = 50000
+    # times and wavelengths spill past the edges and some sit exactly on them, pixels include the closing edge
+    time = rng.choice(np.append(rng.uniform(-10, 110, n), [0, 50, 100]), n)
+    wavelength = rng.uniform(650, 1550, n).astype(np.float32)
+    wavelength[:10] = 1500
+    x, y = rng.integers(-1, 12, n), rng.integers(0, 9, n).astype(np.uint32)
+    weights = rng.uniform(0, 1, n).astype(np.float32)
+    edges = (np.array([0, 50, 100]), np.linspace(700, 1500, 5), np.arange(11), np.arange(9))
+    for w in (None, weights):
+        expected = np.histogramdd(np.vstack((time, wavelength, x, y)).T, edges, weights=w)[0]
+        result = drizzling.histogramdd((time, wavelength, x, y), edges, weights=w)
+        assert result.shape == expected.shape and np.array_equal(result, expected)
+    assert np.array_equal(drizzling.histogram(x[x >= 0], 12, weights=weights[x >= 0]),
+                          np.bincount(x[x >= 0], weights=weights[x >= 0], minlength=12))
+
+
+if __name__ == '__main__':
+    for name, test in list(globals().items()):
+        if name.startswith('test_'):
+            test()
+            print(f'{name} passed')
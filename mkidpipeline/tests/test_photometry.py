@@ -0,0 +1,99 @@
+"""Tests of the satellite spot photometry of mkidpipeline.utils.photometry, run with pytest or as a script"""
+import numpy as np
+import pytest
+from astropy.modeling import fitting
+from astropy.modeling.models import Polynomial2D
+from astropy.wcs import WCS
+
+photometry = pytest.importorskip('mkidpipeline.utils.photometry')
+
+
+def _baseline_racetrack_aper(img, x_guess, y_guess, rotang, aper_radii, halflength, box_size=20):
+    """racetrack_aper as it was before ApertureSet, background subtracted from img in place"""
+    rotang *= -1
+    img[np.isnan(img)] = 0
+    dims = np.shape(img)
+    crop_img = img[int(y_guess) - box_size:int(y_guess) + (box_size + 1),
+                   int(x_guess) - box_size:int(x_guess) + (box_size + 1)]
+    xcoord, ycoord = np.meshgrid(np.arange(dims[0]), np.arange(dims[1]))
+    xppos = np.cos(rotang) * x_guess - np.sin(rotang) * y_guess
+    yppos = np.sin(rotang) * x_guess + np.cos(rotang) * y_guess
+    xpcoord = np.cos(rotang) * xcoord - np.sin(rotang) * ycoord
+    ypcoord = np.sin(rotang) * xcoord + np.cos(rotang) * ycoord
+    source_mid = (ypcoord > yppos - aper_radii) & (ypcoord < yppos + aper_radii) & (xpcoord > xppos - halflength) \
+                 & (xpcoord < xppos + halflength)
+    source_bot = (xpcoord < xppos - halflength) & \
+                 ((ypcoord - yppos) ** 2 + (xpcoord - (xppos - halflength)) ** 2 < aper_radii ** 2)
+    source_top = (xpcoord > xppos + halflength) & \
+                 ((ypcoord - yppos) ** 2 + (xpcoord - (xppos + halflength)) ** 2 < aper_radii ** 2)
+    source = np.where(source_mid | source_bot | source_top)
+    x, y = np.meshgrid(np.arange(np.shape(crop_img)[0]), np.arange(np.shape(crop_img)[0]))
+    p = fitting.LevMarLSQFitter()(Polynomial2D(degree=1), x, y, crop_img)
+    img[int(y_guess) - box_size:int(y_guess) + (box_size + 1),
+        int(x_guess) - box_size:int(x_guess) + (box_size + 1)] -= p(x, y)
+    return np.sum(img[source])
+
+
+def _baseline_spot_flux(cube, aperradii, wvl_start, wvl_stop, wcs, platescale=0.0104, D=8.2):
+    """mec_measure_satellite_spot_flux as it was before ApertureSet, one spot at a time"""
+    flux = np.zeros((len(cube), 4))
+    for i, img in enumerate(cube):
+        starx, stary = img.shape[0] / 2, img.shape[1] / 2
+        landa = wvl_start[i] + (wvl_stop[i] - wvl_start[i]) / 2.0
+        r_mid = (206265 / platescale) * 15.91 * landa / (D * 1e10)
+        halflength = (206265 / platescale) * 15.91 * wvl_stop[i] / (D * 1e10) - r_mid
+        angle = np.deg2rad(45)
+        spot_posx = np.array([1, 1, -1, -1]) * r_mid * np.cos(angle)
+        spot_posy = np.array([1, -1, -1, 1]) * r_mid * np.sin(angle)
+        for j in range(4):
+            new_x, new_y = wcs.wcs.pc.dot(np.array([spot_posx[j], spot_posy[j]]))
+            spot_posx[j], spot_posy[j] = new_x + starx, new_y + stary
+        xsep, ysep = spot_posx - starx, spot_posy - stary
+        rotang = np.arctan(ysep / xsep) + np.array([0, 0, -np.pi, np.pi])
+        for j in range(4):
+            flux[i, j] = _baseline_racetrack_aper(img, spot_posx[j], spot_posy[j], rotang[j], aperradii, halflength)
+    return flux
+
+
+def _cube(rng, nwvl, size):
+    """Noise on a sloped background with a bright satellite spot in each quadrant"""
+    y, x = np.mgrid[:size, :size]
+    cube = rng.random((nwvl, size, size)) + 0.05 * x + 0.02 * y
+    for cx, cy in ((0.3, 0.3), (0.3, 0.7), (0.7, 0.7), (0.7, 0.3)):
+        cube += 50 * np.exp(-((x - cx * size) ** 2 + (y - cy * size) ** 2) / 20)
+    return cube
+
+
+def test_satellite_spots_match_baseline():
+    rng = np.random.default_rng(11)
+    wcs = WCS(naxis=2)
+    wcs.wcs.pc = [[np.cos(.3), -np.sin(.3)], [np.sin(.3), np.cos(.3)]]
+    cube = _cube(rng, 3, 120)
+    cube[1, 5, 7] = np.nan
+    # At these wavelengths the spots are close enough that their background boxes overlap, so later spots are
+    # measured on an image the earlier ones have changed
+    wvl_start, wvl_stop = np.array([4000., 5000., 9000.]), np.array([5000., 6000., 10000.])
+    expected = _baseline_spot_flux(cube.copy(), 3.0, wvl_start, wvl_stop, wcs)
+    original = cube.copy()
+    flux = photometry.mec_measure_satellite_spot_flux(cube, aperradii=3.0, wvl_start=wvl_start, wvl_stop=wvl_stop,
+                                                      wcs=wcs)
+    assert flux.shape == (3, 4)
+    assert np.allclose(flux, expected, rtol=1e-6, atol=1e-6), flux - expected
+    assert np.array_equal(cube, original, equal_nan=True), 'The cube must not be modified'
+
+
+def test_racetrack_aper_matches_baseline():
+    img = _cube(np.random.default_rng(13), 1, 100)[0]
+    expected_img = img.copy()
+    expected = _baseline_racetrack_aper(expected_img, 30.4, 70.2, 0.7, 3.0, 4.0)
+    flux, spare = photometry.racetrack_aper(img, img.copy(), 30.4, 70.2, 0.7, 3.0, 4.0)
+    assert np.isclose(flux, expected, rtol=1e-6)
+    assert np.allclose(img, expected_img, atol=1e-6), 'The background must be subtracted from img in place'
+    assert (spare == 10000).sum() == (photometry.racetrack_weights(img.shape, 30.4, 70.2, 0.7, 3.0, 4.0)).sum()
+
+
+if __name__ == '__main__':
+    for name, test in list(globals().items()):
+        if name.startswith('test_'):
+            test()
+            print(f'{name} passed')
@@ -0,0 +1,161 @@
+"""Tests of mkidpipeline.utils.scheduling.TaskGraph, run with pytest or as a script"""
+import os
+import threading
+import time
+
+from mkidpipeline.utils import pooling
+from mkidpipeline.utils.scheduling import Task, TaskGraph
+
+
+def _record(log, key):
+    log.append(key)
+    return key
+
+
+def _fail(*args):
+    raise ValueError('task failed on purpose')
+
+
+def _square(x):
+    return x * x
+
+
+def _chain():
+    """a -> b -> d, a -> c -> d, e on its own"""
+    log = []
+    graph = TaskGraph()
+    graph.add(Task('a', _record, (log, 'a')))
+    graph.add(Task('b', _record, (log, 'b'), deps=['a']))
+    graph.add(Task('c', _record, (log, 'c'), deps=['a']))
+    graph.add(Task('d', _record, (log, 'd'), deps=['b', 'c']))
+    graph.add(Task('e', _record, (log, 'e')))
+    return graph, log
+
+
+def test_order():
+    graph, _ = _chain()
+    order = graph.order()
+    assert sorted(order) == list('abcde')
+    for t in graph:
+        assert all(order.index(d) < order.index(t.key) for d in t.deps), order
+    assert graph.priorities() == dict(a=3, b=2, c=2, d=1, e=1)
+
+
+def test_run_order():
+    graph, log = _chain()
+    results = graph.run(ncpu=1)
+    assert results == {k: k for k in 'abcde'}
+    assert sorted(log) == list('abcde')
+    for t in graph:
+        assert all(log.index(d) < log.index(t.key) for d in t.deps), log
+    assert log[0] == 'a'  # the longest chain starts first
+
+
+def test_failure_skips_dependents():
+    log = []
+    graph = TaskGraph([Task('a', _fail), Task('b', _record, (log, 'b'), deps=['a']),
+                       Task('c', _record, (log, 'c'), deps=['b']), Task('d', _record, (log, 'd'))])
+    try:
+        graph.run(ncpu=1)
+    except RuntimeError as e:
+        assert '1 task(s) failed and 2 were skipped' in str(e), e
+    else:
+        raise AssertionError('A failed task must raise')
+    assert log == ['d']
+
+
+def test_cycle():
+    graph = TaskGraph([Task('a', _square, (1,), deps=['c']), Task('b', _square, (2,), deps=['a']),
+                       Task('c', _square, (3,), deps=['b']), Task('d', _square, (4,))])
+    for call in (graph.order, graph.run):
+        try:
+            call()
+        except ValueError as e:
+            assert 'cycle' in str(e), e
+        else:
+            raise AssertionError('A cycle must raise ValueError')
+
+
+def test_bad_graph():
+    graph = TaskGraph([Task('a', _square, (1,))])
+    try:
+        graph.add(Task('a', _square, (2,)))
+    except ValueError:
+        pass
+    else:
+        raise AssertionError('A duplicate key must raise ValueError')
+    graph.add(Task('b', _square, (2,), deps=['missing']))
+    try:
+        graph.order()
+    except ValueError as e:
+        assert 'unknown' in str(e), e
+    else:
+        raise AssertionError('An unknown dependency must raise ValueError')
+
+
+def _stamp(*args):
+    return time.time()
+
+
+def _slow():
+    time.sleep(1)
+    return time.time()
+
+
+def test_pool():
+    graph = TaskGraph([Task('slow', _slow, local=True)])
+    for i in range(4):
+        graph.add(Task(('chain', i), _stamp, (i,), deps=[('chain', i - 1)] if i else []))
+    graph.add(Task('fail', _fail, deps=[('chain', 0)]))
+    graph.add(Task('skipped', _stamp, deps=['fail']))
+    try:
+        graph.run(ncpu=2)
+    except RuntimeError as e:
+        assert '1 task(s) failed and 1 were skipped' in str(e), e
+    else:
+        raise AssertionError('A failed task must raise')
+    finally:
+        pooling.shutdown()
+    del graph.tasks['fail'], graph.tasks['skipped']
+    try:
+        results = graph.run(ncpu=2)
+    finally:
+        pooling.shutdown()
+    assert all(results[('chain', i)] <= results[('chain', i + 1)] for i in range(3))
+    assert results[('chain', 3)] < results['slow'], 'A local task held up the pool'
+
+
+def _die(*args):
+    os._exit(3)
+
+
+def test_replace_worker():
+    pool = pooling.WorkerPool(1)
+    try:
+        try:
+            pool.submit(_die).result(timeout=30)
+        except RuntimeError as e:
+            assert 'exited' in str(e), e
+        else:
+            raise AssertionError('The task of a worker that died must fail')
+        # Workers are only forked by the main thread, a task from another thread waits for the replacement
+        submitted = []
+        thread = threading.Thread(target=lambda: submitted.append(pool.submit(_square, 3)))
+        thread.start()
+        thread.join()
+        time.sleep(0.5)
+        assert not submitted[0].done()
+        pool.replace_lost()
+        assert submitted[0].result(timeout=30) == 9
+        pool.submit(_die)
+        time.sleep(0.5)
+        assert pool.submit(_square, 4).result(timeout=30) == 16
+    finally:
+        pool.shutdown()
+
+
+if __name__ == '__main__':
+    for name, test in list(globals().items()):
+        if name.startswith('test_'):
+            test()
+            print(f'{name} passed')
@@ -0,0 +1,117 @@
+"""Tests of the time-resolved flags of mkidpipeline.photontable.Photontable, run with pytest or as a script"""
+import os
+import tempfile
+
+import numpy as np
+import tables
+from mkidcore.pixelflags import FlagSet
+
+from mkidpipeline.photontable import Photontable, _merge_intervals
+from mkidpipeline.utils import indexing
+
+BEAM = np.arange(100, 112).reshape(4, 3)  # resIDs of a 4x3 detector
+NTICKS = 200  # intervals and photons fall in [0, NTICKS), small enough to check tick by tick
+
+
+def _ticks(resid, start, stop):
+    """The set of (resID, tick) covered by a list of intervals"""
+    return {(r, t) for r, a, b in zip(resid, start, stop) for t in range(a, b)}
+
+
+def _random_intervals(rng, n):
+    resid = rng.choice(BEAM.ravel(), n)
+    start = rng.integers(0, NTICKS - 1, n)
+    stop = np.minimum(start + rng.integers(0, 30, n), NTICKS)
+    return resid, start, stop
+
+
+def test_merge_intervals():
+    resid, start, stop = _merge_intervals([], [], [])
+    assert resid.size == start.size == stop.size == 0
+
+    # overlapping, adjoining and contained intervals merge, those of other resonators or after a gap don't
+    resid, start, stop = _merge_intervals([5, 5, 5, 5, 3, 5], [10, 15, 20, 40, 12, 21], [18, 20, 30, 50, 14, 25])
+    assert resid.tolist() == [3, 5, 5] and start.tolist() == [12, 10, 40] and stop.tolist() == [14, 30, 50]
+
+    rng = np.random.default_rng(3)
+    for _ in range(50):
+        intervals = _random_intervals(rng, rng.integers(1, 40))
+        resid, start, stop = _merge_intervals(*intervals)
+        assert _ticks(resid, start, stop) == _ticks(*intervals)
+        key = resid.astype(np.uint64) << np.uint64(32) | start
+        assert np.all(np.diff(key.astype(np.int64)) > 0), 'Not sorted by resID then start'
+        same = resid[1:] == resid[:-1]
+        assert np.all(start[1:][same] > stop[:-1][same]), 'Intervals left overlapping or adjoining'
+
+
+class _Table(Photontable):
+    """A Photontable of just a beammap and time flags, in write mode"""
+
+    def __init__(self, filename):
+        self.mode = 'write'
+        self.file = tables.open_file(filename, 'w')
+        self.file.create_group('/', 'beammap')
+        self.beamImage = BEAM
+        self._timeflags = None
+        self._flagset = FlagSet.define(('a', 0, 'first test flag'), ('b', 1, 'second test flag'))
+        self._bmindex = indexing.BeammapIndex(BEAM, np.zeros(BEAM.shape, dtype=int))
+
+    def __del__(self):
+        self.file.close()
+
+
+def _table(directory, rng):
+    pt = _Table(os.path.join(directory, 'timeflags.h5'))
+    flags = dict(a=_random_intervals(rng, 30), b=_random_intervals(rng, 30))
+    for name, (resid, start, stop) in flags.items():
+        pt.flag_intervals(pt.flags.bitmask(name), resid, start, stop)
+    return pt, flags
+
+
+def test_flag_intervals():
+    rng = np.random.default_rng(5)
+    with tempfile.TemporaryDirectory() as d:
+        pt, flags = _table(d, rng)
+        rows = pt.time_flags
+        assert np.all(rows['stop'] > rows['start']), 'Empty intervals must not be stored'
+        assert np.all(np.diff(rows['resID'].astype(int)) >= 0)
+        for names in (('a',), ('b',), ('a', 'b')):
+            expected = set().union(*(_ticks(*flags[n]) for n in names))
+            assert _ticks(*pt.flagged_intervals(names)) == expected, names
+        assert pt.flagged_intervals(())[0].size == 0
+
+        photons = np.zeros(5000, dtype=[('resID', np.uint32), ('time', np.uint32)])
+        photons['resID'] = rng.choice(np.append(BEAM.ravel(), 999), photons.size)  # 999 is not in the beammap
+        photons['time'] = rng.integers(0, NTICKS, photons.size)
+        covered = _ticks(*flags['a'])
+        expected = [(r, t) in covered for r, t in zip(photons['resID'].tolist(), photons['time'].tolist())]
+        assert pt.interval_mask(photons, ('a',)).tolist() == expected
+
+        pt.unflag_intervals(pt.flags.bitmask('a'))
+        assert _ticks(*pt.flagged_intervals(('a',))) == set()
+        assert _ticks(*pt.flagged_intervals(('b',))) == _ticks(*flags['b'])
+        pt.unflag_intervals(pt.flags.bitmask('b'))
+        assert pt.time_flags.size == 0
+
+
+def test_flagged_time():
+    rng = np.random.default_rng(9)
+    with tempfile.TemporaryDirectory() as d:
+        pt, flags = _table(d, rng)
+        edges = np.array([0, 17, 50, 51, 120, NTICKS])
+        flagged = pt.flagged_time(('a', 'b'), edges)
+        assert flagged.shape == BEAM.shape + (edges.size - 1,)
+        covered = _ticks(*flags['a']) | _ticks(*flags['b'])
+        for (x, y), r in np.ndenumerate(BEAM):
+            for i in range(edges.size - 1):
+                ticks = sum((r, t) in covered for t in range(edges[i], edges[i + 1]))
+                assert np.isclose(flagged[x, y, i], ticks / pt.TICKS_PER_SEC), (r, i)
+        pt.unflag_intervals(pt.flags.bitmask(('a', 'b')))
+        assert pt.flagged_time(('a', 'b'), edges) is None
+
+
+if __name__ == '__main__':
+    for name, test in list(globals().items()):
+        if name.startswith('test_'):
+            test()
+            print(f'{name} passed')
@@ -96,13 +96,13 @@ class ParsedBin:
         self._pcube = None
         self._pcube_meta = None
 
-        self.x = np.empty(0, dtype=np.int)
-        self.y = np.empty(0, dtype=np.int)
+        self.x = np.empty(0, dtype=int)
+        self.y = np.empty(0, dtype=int)
         self.tstamp = np.empty(0, dtype=np.uint64)
         self.baseline = np.empty(0, dtype=np.uint64)
         self.phase = np.empty(0, dtype=np.float32)
-        self.roach = np.empty(0, dtype=np.int)
-        self.obs_nphotons = np.empty(0, dtype=np.int)
+        self.roach = np.empty(0, dtype=int)
+        self.obs_nphotons = np.empty(0, dtype=int)
         tic = time.time()
 
         # Parsing the Files and Appending to Photon List
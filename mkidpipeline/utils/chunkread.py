@@ -0,0 +1,240 @@
+"""
+Thread-parallel reads of blosc compressed photontables
+
+HDF5, and so PyTables, runs one call at a time in a process and decompresses chunks while holding the GIL, so threads
+reading a photontable take turns. Parallel reads have therefore been done by processes that pickle the photons back.
+The chunks of a blosc compressed table are, however, independent blosc buffers at known places in the file.
+ChunkReader asks HDF5 only where they are. A pool of threads then reads (os.pread) and decompresses them (numcodecs'
+blosc, which releases the GIL and uses a context per call) straight into the output array. Any number of threads may
+so read the same table at once, with nothing serialized but the lookup of each chunk's location, which is done once.
+
+HDF5 is not thread-safe, even for calls on different files, so every call into it that threads may make at once (the
+chunk lookups here and the PyTables calls of Photontable) takes the one HDF5_LOCK of the process.
+
+However many reads are in progress, at most the process's share of the core budget (mkidpipeline.utils.cores.share)
+of pool threads decode at once.
+
+Only tables that are uncompressed or compressed by the blosc (v1) filter, without fletcher32, are supported (see
+supported), and the chunk locations need the direct chunking API of PyTables 3.10. Chunks HDF5 stored unfiltered or
+has not written are read through PyTables.
+
+Functions
+
+    supported       : Whether ChunkReader can read a table
+
+Classes
+
+    ChunkReader     : Reads rows of a table with the I/O and decompression spread over threads
+"""
+import os
+import threading
+from concurrent.futures import ThreadPoolExecutor
+
+import numpy as np
+
+from mkidpipeline.utils import cores
+
+try:
+    import numcodecs.blosc as blosc
+except ImportError:
+    blosc = None
+
+# Rows decoded per task of ChunkReader.scan, rounded to whole chunks
+SCAN_BLOCK_ROWS = 4 * 1024 ** 2
+
+HDF5_LOCK = threading.RLock()
+# A fork copies the lock as it is, so one held by another thread mid-call would stay held in the child for good
+os.register_at_fork(before=HDF5_LOCK.acquire, after_in_parent=HDF5_LOCK.release, after_in_child=HDF5_LOCK.release)
+
+_pool = None
+_pool_pid = None
+_pool_lock = threading.Lock()
+_local = threading.local()
+_decoding = None  # [Condition, number of pool threads running tasks]
+
+
+def _executor():
+    """The thread pool of this process, threads don't survive a fork so a forked child starts its own"""
+    global _pool, _pool_pid, _decoding
+    with _pool_lock:
+        if _pool is None or _pool_pid != os.getpid():
+            _pool = ThreadPoolExecutor(max_workers=cores.CORE_BUDGET, thread_name_prefix='ChunkReader',
+                                       initializer=setattr, initargs=(_local, 'worker', True))
+            _pool_pid = os.getpid()
+            _decoding = [threading.Condition(), 0]
+        return _pool
+
+
+def _run(func, items):
+    """
+    Return [func(i) for i in items], in the pool unless called from one of its threads or there is one item. The items
+    are worked through by as many pool threads as the process's core share allows at the time, counting those busy with
+    other calls.
+    """
+    items = list(items)
+    if len(items) < 2 or getattr(_local, 'worker', False):
+        return [func(i) for i in items]
+    pool = _executor()
+    gate = _decoding
+    results = [None] * len(items)
+    todo = iter(range(len(items)))
+    todo_lock = threading.Lock()
+
+    def drain():
+        with gate[0]:
+            while gate[1] >= cores.share():
+                gate[0].wait()
+            gate[1] += 1
+        try:
+            while True:
+                with todo_lock:
+                    i = next(todo, None)
+                if i is None:
+                    return
+                results[i] = func(items[i])
+        finally:
+            with gate[0]:
+                gate[1] -= 1
+                gate[0].notify()
+
+    for f in [pool.submit(drain) for _ in range(min(len(items), cores.share()))]:
+        f.result()
+    return results
+
+
+def supported(table):
+    """Return True if ChunkReader can read the PyTables table"""
+    if not hasattr(table, 'chunk_info'):  # PyTables < 3.10
+        return False
+    filters = table.filters
+    if table.chunkshape is None or len(table.chunkshape) != 1 or filters.fletcher32:
+        return False
+    if not filters.complevel:
+        return True
+    return blosc is not None and (filters.complib or '').split(':')[0] == 'blosc'
+
+
+class ChunkReader:
+    """
+    Reads rows of a chunked PyTables table with the file reads and decompression done by many threads, see the module
+    docstring. Methods may be called from any number of threads. The table must not change while the reader is in use.
+    """
+
+    def __init__(self, table):
+        """
+        :param table: an open PyTables Table for which supported(table) is True
+        """
+        if not supported(table):
+            raise ValueError(f'{table} is not stored in a way ChunkReader can read')
+        self.table = table
+        self.dtype = table.dtype
+        self.nrows = table.nrows
+        self.chunkrows = int(table.chunkshape[0])
+        self.compressed = bool(table.filters.complevel)
+        self._fd = os.open(table._v_file.filename, os.O_RDONLY)
+        nchunks = -(-self.nrows // self.chunkrows)
+        self._offset = np.full(nchunks, -1, dtype=np.int64)  # -1: not yet looked up, -2: read through PyTables
+        self._size = np.zeros(nchunks, dtype=np.int64)
+
+    def close(self):
+        if self._fd is not None:
+            os.close(self._fd)
+            self._fd = None
+
+    def __del__(self):
+        try:
+            self.close()
+        except Exception:
+            pass
+
+    def _locate(self, first, stop):
+        """Look up the offsets and sizes of the chunks first to stop-1"""
+        todo = np.flatnonzero(self._offset[first:stop] == -1) + first
+        if not todo.size:
+            return
+        with HDF5_LOCK:
+            for i in todo:
+                if self._offset[i] != -1:
+                    continue
+                info = self.table.chunk_info((int(i) * self.chunkrows,))
+                if info.offset is None or info.filter_mask:
+                    self._size[i], self._offset[i] = 0, -2
+                else:
+                    self._size[i], self._offset[i] = info.size, info.offset
+
+    def _decode(self, i, lo, hi, out):
+        """Put rows lo to hi-1 of chunk i (counted from the chunk start) into out"""
+        offset = self._offset[i]
+        if offset == -2:
+            start = int(i) * self.chunkrows
+            with HDF5_LOCK:
+                out[:] = self.table.read(start + lo, start + hi)
+            return
+        raw = os.pread(self._fd, int(self._size[i]), int(offset))
+        if not self.compressed:
+            out[:] = np.frombuffer(raw, dtype=self.dtype)[lo:hi]
+        elif lo == 0 and hi == self.chunkrows:
+            blosc.decompress(raw, out.view(np.uint8))
+        else:
+            scratch = np.empty(self.chunkrows, dtype=self.dtype)
+            blosc.decompress(raw, scratch.view(np.uint8))
+            out[:] = scratch[lo:hi]
+
+    def _pieces(self, start, stop, at):
+        """The (chunk, lo, hi, output position) pieces of rows start to stop-1 placed from output position at"""
+        first, last = start // self.chunkrows, -(-stop // self.chunkrows)
+        self._locate(first, last)
+        for i in range(first, last):
+            base = i * self.chunkrows
+            lo, hi = max(start - base, 0), min(stop - base, self.chunkrows)
+            yield i, lo, hi, at
+            at += hi - lo
+
+    def read(self, start=0, stop=None, ranges=None):
+        """
+        Return the rows start to stop-1 of the table, or if ranges is given the rows of each (start, stop) in turn
+
+        :param ranges: an iterable of (start, stop) row ranges or a pair of arrays of starts and stops
+        """
+        if ranges is None:
+            ranges = ((start, self.nrows if stop is None else min(stop, self.nrows)),)
+        elif len(ranges) == 2 and isinstance(ranges[0], np.ndarray):
+            ranges = zip(*ranges)
+        pieces, at = [], 0
+        for a, b in ranges:
+            a, b = int(a), min(int(b), self.nrows)
+            if b > a:
+                pieces.extend(self._pieces(a, b, at))
+                at += b - a
+        out = np.empty(at, dtype=self.dtype)
+        if not pieces:
+            return out
+        # About 4 tasks per thread so that threads finishing early pick up the slack
+        ntasks = min(len(pieces), 4 * cores.share())
+        bounds = np.linspace(0, len(pieces), ntasks + 1).astype(int)
+
+        def work(k):
+            for i, lo, hi, o in pieces[bounds[k]:bounds[k + 1]]:
+                self._decode(i, lo, hi, out[o:o + hi - lo])
+
+        _run(work, range(ntasks))
+        return out
+
+    def scan(self, func, start=0, stop=None, block_rows=SCAN_BLOCK_ROWS):
+        """
+        Return [func(rows, first) for each block of rows start to stop-1], computed in the thread pool. first is the
+        row number of the block's first row. Only a few blocks are decoded at a time, so e.g. filters or reductions
+        of the whole table need not hold all of it in memory.
+        """
+        stop = self.nrows if stop is None else min(stop, self.nrows)
+        block_rows = max(block_rows // self.chunkrows, 1) * self.chunkrows
+        blocks = [(a, min(a + block_rows, stop)) for a in range(start, stop, block_rows)]
+
+        def work(block):
+            a, b = block
+            out = np.empty(b - a, dtype=self.dtype)
+            for i, lo, hi, o in self._pieces(a, b, 0):
+                self._decode(i, lo, hi, out[o:o + hi - lo])
+            return func(out, a)
+
+        return _run(work, blocks)
@@ -0,0 +1,204 @@
+"""
+The CPU core budget shared by the threads of all pipeline processes
+
+numexpr, BLAS/OpenMP (and so the native kernels built on them) and blosc each start a thread per core in every process
+by default. With a pool of worker processes that oversubscribes the machine many times over, yet a single process left
+running at the end of a step uses only its own threads unless they are allowed to grow. Here the budget, CORE_BUDGET
+cores, is divided among the processes currently running pipeline tasks (those within busy). Each gets an equal share of
+threads for all those libraries, recomputed whenever a process starts or finishes a task.
+
+A process applies its share when it starts a task and then at safe points (see rebalance), the libraries' thread pools
+can't be resized while another thread is using them. The budget state is shared with the processes forked from this
+one, the shares of processes that die are reclaimed.
+
+CORE_BUDGET is the number of cores this process may use (affinity and cgroup quota) unless MKIDPIPE_CORES is set.
+
+Functions
+
+    usable_cores    : Number of cores this process may run on
+    busy            : Context manager counting this process as running a pipeline task
+    share           : Number of threads this process may use now
+    rebalance       : Resize the thread pools of this process to its share if that has changed
+    limit_threads   : Set the number of threads numexpr, BLAS/OpenMP and blosc use in this process
+"""
+import ctypes
+import multiprocessing as mp
+import os
+import threading
+from contextlib import contextmanager
+
+from mkidcore.corelog import getLogger
+from mkidpipeline.utils.sysinfo import cgroup_dirs, pid_alive
+
+try:
+    import threadpoolctl
+except ImportError:
+    threadpoolctl = None
+
+MAX_PROCESSES = 1024
+
+
+def _cgroup_cpu_quota():
+    """Return the CPU quota of this process's cgroup in cores, or None if there is none"""
+    for d in cgroup_dirs('cpu'):
+        try:
+            if os.path.isfile(os.path.join(d, 'cpu.max')):  # cgroup v2
+                with open(os.path.join(d, 'cpu.max')) as f:
+                    quota, period = f.read().split()
+            else:
+                with open(os.path.join(d, 'cpu.cfs_quota_us')) as f, open(os.path.join(d, 'cpu.cfs_period_us')) as g:
+                    quota, period = f.read().strip(), g.read().strip()
+        except (OSError, ValueError):
+            continue
+        if quota in ('max', '-1'):
+            return None
+        return max(int(quota) // int(period), 1)
+    return None
+
+
+def usable_cores():
+    """The number of cores this process may run on, limited by its CPU affinity and the CPU quota of its cgroup"""
+    try:
+        n = len(os.sched_getaffinity(0))
+    except AttributeError:
+        n = os.cpu_count() or 1
+    quota = _cgroup_cpu_quota()
+    return max(min(n, quota) if quota else n, 1)
+
+
+CORE_BUDGET = int(os.environ.get('MKIDPIPE_CORES', 0)) or usable_cores()
+
+# Shared with the processes forked from this one: the pids of the processes running tasks and a count of the changes
+_lock = mp.Lock()
+_slots = mp.RawArray(ctypes.c_int, MAX_PROCESSES)  # pid 0 marks a free slot
+_generation = mp.RawValue('q', 0)
+
+# The state of this process, reset in forked children by _mine
+_local_lock = threading.Lock()
+_pid = os.getpid()
+_depth = 0  # nesting of busy
+_applied = None  # (generation, threads) last applied
+
+
+def _busy_pids():
+    """Return the pids of the processes running tasks, dropping those that have died, call with _lock held"""
+    pids = []
+    for i, pid in enumerate(_slots):
+        if not pid:
+            continue
+        if pid_alive(pid):
+            pids.append(pid)
+        else:
+            _slots[i] = 0
+            _generation.value += 1
+    return pids
+
+
+def _mine():
+    """Forget the state a forked child inherited from its parent, call with _local_lock held"""
+    global _pid, _depth, _applied
+    if _pid != os.getpid():
+        _pid, _depth, _applied = os.getpid(), 0, None
+
+
+def _claim():
+    pid = os.getpid()
+    with _lock:
+        pids = _busy_pids()
+        if pid in pids:
+            return
+        for i, p in enumerate(_slots):
+            if not p:
+                _slots[i] = pid
+                _generation.value += 1
+                return
+    getLogger(__name__).debug(f'More than {MAX_PROCESSES} busy processes, process {pid} is not counted')
+
+
+def _release():
+    pid = os.getpid()
+    with _lock:
+        for i, p in enumerate(_slots):
+            if p == pid:
+                _slots[i] = 0
+                _generation.value += 1
+
+
+def share():
+    """
+    Return the number of threads this process may use: an equal part of CORE_BUDGET for each busy process, the cores
+    left over going to the processes that became busy first, and at least 1
+    """
+    with _lock:
+        pids = _busy_pids()
+    pid = os.getpid()
+    if pid not in pids:
+        pids.append(pid)
+    n = len(pids)
+    return max(CORE_BUDGET // n + (pids.index(pid) < CORE_BUDGET % n), 1)
+
+
+def limit_threads(n):
+    """Set the number of threads used by numexpr, BLAS and OpenMP libraries, and blosc in this process to n"""
+    n = max(int(n), 1)
+    try:
+        import numexpr
+        numexpr.set_num_threads(min(n, numexpr.MAX_THREADS))
+    except ImportError:
+        pass
+    try:
+        import tables
+        tables.set_blosc_max_threads(n)
+    except (ImportError, AttributeError):
+        pass
+    if threadpoolctl is not None:
+        threadpoolctl.threadpool_limits(limits=n)
+
+
+def _apply(force=False):
+    global _applied
+    generation = _generation.value
+    if not force and _applied is not None and _applied[0] == generation:
+        return
+    n = share()
+    if _applied is None or _applied[1] != n:
+        limit_threads(n)
+        getLogger(__name__).debug(f'Process {os.getpid()} using {n} of {CORE_BUDGET} cores')
+    _applied = generation, n
+
+
+def rebalance():
+    """
+    Resize the thread pools of this process to its current share if another process has started or finished a task
+    since they were last set. Does nothing outside of busy or in a thread other than the main one, call it only where no
+    other thread of the process may be running numexpr, BLAS or blosc work. This is cheap when nothing has changed.
+    """
+    if threading.current_thread() is not threading.main_thread():
+        return
+    with _local_lock:
+        _mine()
+        if _depth:
+            _apply()
+
+
+@contextmanager
+def busy():
+    """
+    Count this process as running a pipeline task within the context, resizing its thread pools to its share when it
+    starts. Nests, only the outermost context counts.
+    """
+    global _depth
+    with _local_lock:
+        _mine()
+        _depth += 1
+        first = _depth == 1
+        if first:
+            _claim()
+            _apply(force=True)
+    try:
+        yield
+    finally:
+        with _local_lock:
+            _depth -= 1
+            if not _depth:
+                _release()
@@ -0,0 +1,381 @@
+"""
+Sparse drizzle kernel used by mkidpipeline.steps.drizzler
+
+The square-kernel drizzle of an input frame onto an output grid is linear in the input data. For a fixed input WCS,
+output WCS and pixfrac, the fraction of each (shrunken) input pixel falling on each output pixel is therefore a
+constant (nout x nin) sparse matrix, the footprint. Computing it once per WCS solution and applying it to every time
+and wavelength plane at once replaces a drizzle.Drizzle.add_image call per plane.
+
+Functions
+
+    overlap_matrix  : Compute the input->output pixel overlap fractions as a CSR matrix
+    drizzle_planes  : Drizzle a stack of cps frames through a footprint, equivalent to one add_image call per frame
+    drizzle_events  : Drizzle individual photons through a footprint without forming detector frames
+    histogram       : np.bincount computed without holding the GIL
+    histogramdd     : np.histogramdd computed without holding the GIL, for binning photons into frames in threads
+    tree_sum        : Deterministic pairwise sum of partial canvases
+    footprint_key   : Hash identifying a footprint by the two WCS, shapes, and pixfrac
+
+Classes
+
+    FootprintCache  : In memory and (optionally) on disk cache of footprints
+"""
+import os
+import hashlib
+import threading
+import zipfile
+from collections import OrderedDict
+from concurrent.futures import ThreadPoolExecutor
+
+import numpy as np
+import scipy.sparse
+from mkidcore.corelog import getLogger
+
+# Planes per thread below which it is not worth splitting a drizzle over threads
+MIN_PLANES_PER_THREAD = 4
+
+
+def _edge_integral(x1, y1, x2, y2):
+    """
+    Signed integral of clip(y, 0, 1) along the segment (x1, y1)->(x2, y2) over the part of the segment with x in
+    [0, 1]. Summed over the edges of a closed polygon this gives (minus, for counterclockwise polygons) the area of the
+    polygon within the unit square. The clipped line is linear between its crossings of y=0 and y=1 so the
+    midpoint rule on the three sub-intervals is exact.
+    """
+    dx = x2 - x1
+    lo = np.clip(np.minimum(x1, x2), 0, 1)
+    hi = np.clip(np.maximum(x1, x2), 0, 1)
+    with np.errstate(divide='ignore', invalid='ignore'):
+        m = np.where(dx != 0, (y2 - y1) / dx, 0)
+        c = y1 - m * x1
+        b0 = np.where(m != 0, -c / m, lo)
+        b1 = np.where(m != 0, (1 - c) / m, lo)
+    pts = np.sort(np.stack([lo, np.clip(b0, lo, hi), np.clip(b1, lo, hi), hi]), axis=0)
+    mid = (pts[1:] + pts[:-1]) / 2
+    return np.sign(dx) * (np.diff(pts, axis=0) * np.clip(m * mid + c, 0, 1)).sum(axis=0)
+
+
+def _box_overlap(px, py, u, v):
+    """Area of the convex quadrilaterals (px[i], py[i]) within the unit output pixels centered on (u[i], v[i])"""
+    x = px - (u[:, None] - 0.5)
+    y = py - (v[:, None] - 0.5)
+    area = np.zeros(x.shape[0])
+    for k in range(x.shape[1]):
+        kn = (k + 1) % x.shape[1]
+        area += _edge_integral(x[:, k], y[:, k], x[:, kn], y[:, kn])
+    return np.abs(area)
+
+
+def input_corners(in_wcs, out_wcs, in_shape, pixfrac=1.0):
+    """
+    Return the (nin, 4) x and y output pixel coordinates of the corners of every input pixel after shrinking it by
+    pixfrac. Pixels are numbered in raveled (row, column) order of an array of shape in_shape.
+    """
+    ny, nx = in_shape
+    h = pixfrac / 2
+    r, c = np.mgrid[:ny, :nx]
+    c = c.ravel().astype(float)
+    r = r.ravel().astype(float)
+    cx = np.stack([c - h, c + h, c + h, c - h], axis=1)
+    cy = np.stack([r - h, r - h, r + h, r + h], axis=1)
+    ra, dec = in_wcs.all_pix2world(cx.ravel(), cy.ravel(), 0)
+    ox, oy = out_wcs.all_world2pix(ra, dec, 0)
+    return ox.reshape(-1, 4), oy.reshape(-1, 4)
+
+
+def overlap_matrix(in_wcs, out_wcs, in_shape, out_shape, pixfrac=1.0):
+    """
+    Compute the drizzle footprint of an input frame on an output grid
+
+    :param in_wcs: 2D astropy.wcs.WCS of the input frame
+    :param out_wcs: 2D astropy.wcs.WCS of the output grid
+    :param in_shape: (rows, columns) of the input frame array
+    :param out_shape: (rows, columns) of the output grid array
+    :param pixfrac: fraction by which input pixels are shrunk before drizzling
+    :return: scipy.sparse.csr_matrix of shape (nout, nin), element [o, i] is the fraction of the shrunken input pixel i
+    that lands on output pixel o. Pixels are in raveled array order.
+    """
+    ox, oy = input_corners(in_wcs, out_wcs, in_shape, pixfrac=pixfrac)
+    nin = ox.shape[0]
+    nout = int(np.prod(out_shape))
+
+    # output pixel u spans [u-0.5, u+0.5)
+    u0 = np.floor(ox.min(axis=1) + 0.5).astype(int)
+    v0 = np.floor(oy.min(axis=1) + 0.5).astype(int)
+    nu = int((np.floor(ox.max(axis=1) + 0.5).astype(int) - u0).max()) + 1
+    nv = int((np.floor(oy.max(axis=1) + 0.5).astype(int) - v0).max()) + 1
+
+    du, dv = np.meshgrid(np.arange(nu), np.arange(nv), indexing='ij')
+    u = (u0[:, None] + du.ravel()).ravel()
+    v = (v0[:, None] + dv.ravel()).ravel()
+    ipix = np.repeat(np.arange(nin), du.size)
+    on_grid = (u >= 0) & (u < out_shape[1]) & (v >= 0) & (v < out_shape[0])
+    u, v, ipix = u[on_grid], v[on_grid], ipix[on_grid]
+
+    area = _box_overlap(ox[ipix], oy[ipix], u, v)
+    jaco = 0.5 * np.abs((ox[:, 2] - ox[:, 0]) * (oy[:, 3] - oy[:, 1]) - (ox[:, 3] - ox[:, 1]) * (oy[:, 2] - oy[:, 0]))
+    with np.errstate(divide='ignore', invalid='ignore'):
+        frac = np.where(jaco[ipix] > 0, area / jaco[ipix], 0)
+    keep = frac > 0
+    return scipy.sparse.csr_matrix((frac[keep], (v[keep] * out_shape[1] + u[keep], ipix[keep])), shape=(nout, nin))
+
+
+def _drizzle_block(footprint, data, wht):
+    num = footprint @ (data * wht)
+    den = footprint @ wht
+    return np.divide(num, den, out=np.zeros_like(num), where=den > 0)
+
+
+def drizzle_planes(footprint, planes, out_shape, expin=1.0, ncpu=1):
+    """
+    Drizzle a stack of frames in counts per second through a footprint from overlap_matrix.
+
+    Each plane is treated as drizzle.Drizzle.add_image(plane, expin=expin, inwht=plane.astype(bool), in_units='cps')
+    into a fresh Drizzle object and the per-plane outsci are returned. Planes are split over ncpu threads, the sparse
+    products release the GIL.
+
+    :param footprint: (nout, nin) sparse matrix
+    :param planes: (nplanes, rows, columns) array
+    :param out_shape: (rows, columns) of the output grid
+    :param expin: exposure time of each plane, only its sign matters for the result
+    :param ncpu: number of threads to use
+    :return: (nplanes,) + out_shape array of drizzled cps
+    """
+    nplanes = planes.shape[0]
+    data = planes.reshape(nplanes, -1).T
+    wht = (data != 0) * float(expin)
+
+    nthreads = max(1, min(ncpu, nplanes // MIN_PLANES_PER_THREAD))
+    if nthreads == 1:
+        out = _drizzle_block(footprint, data, wht)
+    else:
+        blocks = np.array_split(np.arange(nplanes), nthreads)
+        with ThreadPoolExecutor(max_workers=nthreads) as pool:
+            parts = pool.map(lambda b: _drizzle_block(footprint, data[:, b], wht[:, b]), blocks)
+            out = np.hstack(list(parts))
+    return out.T.reshape((nplanes,) + tuple(out_shape))
+
+
+def histogram(index, size, weights=None):
+    """
+    Return np.bincount(index, weights, minlength=size) as floats. The sum is done by scipy's sparse code, which unlike
+    np.bincount and np.histogramdd releases the GIL, so threads binning at once run in parallel. The weights of each
+    bin are added in the order given, as by np.bincount.
+
+    :param index: bin of each value, in [0, size)
+    :param size: number of bins
+    :param weights: optional weight of each value
+    """
+    index = np.asarray(index)
+    data = np.ones(index.size) if weights is None else np.asarray(weights, dtype=float)
+    return scipy.sparse.coo_matrix((data, (index, np.zeros_like(index))), shape=(size, 1)).toarray().ravel()
+
+
+def _bin_index(edges, values):
+    """Bin of each value, -1 outside the edges, with the last bin closed as in np.histogramdd"""
+    values = np.asarray(values)
+    if values.dtype.kind in 'iu' and np.array_equal(edges, edges[0] + np.arange(edges.size)):
+        index = values.astype(np.int64) - int(edges[0])  # e.g. pixel coordinates, unit bins need no search
+    else:
+        index = np.searchsorted(edges, values, side='right') - 1
+    index[values == edges[-1]] = edges.size - 2
+    index[(index < 0) | (index >= edges.size - 1)] = -1
+    return index
+
+
+def histogramdd(columns, edges, weights=None):
+    """
+    Return np.histogramdd(np.vstack(columns).T, edges, weights=weights)[0] without holding the GIL for all but a
+    few short steps. Values are binned with np.searchsorted and summed with histogram.
+
+    :param columns: sequence of equal length arrays, the coordinates along each dimension
+    :param edges: sequence of increasing bin edge arrays, one per column
+    :param weights: optional weight of each sample
+    """
+    edges = [np.asarray(e, dtype=float) for e in edges]
+    shape = tuple(len(e) - 1 for e in edges)
+    flat = np.zeros(len(columns[0]), dtype=np.int64)
+    keep = np.ones(flat.size, dtype=bool)
+    for column, e, n in zip(columns, edges, shape):
+        index = _bin_index(e, column)
+        keep &= index >= 0
+        flat *= n
+        flat += index
+    weights = None if weights is None else np.asarray(weights)[keep]
+    return histogram(flat[keep], int(np.prod(shape)), weights=weights).reshape(shape)
+
+
+def _event_histogram(pixels, planes, nin, weights):
+    """Sparse (pixel, plane) histogram of a block of events, returned as unique linear indices and their sums"""
+    lin = planes.astype(np.int64) * nin + pixels
+    uniq, inv = np.unique(lin, return_inverse=True)
+    return uniq, histogram(inv.ravel(), uniq.size, weights=weights)
+
+
+def drizzle_events(footprint, pixels, planes, nplanes, weights=None, coverage=None, ncpu=1):
+    """
+    Drizzle photons directly through a footprint. Only (pixel, plane) pairs that actually contain photons are
+    touched, so the cost scales with the number of photons rather than the number of (mostly empty) frames.
+
+    Events are split over ncpu threads, each building its own sparse partial histogram, and the partials are merged
+    before a single sparse product with the footprint.
+
+    The result matches drizzle_planes run on the count frames, outsci * expin, with each input pixel also weighted by
+    coverage: the weighted mean of the nonzero input counts landing on each output pixel of a plane.
+
+    :param footprint: (nout, nin) sparse matrix from overlap_matrix
+    :param pixels: raveled input pixel index of each event
+    :param planes: output plane index of each event, in [0, nplanes)
+    :param nplanes: number of output planes
+    :param weights: optional per event weight
+    :param coverage: (nin,) input pixel weights, e.g. 0 for masked pixels. Defaults to 1.
+    :param ncpu: number of threads to use
+    :return: (nplanes, nout) arrays of drizzled counts and of the summed weight of the inputs behind them
+    """
+    nout, nin = footprint.shape
+    coverage = np.ones(nin) if coverage is None else np.asarray(coverage, dtype=float)
+
+    pixels = np.asarray(pixels, dtype=np.int64)
+    planes = np.asarray(planes, dtype=np.int64)
+    nthreads = max(1, min(ncpu, pixels.size // 100000))
+    blocks = np.array_split(np.arange(pixels.size), nthreads)
+    work = lambda b: _event_histogram(pixels[b], planes[b], nin, None if weights is None else weights[b])
+    if nthreads == 1:
+        partials = [work(blocks[0])]
+    else:
+        with ThreadPoolExecutor(max_workers=nthreads) as pool:
+            partials = list(pool.map(work, blocks))
+
+    lin = np.concatenate([p[0] for p in partials])
+    val = np.concatenate([p[1] for p in partials])
+    if nthreads > 1:  # a (pixel, plane) pair may be in several partials
+        lin, inv = np.unique(lin, return_inverse=True)
+        val = histogram(inv.ravel(), lin.size, weights=val)
+    wht = (val != 0) * coverage[lin % nin]  # drizzle_planes' inwht, times the coverage
+    index = (lin % nin, lin // nin)
+    counts = (footprint @ scipy.sparse.csr_matrix((val * wht, index), shape=(nin, nplanes))).toarray().T
+    cover = (footprint @ scipy.sparse.csr_matrix((wht, index), shape=(nin, nplanes))).toarray().T
+    np.divide(counts, cover, out=counts, where=cover > 0)
+    return counts, cover
+
+
+def tree_sum(partials):
+    """
+    Sum equally shaped partial canvases pairwise, ((p0 + p1) + (p2 + p3)) + ..., in the order given. The result
+    does not depend on which worker produced which partial or when, and rounding error grows as log(n) rather than n.
+    partials may be a generator, each partial is added as soon as it has a partner so at most log2(n) + 1 are held at
+    once. The partials are summed in place, the result is the (modified) first partial.
+    """
+    pending = []  # (level, sum of 2**level partials), levels strictly decreasing
+    for partial in partials:
+        level = 0
+        while pending and pending[-1][0] == level:
+            earlier = pending.pop()[1]
+            earlier += partial
+            partial, level = earlier, level + 1
+        pending.append((level, partial))
+    if not pending:
+        raise ValueError('Nothing to sum')
+    total = pending.pop()[1]
+    while pending:
+        earlier = pending.pop()[1]
+        earlier += total
+        total = earlier
+    return total
+
+
+def footprint_key(in_wcs, out_wcs, in_shape, out_shape, pixfrac):
+    """Return a hex digest that uniquely identifies the footprint overlap_matrix would compute for the arguments"""
+    settings = (in_wcs.to_header_string(relax=True), out_wcs.to_header_string(relax=True), tuple(map(int, in_shape)),
+                tuple(map(int, out_shape)), float(pixfrac))
+    return hashlib.md5(str(settings).encode()).hexdigest()
+
+
+class FootprintCache:
+    """
+    Cache of drizzle footprints keyed by footprint_key.
+
+    Footprints are kept in memory (least recently used dropped beyond max_bytes) and, if directory is set, stored
+    there as CSR .npz files so reruns (e.g. with a different wavelength binning) skip the geometry entirely.
+    """
+
+    def __init__(self, directory=None, max_bytes=1024 ** 3):
+        """
+        :param directory: directory to store footprints in, None for a memory only cache
+        :param max_bytes: approximate upper bound on the memory used by cached footprints
+        """
+        self.directory = directory
+        self.max_bytes = max_bytes
+        self._cache = OrderedDict()
+        self._bytes = 0
+        self._lock = threading.Lock()
+        self.hits = 0
+        self.misses = 0
+        if directory:
+            os.makedirs(directory, exist_ok=True)
+
+    def _file(self, key):
+        return os.path.join(self.directory, f'footprint_{key}.npz')
+
+    def _remember(self, key, footprint):
+        size = footprint.data.nbytes + footprint.indices.nbytes + footprint.indptr.nbytes
+        with self._lock:
+            if key in self._cache:
+                return
+            self._cache[key] = footprint
+            self._bytes += size
+            while self._bytes > self.max_bytes and len(self._cache) > 1:
+                _, old = self._cache.popitem(last=False)
+                self._bytes -= old.data.nbytes + old.indices.nbytes + old.indptr.nbytes
+
+    def get(self, in_wcs, out_wcs, in_shape, out_shape, pixfrac=1.0):
+        """Return the footprint for the arguments (see overlap_matrix), computing and storing it if needed"""
+        key = footprint_key(in_wcs, out_wcs, in_shape, out_shape, pixfrac)
+        with self._lock:
+            try:
+                self._cache.move_to_end(key)
+                self.hits += 1
+                return self._cache[key]
+            except KeyError:
+                pass
+
+        footprint = None
+        if self.directory:
+            try:
+                footprint = scipy.sparse.load_npz(self._file(key)).tocsr()
+            except FileNotFoundError:
+                pass
+            except (IOError, ValueError, KeyError, EOFError, zipfile.BadZipFile):
+                # e.g. truncated by a run that was killed, it is rebuilt and replaced below
+                getLogger(__name__).warning(f'Unreadable footprint {self._file(key)}, recomputing it')
+
+        with self._lock:
+            if footprint is None:
+                self.misses += 1
+            else:
+                self.hits += 1
+        if footprint is None:
+            footprint = overlap_matrix(in_wcs, out_wcs, in_shape, out_shape, pixfrac=pixfrac)
+            if self.directory:
+                tmp = self._file(key) + f'.{os.getpid()}.{threading.get_ident()}.tmp.npz'
+                try:
+                    scipy.sparse.save_npz(tmp, footprint, compressed=False)
+                    os.replace(tmp, self._file(key))
+                except IOError:
+                    getLogger(__name__).warning(f'Unable to cache footprint to {self._file(key)}', exc_info=True)
+
+        self._remember(key, footprint)
+        return footprint
+
+    def clear(self, disk=True):
+        """Empty the cache, also removing any footprints stored on disk if disk is set"""
+        with self._lock:
+            self._cache.clear()
+            self._bytes = 0
+        if disk and self.directory:
+            for f in os.listdir(self.directory):
+                if f.startswith('footprint_') and f.endswith('.npz'):
+                    try:
+                        os.remove(os.path.join(self.directory, f))
+                    except IOError:
+                        getLogger(__name__).error(f'Unable to remove {f} from footprint cache')
@@ -0,0 +1,255 @@
+"""
+Time-series index of observing metadata and the beammap index of a photontable
+
+Observing metadata is a dict of key: value | mkidcore.metadata.MetadataSeries pairs. A MetadataSeries lookup bisects
+that key's own times, so resolving every key at every sample time of e.g. a WCS sequence costs
+nkeys * nsamples python calls. MetadataIndex instead merges the change times of all the series into one sorted array.
+Each position in it is a metadata state, and for each key it records which record is in effect in each state.
+Finding the states of any number of times is then a single np.searchsorted, and the metadata need only be looked up
+once per distinct state (as Photontable.get_wcs does).
+
+Parsing metadata (unpickling h5 attributes, reading obslogs) is the other repeated cost, so indices and parsed metadata
+are kept in a process-wide cache keyed by the identity (path, mtime, size) of the files they came from.
+
+Photons carry a resID, not a pixel, so per-photon flag tests need the beammap inverted. BeammapIndex does this once and
+keeps lookup tables from resID to pixel and to pixel flags, making per-photon flag filtering a single gather.
+
+Functions
+
+    file_key        : Key identifying the current version of a file
+    cached          : Process-wide LRU cache of parsed metadata
+    clear_cache     : Empty the process-wide cache
+
+Classes
+
+    MetadataIndex   : Index of a metadata dict, answers metadata at one or many times
+    BeammapIndex    : resID <-> pixel lookup tables and the pixel flags of a beammap
+"""
+import os
+import threading
+from collections import OrderedDict
+
+import numpy as np
+
+import mkidcore.metadata
+from mkidcore.corelog import getLogger
+
+# Number of entries kept by cached
+CACHE_SIZE = 256
+
+_cache = OrderedDict()
+_cache_lock = threading.Lock()
+
+
+def file_key(path):
+    """Return (path, mtime, size) for path, this changes whenever the file is rewritten"""
+    st = os.stat(path)
+    return os.path.realpath(path), st.st_mtime_ns, st.st_size
+
+
+def cached(key, build):
+    """
+    Return the cached value for key, calling build() to create it on a miss. The cache is shared by all threads in
+    the process; the value must not be modified by the caller.
+    """
+    with _cache_lock:
+        try:
+            _cache.move_to_end(key)
+            return _cache[key]
+        except KeyError:
+            pass
+    value = build()
+    with _cache_lock:
+        _cache[key] = value
+        while len(_cache) > CACHE_SIZE:
+            _cache.popitem(last=False)
+    return value
+
+
+def clear_cache():
+    with _cache_lock:
+        _cache.clear()
+
+
+class MetadataIndex:
+    """
+    Immutable index of a dict of key: value | MetadataSeries pairs.
+
+    Semantics match MetadataSeries.get(timestamp, preceeding=True): a series key takes its most recent record at or
+    before the requested time and is missing before its first record. A timestamp of None gives the first record of
+    every series.
+    """
+
+    def __init__(self, metadata):
+        """
+        :param metadata: dict of key: value | MetadataSeries pairs
+        """
+        self.constants = {}
+        self._times = {}
+        self._values = {}
+        for k, v in metadata.items():
+            if isinstance(v, mkidcore.metadata.MetadataSeries):
+                self._times[k] = np.asarray(v.times, dtype=float)
+                self._values[k] = list(v.values)
+            else:
+                self.constants[k] = v
+        self._build()
+
+    @classmethod
+    def from_columns(cls, names, key, time, values, extra=None):
+        """
+        Create an index from the columns returned by to_columns
+        :param names: list of key names, key ids index into this
+        :param key: key id of each record
+        :param time: time of each record, NaN for constant keys
+        :param values: value of each record
+        :param extra: optional dict of further key: value | MetadataSeries pairs to index
+        """
+        index = cls(extra or {})
+        for k in names:
+            index._times[k] = []
+            index._values[k] = []
+        for i, t, v in zip(key, time, values):
+            k = names[i]
+            if np.isnan(t):
+                index.constants[k] = v
+                del index._times[k], index._values[k]
+            else:
+                index._times[k].append(t)
+                index._values[k].append(v)
+        index._times = {k: np.asarray(t, dtype=float) for k, t in index._times.items()}
+        index._build()
+        return index
+
+    def to_columns(self):
+        """
+        Return (names, key ids, times, values) with one record for each constant (time NaN) and series record,
+        ordered by key then time
+        """
+        names = self.keys()
+        key, time, values = [], [], []
+        for i, k in enumerate(names):
+            if k in self.constants:
+                key.append(i)
+                time.append(np.nan)
+                values.append(self.constants[k])
+            else:
+                key.extend([i] * len(self._values[k]))
+                time.extend(self._times[k])
+                values.extend(self._values[k])
+        return names, np.array(key, dtype=np.uint16), np.array(time, dtype=float), values
+
+    def _build(self):
+        if self._times:
+            self.times = np.unique(np.concatenate([t for t in self._times.values()]))
+        else:
+            self.times = np.zeros(0)
+        # rows[k][s] is the record of key k in effect in state s, -1 if k has no record yet
+        self._rows = {k: np.searchsorted(t, self.times, side='right') - 1 for k, t in self._times.items()}
+
+    def __contains__(self, key):
+        return key in self.constants or key in self._values
+
+    def keys(self):
+        return list(self.constants) + list(self._values)
+
+    def states(self, timestamps):
+        """
+        Return the metadata state index for each timestamp, -1 for times before any series record. States are
+        ordered in time and two times with the same state have identical metadata.
+        """
+        return np.searchsorted(self.times, np.asarray(timestamps, dtype=float), side='right') - 1
+
+    def at_state(self, state, keys=None):
+        """
+        Return a dict of the metadata in a single state (see states), series keys without a record are omitted.
+        :param keys: optional subset of keys to return
+        """
+        keys = self.keys() if keys is None else keys
+        ret = {}
+        for k in keys:
+            if k in self.constants:
+                ret[k] = self.constants[k]
+            elif k in self._values:
+                row = self._rows[k][state] if state >= 0 else -1
+                if row >= 0:
+                    ret[k] = self._values[k][row]
+        return ret
+
+    def get(self, timestamp=None, keys=None):
+        """
+        Return a dict of the metadata at timestamp, equivalent to calling MetadataSeries.get on each series.
+        :param keys: optional subset of keys to return
+        """
+        keys = self.keys() if keys is None else keys
+        if timestamp is not None:
+            state = int(self.states(timestamp))
+            md = self.at_state(state, keys=keys)
+            missing = [k for k in keys if k in self._values and k not in md]
+            if missing:
+                getLogger(__name__).warning(f'No data for {missing} at or before {timestamp}')
+            return md
+        return {k: self.constants[k] if k in self.constants else self._values[k][0]
+                for k in keys if k in self.constants or (k in self._values and self._values[k])}
+
+
+class BeammapIndex:
+    """
+    Lookup tables for a beammap: resID to flat pixel index, flat pixel index to resID, and the flag bitmask of each
+    pixel. Unknown resIDs map to pixel -1 and carry no flags.
+    """
+    # Above this resID a dense lookup table is replaced with a sorted search
+    MAX_DENSE_RESID = 2 ** 24
+
+    def __init__(self, beam_image, flags):
+        """
+        :param beam_image: 2D array of the resID of each pixel
+        :param flags: array of the flag bitmask of each pixel, the same shape as beam_image
+        """
+        self.shape = beam_image.shape
+        self.resids = np.asarray(beam_image).ravel()
+        self.flags = np.asarray(flags).ravel()
+        self._sorted = np.argsort(self.resids)
+        self._lut = None
+        if self.resids.size and 0 <= self.resids.min() and self.resids.max() < self.MAX_DENSE_RESID:
+            self._lut = np.full(int(self.resids.max()) + 2, -1, dtype=np.int64)
+            self._lut[self.resids] = np.arange(self.resids.size)
+            self._flag_lut = np.zeros(self._lut.size, dtype=self.flags.dtype)
+            self._flag_lut[self.resids] = self.flags
+
+    def pixel(self, resid):
+        """Return the flat pixel index of each resID, -1 for resIDs not in the beammap"""
+        resid = np.asarray(resid)
+        if self._lut is not None:
+            return self._lut[np.minimum(resid, self._lut.size - 1)]
+        ndx = np.minimum(np.searchsorted(self.resids[self._sorted], resid), self.resids.size - 1)
+        pixel = self._sorted[ndx]
+        return np.where(self.resids[pixel] == resid, pixel, -1)
+
+    def xy(self, resid):
+        """
+        Return a tuple of two arrays with the x & y pixel positions of the resIDs, raises ValueError if any are not in
+        the beammap
+        """
+        pixel = self.pixel(resid)
+        unknown = pixel < 0
+        if np.any(unknown):
+            missing = np.unique(np.asarray(resid)[unknown])
+            raise ValueError(f'{missing.size} resID(s) are not in the beammap, e.g. {missing[:5].tolist()}')
+        return np.unravel_index(pixel, self.shape)
+
+    def resid_flags(self, resid):
+        """Return the flag bitmask of each resID"""
+        resid = np.asarray(resid)
+        if self._lut is not None:
+            return self._flag_lut[np.minimum(resid, self._lut.size - 1)]
+        pixel = self.pixel(resid)
+        return np.where(pixel >= 0, self.flags[pixel], 0)
+
+    def photon_mask(self, photons, bitmask):
+        """Return a boolean array that is True for photons from pixels with any of the bits in bitmask set"""
+        return (self.resid_flags(photons['resID']) & bitmask) != 0
+
+    def good_resids(self, bitmask):
+        """Return the resIDs of the pixels with none of the bits in bitmask set, in pixel order"""
+        return self.resids[(self.flags & bitmask) == 0]
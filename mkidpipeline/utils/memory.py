@@ -1,16 +1,79 @@
+import ctypes
+import functools
+import gc
+import json
 import multiprocessing as mp
 import os
 import threading
 from collections import defaultdict
-from contextlib import AbstractContextManager
+from contextlib import AbstractContextManager, contextmanager, nullcontext
+import numpy as np
 import psutil
 import time
 from logging import getLogger
 
-allocated = mp.Value('d', 0.0)
-CHECK_INTERVAL = .5
+from mkidpipeline.utils import tracing
+from mkidpipeline.utils.sysinfo import cgroup_file, pid_alive
 
-PIPELINE_MAX_RAM = min(192 * 1024**3, psutil.virtual_memory().total)
+# Reservations are granted in order of priority, lowest first, then of arrival, see reserve_ram
+PRIORITY_CALIBRATION = 0
+PRIORITY_DEFAULT = 10
+
+# Waiters are woken by every release, but RAM freed outside the pipeline isn't signalled so they also recheck this often
+CHECK_INTERVAL = 5
+MAX_WAITERS = 1024
+MAX_HOLDERS = 1024
+
+# Measured RAM use of pipeline tasks, see record_ram and predict_ram
+RAM_STATS_FILE = os.environ.get('MKIDPIPE_RAM_STATS',
+                                os.path.join(os.path.expanduser('~'), '.mkidpipeline', 'ram_stats.jsonl'))
+RAM_STATS_MAX_SAMPLES = 500  # most recent measurements of each task used for predictions
+RAM_STATS_MIN_SAMPLES = 5
+RAM_SAFETY_FACTOR = 1.25  # predictions are this multiple of the fit plus RAM_SAFETY_SIGMA times its rms error
+RAM_SAFETY_SIGMA = 3
+RAM_SAMPLE_INTERVAL = .05
+
+
+class _Waiter(ctypes.Structure):
+    _fields_ = [('pid', ctypes.c_int), ('priority', ctypes.c_int), ('ticket', ctypes.c_int64),
+                ('amount', ctypes.c_double)]
+
+
+class _Holder(ctypes.Structure):
+    _fields_ = [('pid', ctypes.c_int), ('amount', ctypes.c_double)]
+
+
+# The broker state is shared with the processes forked from this one and guarded by _broker
+_broker = mp.Condition()
+allocated = mp.RawValue('d', 0.0)
+_tickets = mp.RawValue('q', 0)
+_waiters = mp.RawArray(_Waiter, MAX_WAITERS)  # queued requests, pid 0 marks a free slot
+_holders = mp.RawArray(_Holder, MAX_HOLDERS)  # RAM reserved by each process, reclaimed if the process dies
+_local = threading.local()
+
+
+def cgroup_memory():
+    """
+    Return (limit, usage) in bytes for the memory cgroup of this process, or None if it isn't limited. Reclaimable page
+    cache is not counted as used.
+    """
+    try:
+        with open(cgroup_file('memory', 'memory.max', 'memory.limit_in_bytes')) as f:
+            limit = f.read().strip()
+        if limit == 'max' or int(limit) >= min(2 ** 60, psutil.virtual_memory().total):
+            return None
+        with open(cgroup_file('memory', 'memory.current', 'memory.usage_in_bytes')) as f:
+            usage = int(f.read())
+        with open(cgroup_file('memory', 'memory.stat')) as f:
+            stat = dict(line.split() for line in f)
+        usage -= int(stat.get('total_inactive_file', stat.get('inactive_file', 0)))
+    except (OSError, TypeError, ValueError):
+        return None
+    return int(limit), max(usage, 0)
+
+
+_cgroup = cgroup_memory()
+PIPELINE_MAX_RAM = min(192 * 1024**3, psutil.virtual_memory().total, _cgroup[0] if _cgroup else float('inf'))
 PIPELINE_MAX_RAM_GB = PIPELINE_MAX_RAM/1024**3
 
 
@@ -28,56 +91,151 @@ print(f"======MEMORY PID={os.getpid()}======", allocated)
 def get_free_ram():
     mem = psutil.virtual_memory()
     if 'macos' in os.environ.get('PLAT', '').lower():
-        return mem.available
+        free = mem.available
     else:
-        return mem.free + mem.cached
+        free = mem.free + mem.cached
+    cgroup = cgroup_memory() if _cgroup else None
+    return min(free, cgroup[0] - cgroup[1]) if cgroup else free
 
 
 def free_ram_gb():
     return get_free_ram()/1024**3
 
 
-def reserve_ram(amount, id='', timeout=None):
+@contextmanager
+def reservation_priority(priority):
+    """Make priority the default for the reservations made by this thread within the context"""
+    previous = getattr(_local, 'priority', PRIORITY_DEFAULT)
+    _local.priority = priority
+    try:
+        yield
+    finally:
+        _local.priority = previous
+
+
+def _reap():
+    """Drop the requests and reservations of processes that have died, call with _broker held"""
+    for w in _waiters:
+        if w.pid and not pid_alive(w.pid):
+            w.pid = 0
+    for h in _holders:
+        if h.pid and not pid_alive(h.pid):
+            getLogger(__name__).warning(f'Reclaiming {h.amount / 1024 ** 3:.1f} GB reserved by exited process {h.pid}')
+            allocated.value = max(allocated.value - h.amount, 0)
+            h.pid, h.amount = 0, 0
+
+
+def _head():
+    """
+    Return the slot of the request to be granted next, call with _broker held. Requests of processes that already hold
+    RAM come first, they may be increments their holder needs before it can release what it has.
+    """
+    holding = {h.pid for h in _holders if h.pid}
+    queued = [(w.pid not in holding, w.priority, w.ticket, i) for i, w in enumerate(_waiters) if w.pid]
+    return min(queued)[-1] if queued else None
+
+
+def _hold(pid, amount):
+    """Record that pid holds amount more bytes, call with _broker held"""
+    free = None
+    for h in _holders:
+        if h.pid == pid:
+            h.amount += amount
+            return
+        if free is None and not h.pid:
+            free = h
+    if free is not None:
+        free.pid, free.amount = pid, amount
+
+
+@tracing.traced('ram.reserve', counts=lambda amount: dict(bytes_reserved=amount))
+def reserve_ram(amount, id='', timeout=None, priority=None):
+    """
+    Wait for and reserve amount bytes of RAM for the pipeline, returning amount.
+
+    Requests from all the processes of the pipeline are granted one at a time in order of priority and then arrival, a
+    request never overtakes an earlier one of the same priority. The exception are requests of processes that already
+    hold a reservation (e.g. a nested Manager asking for more), which go first so that a holder never waits on a request
+    that can only be granted once it releases. Waiting requests are woken as soon as RAM is released.
+    The RAM available is limited by PIPELINE_MAX_RAM, the RAM free on the system and, if set, the memory limit of the
+    process's cgroup. A request that could not be granted even if every reservation were released raises MemoryError
+    when it reaches the head of the queue, rather than holding up those behind it.
+
+    :param id: name of the requester for the log
+    :param timeout: seconds to wait before withdrawing the request and raising TimeoutError
+    :param priority: see PRIORITY_CALIBRATION, default set by reservation_priority or PRIORITY_DEFAULT
+    """
     if amount <0:
         raise ValueError('Reservation amount must be >=0')
     if amount == 0:
         return 0
+    if amount > PIPELINE_MAX_RAM:
+        raise MemoryError(f'{amount / 1024 ** 3:.1f} GB' + (f' for {id}' if id else '') +
+                          f' exceeds the {PIPELINE_MAX_RAM_GB:.1f} GB the pipeline may use')
+
+    priority = getattr(_local, 'priority', PRIORITY_DEFAULT) if priority is None else priority
+    deadline = None if timeout is None else time.monotonic() + timeout
+    pid = os.getpid()
+    with _broker:
+        slot = None
+        while slot is None:
+            slot = next((i for i, w in enumerate(_waiters) if not w.pid), None)
+            if slot is None:
+                _broker.wait(CHECK_INTERVAL)
+                _reap()
+        _waiters[slot].pid, _waiters[slot].priority = pid, priority
+        _waiters[slot].ticket, _waiters[slot].amount = _tickets.value, amount
+        _tickets.value += 1
 
-    global allocated  # global across all processes
-    elapsed = 0
-
-    allocated.get_lock().acquire()
-    available = min(get_free_ram(), PIPELINE_MAX_RAM-allocated.value)
-
-    while amount > available:
-        allocated.get_lock().release()
-        if timeout is not None and elapsed > timeout:
-            raise TimeoutError('Insufficient RAM available within timeout')
-        if int(elapsed)%120 == 0:
-            getLogger(__name__).debug(f'Waiting for {amount / 1024 ** 3:.1f} GB'+(f' (for {id})' if id else '') +
-                                      f' Presently '
-                                      f'{free_ram_gb():.1f}/{PIPELINE_MAX_RAM_GB:.1f}/'
-                                      f'{available/1024**3:.1f}/{allocated.value/1024**3:.1f} GB '
-                                      f'(OSfree/Pipetotal/Pipeavailable/allocated)')
-        time.sleep(CHECK_INTERVAL)
-        elapsed += CHECK_INTERVAL
-
-        allocated.get_lock().acquire()
-        available = min(get_free_ram(), PIPELINE_MAX_RAM - allocated.value)
-
-    allocated.value += amount
-    getLogger(__name__).debug(f'Reserved {amount / 1024 ** 3:.1f} GB for {id} '
-                              f'total reserved {allocated.value / 1024 ** 3:.1f} GB')
-    allocated.get_lock().release()
+        try:
+            logged = None
+            while True:
+                free = get_free_ram()
+                available = min(free, PIPELINE_MAX_RAM - allocated.value)
+                if _head() == slot:
+                    if amount <= available:
+                        break
+                    if amount > free + allocated.value:
+                        raise MemoryError(f'{amount / 1024 ** 3:.1f} GB' + (f' for {id}' if id else '') +
+                                          f' exceeds the {(free + allocated.value) / 1024 ** 3:.1f} GB free or '
+                                          f'reserved by the pipeline')
+                now = time.monotonic()
+                if deadline is not None and now >= deadline:
+                    raise TimeoutError('Insufficient RAM available within timeout')
+                if logged is None or now - logged >= 120:
+                    logged = now
+                    getLogger(__name__).debug(f'Waiting for {amount / 1024 ** 3:.1f} GB' +
+                                              (f' (for {id})' if id else '') +
+                                              f' behind {sum(bool(w.pid) for w in _waiters) - 1} request(s). '
+                                              f'Presently {free_ram_gb():.1f}/{PIPELINE_MAX_RAM_GB:.1f}/'
+                                              f'{available/1024**3:.1f}/{allocated.value/1024**3:.1f} GB '
+                                              f'(OSfree/Pipetotal/Pipeavailable/allocated)')
+                if not _broker.wait(CHECK_INTERVAL if deadline is None else min(CHECK_INTERVAL, deadline - now)):
+                    _reap()
+        finally:
+            _waiters[slot].pid = 0
+            _broker.notify_all()  # the next request in line may now be at the head
+
+        allocated.value += amount
+        _hold(pid, amount)
+        getLogger(__name__).debug(f'Reserved {amount / 1024 ** 3:.1f} GB for {id} '
+                                  f'total reserved {allocated.value / 1024 ** 3:.1f} GB')
     return amount
 
 
 def release_ram(amount, id=''):
     if amount<=0:
         return
-    global allocated
-    with allocated.get_lock():
-        allocated.value -= amount
+    pid = os.getpid()
+    with _broker:
+        allocated.value = max(allocated.value - amount, 0)
+        for h in _holders:
+            if h.pid == pid:
+                h.amount -= amount
+                if h.amount <= 0:
+                    h.pid, h.amount = 0, 0
+                break
+        _broker.notify_all()
         getLogger(__name__).debug((f'{id} r' if id else 'R')+
                                   f'eleased {amount/1024**3:.1f} GB, total reserved {allocated.value/1024**3:.1f} GB')
 
@@ -89,6 +247,8 @@ class Manager(AbstractContextManager):
         self._lock = threading.Lock()
         self.required = {}
         self._allocated = defaultdict(list)
+        self._reserved = 0  # bytes reserved through this manager
+        self._pending = 0  # bytes being waited for by __enter__ calls
 
     def __setstate__(self, state):
         # don't ram locks across processes
@@ -102,35 +262,178 @@ class Manager(AbstractContextManager):
     def __enter__(self):
         tid=threading.get_ident()
         required = self.required[tid]
-        # Some other thread might try to allocate simultaneously resulting in more than is required in total
-        # we can fix this if needed but generally the pipeline is single threaded so ignore it for now
-        with self._lock:  # small requests might get held up by a large request
-            largest_allocation = self.required_allocation
+        # Wait outside the lock so that other threads can still release. A thread entering while another waits for
+        # the RAM both need relies on that reservation.
+        with self._lock:
             self._allocated[tid].append(required)
-            if largest_allocation < required:
-                reserve_ram(required-largest_allocation, id=f'{self.id} (tid={tid})')  # reserve a bit more
+            increment = max(self.required_allocation - self._reserved - self._pending, 0)
+            self._pending += increment
+        try:
+            reserve_ram(increment, id=f'{self.id} (tid={tid})')
+        except BaseException:
+            with self._lock:
+                self._pending -= increment
+                self._allocated[tid].pop()
+            raise
+        with self._lock:
+            self._pending -= increment
+            self._reserved += increment
         return True
 
     def __exit__(self, exctype, excinst, exctb):
-        """We should only release up to the incremental amount the corresponding enter call reserved.
-        min(self._allocated-this_reservation, self._allocated - max(other_reservations))
-        """
+        """Release what was reserved beyond the largest requirement still in use"""
         tid = threading.get_ident()
-        done_with = self._allocated[tid].pop()
-        if self._lock.acquire(timeout=1):
-            largest_required = self.required_allocation
-            release_ram(max(done_with - largest_required, 0), id=f'{self.id} (tid={tid})')
-            self._lock.release()
-        else:
-            getLogger(__name__).error(f'Unable to acquire lock to release ram pid={os.getpid()} tid={tid}')
-
+        with self._lock:
+            self._allocated[tid].pop()
+            excess = max(self._reserved - self.required_allocation, 0)
+            self._reserved -= excess
+        release_ram(excess, id=f'{self.id} (tid={tid})')
 
     @property
     def required_allocation(self):
+        return max((max(a) for a in self._allocated.values() if a), default=0)
+
+
+# Reservations start out as the hard-coded guesses of their callers. Wrapping a task in record_ram appends the peak RSS
+# growth it caused, along with its input sizes, to RAM_STATS_FILE. Once a task type has enough measurements predict_ram
+# returns a linear fit of footprint against input size with a safety margin instead of the guess. The RSS is that of
+# the whole process, so a task measured while another is measured in the process would overestimate its needs and is
+# not recorded, and memory freed by earlier tasks is returned to the system first so that reusing it doesn't hide
+# growth.
+
+
+class PeakSampler:
+    """Samples the RSS of this process in a thread, tracking the peak"""
+
+    def __init__(self):
+        self._process = psutil.Process()
+        self._done = threading.Event()
+        self.start = self.peak = self._process.memory_info().rss
+        self._thread = threading.Thread(target=self._run, name='RAM sampler', daemon=True)
+        self._thread.start()
+
+    def _run(self):
+        while not self._done.wait(RAM_SAMPLE_INTERVAL):
+            self.peak = max(self.peak, self._process.memory_info().rss)
+
+    def stop(self):
+        """Stop sampling and return the peak RSS growth in bytes"""
+        self._done.set()
+        self._thread.join()
+        self.peak = max(self.peak, self._process.memory_info().rss)
+        return self.peak - self.start
+
+
+_measuring = set()  # the PeakSamplers of the record_ram contexts open in this process
+_measuring_lock = threading.Lock()
+
+
+@functools.lru_cache()
+def _libc():
+    try:
+        return ctypes.CDLL('libc.so.6')
+    except OSError:
+        return None
+
+
+def _trim_heap():
+    """Return the memory freed in this process to the system, where the allocator supports it"""
+    gc.collect()
+    try:
+        _libc().malloc_trim(0)
+    except AttributeError:  # not glibc
+        pass
+
+
+@contextmanager
+def record_ram(task, reservation=None, **sizes):
+    """
+    Measure the peak RAM used within the context and, unless it raises or another measurement in the process overlaps
+    it, add it to the RAM statistics of task
+
+    :param task: name of the kind of work, e.g. 'buildhdf'
+    :param reservation: optional context manager (e.g. a Manager) entered around the measurement
+    :param sizes: the input sizes the RAM use scales with, e.g. photons=n
+    """
+    with reservation if reservation is not None else nullcontext():
+        with _measuring_lock:
+            idle = not _measuring
+        if idle:
+            _trim_heap()
+        sampler = PeakSampler()
+        with _measuring_lock:
+            sampler.alone = idle and not _measuring
+            for other in _measuring:
+                other.alone = False
+            _measuring.add(sampler)
+        try:
+            yield
+        finally:
+            used = sampler.stop()
+            with _measuring_lock:
+                _measuring.discard(sampler)
+    if not sampler.alone:
+        getLogger(__name__).debug(f'Not recording the RAM used by {task}, other tasks were measured at the same time')
+        return
+    record = dict(task=task, sizes={k: float(v) for k, v in sizes.items()}, peak=used, time=time.time())
+    try:
+        os.makedirs(os.path.dirname(RAM_STATS_FILE), exist_ok=True)
+        with open(RAM_STATS_FILE, 'a') as f:  # a single short append, safe from concurrent processes
+            f.write(json.dumps(record) + '\n')
+    except OSError:
+        getLogger(__name__).debug(f'Unable to record RAM use to {RAM_STATS_FILE}', exc_info=True)
+
+
+_stats = {'key': None, 'tasks': {}}
+_stats_lock = threading.Lock()
+
+
+def _load_stats():
+    """Return dict of task: list of (sizes, peak) from RAM_STATS_FILE, reread only when the file changes"""
+    try:
+        st = os.stat(RAM_STATS_FILE)
+    except OSError:
+        return {}
+    key = (RAM_STATS_FILE, st.st_mtime_ns, st.st_size)
+    with _stats_lock:
+        if _stats['key'] == key:
+            return _stats['tasks']
+        tasks = defaultdict(list)
         try:
-            return max(map(max, self._allocated.values()))
-        except ValueError:
-            return 0
+            with open(RAM_STATS_FILE) as f:
+                for line in f:
+                    try:
+                        r = json.loads(line)
+                        tasks[r['task']].append((r['sizes'], float(r['peak'])))
+                    except (ValueError, KeyError, TypeError):
+                        continue  # e.g. a line being written
+        except OSError:
+            return {}
+        _stats['key'], _stats['tasks'] = key, {k: v[-RAM_STATS_MAX_SAMPLES:] for k, v in tasks.items()}
+        return _stats['tasks']
+
+
+def predict_ram(task, default, **sizes):
+    """
+    Return the RAM in bytes to reserve for a task with the given input sizes, predicted from the measurements made with
+    record_ram. default is returned while there are too few measurements or when the sizes are well beyond those
+    measured.
+    """
+    keys = sorted(sizes)
+    samples = [(s, p) for s, p in _load_stats().get(task, []) if all(k in s for k in keys)]
+    if len(samples) < max(RAM_STATS_MIN_SAMPLES, len(keys) + 2):
+        return default
+    x = np.array([[1.0] + [s[k] for k in keys] for s, _ in samples])
+    y = np.array([p for _, p in samples])
+    query = np.array([1.0] + [float(sizes[k]) for k in keys])
+    if np.any(query[1:] > 2 * x[:, 1:].max(axis=0)):
+        return default  # don't extrapolate far
+    coeffs = np.linalg.lstsq(x, y, rcond=None)[0]
+    rms = np.sqrt(np.mean((x @ coeffs - y) ** 2))
+    predicted = int(max(query @ coeffs + RAM_SAFETY_SIGMA * rms, 0) * RAM_SAFETY_FACTOR)
+    getLogger(__name__).debug(f'Predicted {predicted / 1024 ** 3:.2f} GB for {task} {sizes} from {len(samples)} '
+                              f'measurements (default {default / 1024 ** 3:.2f} GB)')
+    return predicted
 
 
 #
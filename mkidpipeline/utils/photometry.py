@@ -11,6 +11,7 @@ from photutils.background import MMMBackground, MADStdBackgroundRMS
 from astropy.modeling.fitting import LevMarLSQFitter
 from astropy.stats import gaussian_sigma_to_fwhm
 import scipy.ndimage as ndimage
+import scipy.sparse
 from photutils import aperture_photometry
 from photutils import CircularAperture
 from photutils import CircularAnnulus
@@ -80,6 +81,190 @@ def aper_photometry(image, obj_position, radius, box_size=10, bkgd_subtraction_t
                        .format(bkgd_subtraction_type))
 
 
+class ApertureSet:
+    """
+    The pixel weights of a set of apertures on images of one shape, held as a sparse (naper, npix) matrix. Weights are
+    computed once, after which the sums of any number of apertures over any number of planes of a cube are a single
+    sparse product, as are the plane background fits aper_photometry subtracts.
+    """
+
+    def __init__(self, shape, apertures):
+        """
+        :param shape: (y, x) shape of the images
+        :param apertures: iterable of photutils apertures (exact overlap weights are used) and/or (y, x) weight images
+        """
+        self.shape = tuple(shape)
+        rows, cols, vals = [], [], []
+        for i, aperture in enumerate(apertures):
+            if isinstance(aperture, np.ndarray):
+                weights = aperture.astype(float).ravel()
+            else:
+                weights = aperture.to_mask(method='exact').to_image(self.shape).ravel()
+            nonzero = np.flatnonzero(weights)
+            rows.append(np.full(nonzero.size, i))
+            cols.append(nonzero)
+            vals.append(weights[nonzero])
+        n = len(rows)
+        npix = self.shape[0] * self.shape[1]
+        if n:
+            rows, cols, vals = np.concatenate(rows), np.concatenate(cols), np.concatenate(vals)
+        self.matrix = scipy.sparse.csr_matrix((vals, (rows, cols)), shape=(n, npix))
+        self.area = np.asarray(self.matrix.sum(axis=1)).ravel()
+
+    def __len__(self):
+        return self.matrix.shape[0]
+
+    def _pairs(self, nplanes, pairs):
+        if pairs is None:
+            planes, apertures = np.meshgrid(np.arange(nplanes), np.arange(len(self)), indexing='ij')
+            return planes.ravel(), apertures.ravel()
+        return np.asarray(pairs[0]), np.asarray(pairs[1])
+
+    def sums(self, cube, pairs=None):
+        """
+        Sum the apertures over the planes of cube
+        :param cube: (plane, y, x) cube or (y, x) image
+        :param pairs: (planes, apertures) index arrays of the aperture and plane pairs to evaluate. If None every
+        aperture is summed over every plane.
+        :return: (nplanes, naper) sums if pairs is None else the sum for each pair
+        """
+        flat = np.asarray(cube, dtype=float).reshape(-1, self.shape[0] * self.shape[1])
+        if pairs is None:
+            return np.asarray(self.matrix @ flat.T).T
+        planes, apertures = self._pairs(len(flat), pairs)
+        return np.asarray(self.matrix[apertures].multiply(flat[planes]).sum(axis=1)).ravel()
+
+    def _plane_fits(self, cube, centers, box_size, planes, apertures):
+        """
+        Fit a degree 1 polynomial to the box of half size box_size around the center of each (plane, aperture) pair,
+        returning the (c0, c1, c2) coefficients over box coordinates (see _plane_design) and the box bounds. Boxes that
+        fit on the image share a single least squares solve.
+        """
+        centers = np.asarray(centers, dtype=float)[apertures]
+        ny, nx = self.shape
+        nbox = 2 * box_size + 1
+        row0, col0 = centers[:, 1].astype(int) - box_size, centers[:, 0].astype(int) - box_size
+        row1, col1 = np.minimum(row0 + nbox, ny), np.minimum(col0 + nbox, nx)
+        row0, col0 = np.maximum(row0, 0), np.maximum(col0, 0)
+
+        coeffs = np.zeros((len(planes), 3))
+        full = (row1 - row0 == nbox) & (col1 - col0 == nbox)
+        if full.any():
+            r = row0[full, None, None] + np.arange(nbox)[None, :, None]
+            c = col0[full, None, None] + np.arange(nbox)[None, None, :]
+            crops = cube[planes[full, None, None], r, c].reshape(full.sum(), -1)
+            coeffs[full] = np.linalg.lstsq(_plane_design(nbox, nbox), crops.T, rcond=None)[0].T
+        for i in np.flatnonzero(~full):
+            crop = cube[planes[i], row0[i]:row1[i], col0[i]:col1[i]]
+            if crop.size:
+                coeffs[i] = np.linalg.lstsq(_plane_design(*crop.shape), crop.ravel(), rcond=None)[0]
+        return coeffs, row0, row1, col0, col1
+
+    def plane_backgrounds(self, cube, centers, box_size=10, pairs=None):
+        """
+        Fit a degree 1 polynomial to the box of half size box_size around the center of each aperture in each plane
+        and return the fit summed over the part of the aperture inside the box, i.e. the background that
+        aper_photometry subtracts. Boxes that fit on the image share a single least squares solve.
+
+        :param cube: (plane, y, x) cube or (y, x) image
+        :param centers: (x, y) pixel center of the box of each aperture
+        :param box_size: half size of the boxes (in pixels)
+        :param pairs: see sums
+        :return: (nplanes, naper) backgrounds if pairs is None else the background for each pair
+        """
+        cube = np.asarray(cube, dtype=float).reshape((-1,) + self.shape)
+        planes, apertures = self._pairs(len(cube), pairs)
+        coeffs, row0, row1, col0, col1 = self._plane_fits(cube, centers, box_size, planes, apertures)
+
+        # integrate 1 + col + row (in box coordinates) over the weights of each aperture within its box
+        weights = self.matrix[apertures].tocoo()
+        k = weights.row
+        py, px = np.divmod(weights.col, self.shape[1])
+        inbox = (py >= row0[k]) & (py < row1[k]) & (px >= col0[k]) & (px < col1[k])
+        w = weights.data * inbox
+        n = len(planes)
+        moments = np.stack((np.bincount(k, w, n), np.bincount(k, w * (px - col0[k]), n),
+                            np.bincount(k, w * (py - row0[k]), n)), axis=1)
+        background = (coeffs * moments).sum(axis=1)
+        return background.reshape(len(cube), len(self)) if pairs is None else background
+
+    def subtract_backgrounds(self, cube, centers, box_size=10, pairs=None):
+        """
+        Fit the backgrounds of plane_backgrounds and subtract each fit from its whole box, in place, as racetrack_aper
+        always has. Every fit is made before any is subtracted, so pairs whose boxes overlap in a plane should be
+        subtracted by separate calls in the order they are to be measured.
+
+        :param cube: float (plane, y, x) cube or (y, x) image, modified in place
+        :param centers: (x, y) pixel center of the box of each aperture
+        :param box_size: half size of the boxes (in pixels)
+        :param pairs: see sums
+        """
+        cube = cube.reshape((-1,) + self.shape)
+        planes, apertures = self._pairs(len(cube), pairs)
+        coeffs, row0, row1, col0, col1 = self._plane_fits(cube, centers, box_size, planes, apertures)
+        for i in range(len(planes)):
+            row, col = np.mgrid[:row1[i] - row0[i], :col1[i] - col0[i]]
+            cube[planes[i], row0[i]:row1[i], col0[i]:col1[i]] -= coeffs[i, 0] + coeffs[i, 1] * col + coeffs[i, 2] * row
+
+
+def _plane_design(nrows, ncols):
+    """Design matrix of the degree 1 polynomial c0 + c1 * col + c2 * row over a (nrows, ncols) box"""
+    row, col = np.mgrid[:nrows, :ncols]
+    return np.column_stack((np.ones(row.size), col.ravel(), row.ravel()))
+
+
+def batch_aper_photometry(cube, positions, radii, box_size=10, bkgd_subtraction_type='plane', pairs=None):
+    """
+    aper_photometry for many circular apertures over every plane of a cube in one call. The cube is not modified.
+
+    :param cube: (plane, y, x) cube or (y, x) image
+    :param positions: (x, y) pixel position of each aperture
+    :param radii: radius of each aperture (in pixels), or a single radius for all
+    :param box_size: half size (in pixels) of the box used for the plane background fit
+    :param bkgd_subtraction_type: 'plane' or 'annulus', see aper_photometry
+    :param pairs: (planes, apertures) index arrays of the pairs to evaluate, if None every aperture on every plane
+    :return: (nplanes, naper) sky subtracted fluxes if pairs is None else the flux of each pair
+    """
+    cube = np.asarray(cube, dtype=float)
+    cube = np.nan_to_num(cube.reshape((-1,) + cube.shape[-2:]))
+    positions = np.atleast_2d(positions)
+    radii = np.broadcast_to(radii, positions.shape[:1])
+    apertures = ApertureSet(cube.shape[1:], [CircularAperture(p, r=r) for p, r in zip(positions, radii)])
+    object_flux = apertures.sums(cube, pairs=pairs)
+
+    if bkgd_subtraction_type == 'plane':
+        return object_flux - apertures.plane_backgrounds(cube, positions, box_size=box_size, pairs=pairs)
+    elif bkgd_subtraction_type == 'annulus':
+        annuli = [CircularAnnulus(p, r_in=r, r_out=r + 0.5 * r) for p, r in zip(positions, radii)]
+        bkgd_mean = ApertureSet(cube.shape[1:], annuli).sums(cube, pairs=pairs)
+        area = np.array([a.area for a in annuli])
+        circ_area = np.pi * radii ** 2
+        if pairs is None:
+            return object_flux - bkgd_mean / area * circ_area
+        return object_flux - bkgd_mean / area[pairs[1]] * circ_area[pairs[1]]
+    else:
+        raise KeyError('invalid background subtraction type given ({}), must be either plane or annulus'
+                       .format(bkgd_subtraction_type))
+
+
+def cube_aper_photometry(cube, obj_position, radii, box_size=10, bkgd_subtraction_type='plane'):
+    """
+    aper_photometry of a single object in every plane of a cube, e.g. a spectrum from a spectral cube
+
+    :param cube: 3D array (plane, y, x) on which to perform aperture photometry
+    :param obj_position: tuple (in pixels)
+    :param radii: aperture radius in pixels, either a single value or one per plane
+    :param box_size: half size (in pixels) of the box used for the plane background fit
+    :param bkgd_subtraction_type: 'plane' or 'annulus', see aper_photometry
+    :return: array of sky subtracted object flux for each plane
+    """
+    radii = np.broadcast_to(radii, np.shape(cube)[:1])
+    unique, which = np.unique(radii, return_inverse=True)
+    return batch_aper_photometry(cube, [obj_position] * len(unique), unique, box_size=box_size,
+                                 bkgd_subtraction_type=bkgd_subtraction_type,
+                                 pairs=(np.arange(len(radii)), which.ravel()))
+
+
 def astropy_psf_photometry(img, aperture=3, guess_loc=None, filter=1,
                            star_fwhm=3, threshold=None, minsep_fwhm=1.5, max_fwhm=10,
                            return_photometry=False, mask='zeros', n_brightest=1, nfwhm_win=4):
@@ -202,68 +387,91 @@ def interpolateImage(inputArray, method='linear'):
 
 
 def mec_measure_satellite_spot_flux(cube, aperradii=None, wvl_start=None, wvl_stop=None, wcs=None,
-                                    platescale=0.0104, D=8.2):
+                                    platescale=0.0104, D=8.2, box_size=20):
     """
     performs aperture photometry using an adaptation of the racetrack aperture from the polarimetry mode of the
     GPI pipeline (http://docs.planetimager.org/pipeline/usage/tutorial_polphotometry.html)
 
+    The spots are measured in turn, each after its background is subtracted from the box around it, as with
+    racetrack_aper, but in every wavelength at once (see ApertureSet). The cube is not modified.
+
     :param cube: [wvl, xdim, ydim] cube on which to perform photometry
     :param aperradii: radius of the aperture - if 'None' will use the diffraction limited aperture for each wvl
     :param wvl_start: array, start wavelengths in angstroms
     :param wvl_stop: array, stop wavelengths in angstroms
     :param platescale: platescale in arcsec/pix
     :param D: telescope diameter in meters
+    :param box_size: size of box to use around each aperture to calculate the background (in pixels)
     :return: background subtracted flux of the satellite spot in counts/sec
     """
-    flux = np.zeros((len(cube), 4))
     if len(cube) != len(wvl_start) or len(cube) != len(wvl_stop):
         raise ValueError('cube must have same wavelength dimensions wvl start and wvl stop')
-    for i, img in enumerate(cube):
-        imgspare = img.copy()
-        dim = np.shape(cube[0, :, :])
-        starx = dim[0] / 2
-        stary = dim[1] / 2
-        lambdamin = wvl_start[i]
-        lambdamax = wvl_stop[i]
-        landa = lambdamin + (lambdamax - lambdamin) / 2.0
-        if aperradii is None:
-            aperradii = get_aperture_radius(landa, platescale)
-        R_spot = np.zeros(3)
-        R_spot[0] = (206265 / platescale) * 15.91 * lambdamin / (D * 1e10)
-        R_spot[1] = (206265 / platescale) * 15.91 * landa / (D * 1e10)
-        R_spot[2] = (206265 / platescale) * 15.91 * lambdamax / (D * 1e10)
-        halflength = R_spot[2] - R_spot[1]
-
-        wcs_rot = wcs.wcs.pc
-        # ROT_ANG = [42.73, 136, 226.9, 311.7]
-        ROT_ANG = [45, 45, 45, 45]
-        ROT_ANG = np.deg2rad(ROT_ANG)
-        xs0 = R_spot[1] * np.cos(ROT_ANG[0])
-        ys0 = R_spot[1] * np.sin(ROT_ANG[0])
-        xs1 = R_spot[1] * np.cos(ROT_ANG[1])
-        ys1 = -R_spot[1] * np.sin(ROT_ANG[1])
-        xs2 = -R_spot[1] * np.cos(ROT_ANG[2])
-        ys2 = -R_spot[1] * np.sin(ROT_ANG[2])
-        xs3 = -R_spot[1] * np.cos(ROT_ANG[3])
-        ys3 = R_spot[1] * np.sin(ROT_ANG[3])
-
-        spot_posx = np.array([xs0, xs1, xs2, xs3])
-        spot_posy = np.array([ys0, ys1, ys2, ys3])
-        for idx, coord in enumerate(spot_posx):
-            new_x, new_y = wcs_rot.dot(np.array([spot_posx[idx], spot_posy[idx]]))
-            spot_posx[idx] = new_x + starx
-            spot_posy[idx] = new_y + stary
-        spot_xsep = [spot_posx[0] - starx, spot_posx[1] - starx, spot_posx[2] - starx, spot_posx[3] - starx]
-        spot_ysep = [spot_posy[0] - stary, spot_posy[1] - stary, spot_posy[2] - stary, spot_posy[3] - stary]
-
-        spot_rotang = [np.arctan(spot_ysep[0] / spot_xsep[0]), np.arctan(spot_ysep[1] / spot_xsep[1]),
-                       np.arctan(spot_ysep[2] / spot_xsep[2]) - np.pi, np.pi + np.arctan(spot_ysep[3] / spot_xsep[3])]
-        for j in range(4):
-            flux[i, j], imgspare = racetrack_aper(img, imgspare, spot_posx[j], spot_posy[j], spot_rotang[j],
-                                                  aperradii, halflength)
+    cube = np.nan_to_num(np.asarray(cube, dtype=float))
+    dim = np.shape(cube[0, :, :])
+    starx = dim[0] / 2
+    stary = dim[1] / 2
+    lambdamin = np.asarray(wvl_start, dtype=float)
+    lambdamax = np.asarray(wvl_stop, dtype=float)
+    landa = lambdamin + (lambdamax - lambdamin) / 2.0
+    aperradii = get_aperture_radius(landa, platescale) if aperradii is None else np.broadcast_to(aperradii, landa.shape)
+    R_spot = (206265 / platescale) * 15.91 * landa / (D * 1e10)
+    halflength = (206265 / platescale) * 15.91 * lambdamax / (D * 1e10) - R_spot
+
+    # ROT_ANG = [42.73, 136, 226.9, 311.7]
+    ROT_ANG = np.deg2rad([45, 45, 45, 45])
+    sign_x = np.array([1, 1, -1, -1])
+    sign_y = np.array([1, -1, -1, 1])
+    # (wvl, spot) separations from the star before and after rotation by the wcs
+    spot_posx = sign_x * R_spot[:, None] * np.cos(ROT_ANG)
+    spot_posy = sign_y * R_spot[:, None] * np.sin(ROT_ANG)
+    wcs_rot = wcs.wcs.pc
+    spot_xsep = wcs_rot[0, 0] * spot_posx + wcs_rot[0, 1] * spot_posy
+    spot_ysep = wcs_rot[1, 0] * spot_posx + wcs_rot[1, 1] * spot_posy
+    spot_posx, spot_posy = spot_xsep + starx, spot_ysep + stary
+    spot_rotang = np.arctan(spot_ysep / spot_xsep) + np.array([0, 0, -np.pi, np.pi])
+
+    nwvl = len(cube)
+    apertures = ApertureSet(dim, [racetrack_weights(dim, spot_posx[i, j], spot_posy[i, j], spot_rotang[i, j],
+                                                    aperradii[i], halflength[i])
+                                  for i in range(nwvl) for j in range(4)])
+    centers = np.column_stack((spot_posx.ravel(), spot_posy.ravel()))
+    # As racetrack_aper did spot by spot, each spot's background is subtracted from its box before it is measured and
+    # later spots are measured on the result, where their boxes overlap. Every wavelength is done at once.
+    flux = np.zeros((nwvl, 4))
+    for j in range(4):
+        pairs = (np.arange(nwvl), 4 * np.arange(nwvl) + j)
+        apertures.subtract_backgrounds(cube, centers, box_size=box_size, pairs=pairs)
+        flux[:, j] = apertures.sums(cube, pairs)
     return flux
 
 
+def racetrack_weights(shape, x_guess, y_guess, rotang, aper_radii, halflength):
+    """
+    Return a boolean image of the racetrack (stadium) aperture used for satellite spots
+    :param shape: shape of the image
+    :param x_guess: x location of aperture (in pixels)
+    :param y_guess: y location of aperture (in pixels)
+    :param rotang: rotation angle of satellite spot
+    :param aper_radii: aperture radius (in pixels)
+    :param halflength: halflength of the satellite spot
+    """
+    rotang = -rotang
+    xcoord, ycoord = np.meshgrid(np.arange(shape[1]), np.arange(shape[0]))
+    xppos = np.cos(rotang) * x_guess - np.sin(rotang) * y_guess
+    yppos = np.sin(rotang) * x_guess + np.cos(rotang) * y_guess
+
+    xpcoord = np.cos(rotang) * xcoord - np.sin(rotang) * ycoord
+    ypcoord = np.sin(rotang) * xcoord + np.cos(rotang) * ycoord
+
+    source_mid = (ypcoord > yppos - aper_radii) & (ypcoord < yppos + aper_radii) & (xpcoord > xppos - halflength) \
+                 & (xpcoord < xppos + halflength)
+    source_bot = (xpcoord < xppos - halflength) & \
+                 ((ypcoord - yppos) ** 2 + (xpcoord - (xppos - halflength)) ** 2 < aper_radii ** 2)
+    source_top = (xpcoord > xppos + halflength) & \
+                 ((ypcoord - yppos) ** 2 + (xpcoord - (xppos + halflength)) ** 2 < aper_radii ** 2)
+    return source_mid | source_bot | source_top
+
+
 def racetrack_aper(img, imgspare, x_guess, y_guess, rotang, aper_radii, halflength, box_size=20):
     """
 
@@ -277,41 +485,11 @@ def racetrack_aper(img, imgspare, x_guess, y_guess, rotang, aper_radii, halfleng
     :param box_size: size of box to use around each aperture to calculate the background (in pixels)
     :return: background subtracted flux, debug image
     """
-    rotang *= -1
-    where_nan = np.where(np.isnan(img))
-    img[where_nan] = 0
-    spot_halflen = halflength
-    dims = np.shape(img)
-
-    crop_img = img[int(y_guess) - box_size:int(y_guess) + (box_size + 1),
-               int(x_guess) - box_size:int(x_guess) + (box_size + 1)]
-    xpos = x_guess
-    ypos = y_guess
-    xcoord, ycoord = np.meshgrid(np.arange(dims[0]), np.arange(dims[1]))
-    xppos = np.cos(rotang) * xpos - np.sin(rotang) * ypos
-    yppos = np.sin(rotang) * xpos + np.cos(rotang) * ypos
-
-    xpcoord = np.cos(rotang) * xcoord - np.sin(rotang) * ycoord
-    ypcoord = np.sin(rotang) * xcoord + np.cos(rotang) * ycoord
-
-    source_mid = (ypcoord > yppos - aper_radii) & (ypcoord < yppos + aper_radii) & (xpcoord > xppos - spot_halflen) \
-                 & (xpcoord < xppos + spot_halflen)
-    source_bot = (xpcoord < xppos - spot_halflen) & \
-                 ((ypcoord - yppos) ** 2 + (xpcoord - (xppos - spot_halflen)) ** 2 < aper_radii ** 2)
-    source_top = (xpcoord > xppos + spot_halflen) & \
-                 ((ypcoord - yppos) ** 2 + (xpcoord - (xppos + spot_halflen)) ** 2 < aper_radii ** 2)
-    source = np.where(source_mid | source_bot | source_top)
-
-    # subtract off background flux
-    p_back_init = Polynomial2D(degree=1)
-    fit_p = fitting.LevMarLSQFitter()
-    x, y = np.meshgrid(np.arange(np.shape(crop_img)[0]), np.arange(np.shape(crop_img)[0]))
-    p = fit_p(p_back_init, x, y, crop_img)
-    background = p(x, y)
-    img[int(y_guess) - box_size:int(y_guess) + (box_size + 1),
-    int(x_guess) - box_size:int(x_guess) + (box_size + 1)] -= background
-    flux = np.sum(img[source])
-
+    img[np.isnan(img)] = 0
+    source = racetrack_weights(img.shape, x_guess, y_guess, rotang, aper_radii, halflength)
+    aperture = ApertureSet(img.shape, [source])
+    aperture.subtract_backgrounds(img, [(x_guess, y_guess)], box_size=box_size)
+    flux = aperture.sums(img)[0, 0]
     imgspare[source] = 10000
     return flux, imgspare
 
@@ -0,0 +1,468 @@
+"""
+A pipeline-wide pool of long-lived worker processes
+
+Creating an mp.Pool in every step forks new workers that reload the calibration solutions and reopen the h5 files the
+workers of the previous step had just loaded, and that is repeated for each of the ~10 steps of a run. WorkerPool
+instead keeps its workers for the whole run, so module state (e.g. the solutions cached by
+mkidpipeline.steps.wavecal.load_solution) and the read-only photontables opened with
+mkidpipeline.photontable.open_photontable stay warm from one task to the next.
+
+Tasks may name the files they work on (their affinity). A file stays with the worker that has it open: later tasks that
+name it are routed to that worker and no other worker is given it. This matters beyond speed, HDF5 will not open a file
+for writing while another process has it open, so a task that writes a file must name it. The worker that runs it is
+then the only one that can hold the file, and it closes its own handle before reopening for write. Writes from the
+process that owns the pool release the file from the workers first (see release). Workers can't ask that process to do
+the same, so it keeps no tables open through open_photontable while the pool runs.
+
+Each task counts against the core budget while it runs, workers size their numexpr, BLAS and blosc thread pools to
+their share of it (see mkidpipeline.utils.cores).
+
+Workers are forked when the pool starts and keep the pipeline configuration of that moment, call shutdown to have
+the next shared_pool call start fresh ones. A worker that dies is replaced, but after MAX_RESTARTS replacements the pool
+gives up (e.g. when workers fail as they start) and fails its tasks until it is shut down. Workers are only forked by
+the main thread, a fork from a helper thread could copy a lock another thread holds into a worker that then never gets
+it. The main thread replaces dead workers the next time it submits a task or calls replace_lost, tasks sent to a dead
+worker in the meantime wait for its replacement.
+
+Functions
+
+    shared_pool     : The pipeline-wide WorkerPool, started on first use
+    running         : Whether this process runs the shared pool
+    pool_map        : Map a function over items using the shared pool, or in this process for ncpu=1
+    release         : Have the workers of the shared pool close a file
+    shutdown        : Stop the workers of the shared pool
+
+Classes
+
+    WorkerPool      : Long-lived worker processes with per-file task routing
+"""
+import os
+import atexit
+import itertools
+import threading
+import traceback
+import multiprocessing as mp
+import multiprocessing.connection
+from multiprocessing.reduction import ForkingPickler
+from concurrent.futures import Future
+
+from mkidcore.corelog import getLogger
+from mkidpipeline.utils import cores, tracing
+
+# Workers replaced over the life of a pool before it stops and fails all its tasks
+MAX_RESTARTS = 10
+
+_pool = None
+_pool_lock = threading.Lock()
+_in_worker = False
+
+
+class _RemoteTraceback(Exception):
+    def __init__(self, tb):
+        self.tb = tb
+
+    def __str__(self):
+        return self.tb
+
+
+def _rebuild_exception(exc, tb):
+    exc.__cause__ = _RemoteTraceback(tb)
+    return exc
+
+
+class _ExceptionWithTraceback:
+    """Carries the formatted worker traceback of an exception to the parent, where it becomes the __cause__"""
+    def __init__(self, exc):
+        self.tb = '\n"""\n' + ''.join(traceback.format_exception(type(exc), exc, exc.__traceback__)) + '"""'
+        self.exc = exc.with_traceback(None)
+
+    def __reduce__(self):
+        return _rebuild_exception, (self.exc, self.tb)
+
+
+def _worker_main(conn, index):
+    """Run the tasks sent over conn until told to stop with None"""
+    global _pool, _in_worker
+    _pool = None  # A forked copy of the parent's pool, not ours to use
+    _in_worker = True
+    from mkidpipeline.photontable import close_photontables, open_photontables
+    close_photontables()  # Handles inherited from the parent would keep it from writing those files
+    while True:
+        try:
+            item = conn.recv()
+        except EOFError:
+            break
+        if item is None:
+            break
+        task_id, payload = item
+        func = None
+        try:
+            # Unpickled here rather than by recv so that e.g. a function the worker can't import fails only the task
+            func, args, kwargs = ForkingPickler.loads(payload)
+            with cores.busy():
+                ok, value = True, func(*args, **kwargs)
+        except Exception as e:
+            ok, value = False, _ExceptionWithTraceback(e)
+        tracing.flush()  # Workers don't run atexit handlers
+        try:
+            conn.send((task_id, ok, value, open_photontables()))
+        except Exception as e:  # the result or exception could not be pickled
+            conn.send((task_id, False, RuntimeError(f'Unable to return the result of {func}: {e!r}'),
+                       open_photontables()))
+    close_photontables()
+    conn.close()
+
+
+def _close_file(path):
+    from mkidpipeline.photontable import close_photontables
+    close_photontables(path)
+
+
+def _paths(files):
+    if not files:
+        return set()
+    if isinstance(files, (str, os.PathLike)):
+        files = (files,)
+    return {os.path.realpath(f) for f in files}
+
+
+class WorkerPool:
+    """
+    A fixed set of worker processes that run submitted tasks until shutdown. Unlike mp.Pool tasks are routed to
+    workers by the files they name, see the module docstring.
+
+    Workers are not daemonic so that tasks may start processes of their own.
+    """
+
+    def __init__(self, nworkers):
+        """
+        :param nworkers: number of worker processes
+        """
+        self._ctx = mp.get_context()
+        self._lock = threading.Lock()
+        self._ids = itertools.count()
+        self._procs, self._conns, self._send_locks = [], [], []
+        self._load = []  # number of unfinished tasks sent to each worker
+        self._held = []  # files each worker has open, as last reported by it
+        self._pending = {}  # task id: (worker, future, files)
+        self._exited = set()  # workers that have stopped after shutdown
+        self._dead = set()  # workers that have died and are waiting to be replaced
+        self._queued = {}  # worker: [(task id, payload)] sent to it while dead
+        self._closed = False
+        self._restarts = 0
+        self._broken = None  # why the pool stopped, once workers have died too often
+        self._wake_r, self._wake_w = self._ctx.Pipe(duplex=False)
+        self.grow(nworkers)
+        self._collector = threading.Thread(target=self._collect, name='WorkerPool collector', daemon=True)
+        self._collector.start()
+
+    def __len__(self):
+        return len(self._procs)
+
+    def _start(self, i):
+        parent, child = self._ctx.Pipe()
+        proc = self._ctx.Process(target=_worker_main, args=(child, i), name=f'PipelineWorker-{i}', daemon=False)
+        proc.start()
+        child.close()
+        return proc, parent
+
+    def grow(self, nworkers):
+        """Start workers until there are at least nworkers"""
+        with self._lock:
+            while not self._closed and len(self._procs) < nworkers:
+                proc, conn = self._start(len(self._procs))
+                self._procs.append(proc)
+                self._conns.append(conn)
+                self._send_locks.append(threading.Lock())
+                self._load.append(0)
+                self._held.append(set())
+        self._wake()
+
+    def _wake(self):
+        try:
+            self._wake_w.send_bytes(b'')
+        except (OSError, AttributeError):
+            pass
+
+    def _owned(self, i):
+        """Files of worker i: those it has open and those named by its unfinished tasks"""
+        files = set(self._held[i])
+        for w, _, f in self._pending.values():
+            if w == i:
+                files |= f
+        return files
+
+    def _route(self, files):
+        """Pick the worker for a task naming files, must be called with the lock held"""
+        owners = [i for i in range(len(self._procs)) if files and not files.isdisjoint(self._owned(i))]
+        if len(owners) > 1:
+            getLogger(__name__).warning(f'Files {files} are held by several workers, a write may fail')
+        candidates = owners or [i for i in range(len(self._procs)) if i not in self._dead] or range(len(self._procs))
+        return min(candidates, key=lambda i: (self._load[i], len(self._owned(i))))
+
+    def submit(self, func, *args, affinity=None, **kwargs):
+        """
+        Run func(*args, **kwargs) in a worker.
+
+        :param affinity: a file or list of files the task works on, it is sent to the worker that has them open
+        :return: a concurrent.futures.Future
+        """
+        return self._submit(None, func, args, kwargs, _paths(affinity))
+
+    def _submit(self, worker, func, args, kwargs, files):
+        future = Future()
+        future.set_running_or_notify_cancel()
+        with self._lock:
+            if self._broken:
+                raise RuntimeError(self._broken)
+            if self._closed:
+                raise RuntimeError('WorkerPool is shut down')
+            backlog = self._replace()
+            i = self._route(files) if worker is None else worker
+            task_id = next(self._ids)
+            self._pending[task_id] = (i, future, files)
+            self._load[i] += 1
+        self._send_all(backlog)
+        try:
+            payload = bytes(ForkingPickler.dumps((func, args, kwargs)))
+            with self._lock:
+                if i in self._dead:
+                    self._queued.setdefault(i, []).append((task_id, payload))
+                    return future
+            self._send(i, task_id, payload)
+        except Exception as e:  # e.g. func or its arguments can't be pickled
+            self._fail(i, task_id, e)
+        return future
+
+    def _send(self, i, task_id, payload):
+        with self._send_locks[i]:
+            self._conns[i].send((task_id, payload))
+
+    def _send_all(self, backlog):
+        for i, tasks in backlog:
+            for task_id, payload in tasks:
+                try:
+                    self._send(i, task_id, payload)
+                except Exception as e:
+                    self._fail(i, task_id, e)
+
+    def _fail(self, i, task_id, error):
+        with self._lock:
+            entry = self._pending.pop(task_id, None)
+            if entry is not None:
+                self._load[i] -= 1
+        if entry is not None and not entry[1].done():
+            entry[1].set_exception(error)
+
+    def _replace(self):
+        """
+        Start replacements for the dead workers if this is the main thread, must be called with the lock held. Returns
+        the (worker, tasks) that were queued for them, to be sent once the lock is released.
+        """
+        if not self._dead or self._closed or threading.current_thread() is not threading.main_thread():
+            return []
+        backlog = []
+        for i in sorted(self._dead):
+            self._procs[i], self._conns[i] = self._start(i)
+            backlog.append((i, self._queued.pop(i, [])))
+        self._dead.clear()
+        self._wake()
+        return backlog
+
+    def replace_lost(self):
+        """Start replacements for workers that have died, does nothing unless called from the main thread"""
+        with self._lock:
+            backlog = self._replace()
+        self._send_all(backlog)
+
+    def starmap(self, func, arglists, affinity=None, ncpu=None):
+        """
+        Return [func(*args) for args in arglists] computed in the workers, raising the first exception encountered.
+
+        :param affinity: optional function of an args tuple returning the file(s) the call works on
+        :param ncpu: maximum number of calls running at once, default the number of workers
+        """
+        limit = threading.BoundedSemaphore(max(int(ncpu or len(self)), 1))
+        futures = []
+        for args in arglists:
+            limit.acquire()
+            future = self._submit(None, func, tuple(args), {}, _paths(affinity(args) if affinity else None))
+            future.add_done_callback(lambda _: limit.release())
+            futures.append(future)
+        return [f.result() for f in futures]
+
+    def map(self, func, items, affinity=None, ncpu=None):
+        """As starmap for [func(item) for item in items], affinity is a function of an item"""
+        return self.starmap(func, ((item,) for item in items), ncpu=ncpu,
+                            affinity=(lambda args: affinity(args[0])) if affinity else None)
+
+    def release(self, file_name):
+        """Have any worker holding file_name close it, waiting for tasks working on the file to finish"""
+        path = _paths(file_name)
+        with self._lock:
+            holders = [i for i in range(len(self._procs)) if not path.isdisjoint(self._owned(i))]
+        for i in holders:
+            self._submit(i, _close_file, tuple(path), {}, set()).result()
+
+    def _collect(self):
+        """Resolve futures as results arrive and replace workers that die"""
+        while True:
+            with self._lock:
+                if self._closed and not self._pending:
+                    return
+                live = [i for i in range(len(self._procs)) if i not in self._exited and i not in self._dead]
+                conns = {i: self._conns[i] for i in live}
+                sentinels = {i: self._procs[i].sentinel for i in live}
+            ready = mp.connection.wait(list(conns.values()) + list(sentinels.values()) + [self._wake_r])
+            if self._wake_r in ready:
+                self._wake_r.recv_bytes()
+            for i, conn in conns.items():
+                while conn in ready and conn.poll():
+                    try:
+                        task_id, ok, value, held = conn.recv()
+                    except (EOFError, OSError):
+                        break
+                    with self._lock:
+                        entry = self._pending.pop(task_id, None)
+                        self._held[i] = set(held)
+                        if entry is None:  # failed when the pool broke
+                            continue
+                        future = entry[1]
+                        self._load[i] -= 1
+                    if ok:
+                        future.set_result(value)
+                    else:
+                        future.set_exception(value)
+            for i, sentinel in sentinels.items():
+                if sentinel in ready:
+                    self._lost(i)
+
+    def _lost(self, i):
+        """
+        Fail the tasks of worker i, which has exited, and mark it for replacement (see _replace) unless shutting down
+        or MAX_RESTARTS have been made, in which case every task is failed and the pool shut down
+        """
+        error = RuntimeError(f'Pipeline worker {i} exited while running the task')
+        with self._lock:
+            lost = [t for t, (w, _, _) in self._pending.items() if w == i]
+            futures = [self._pending.pop(t)[1] for t in lost]
+            self._load[i] = 0
+            self._held[i] = set()
+            self._procs[i].join(1)
+            code = self._procs[i].exitcode
+            broke = not self._closed and self._restarts >= MAX_RESTARTS
+            if not self._closed and not broke:
+                self._restarts += 1
+                getLogger(__name__).error(f'Pipeline worker {i} exited with code {code}, replacing it '
+                                          f'({self._restarts}/{MAX_RESTARTS}). {len(futures)} task(s) were lost.')
+                self._conns[i].close()
+                self._dead.add(i)
+            else:
+                self._exited.add(i)
+            if broke:
+                self._broken = (f'Pipeline workers exited {MAX_RESTARTS + 1} times, the last ({i}) with code {code}. '
+                                f'See the log for why they fail.')
+                getLogger(__name__).critical(f'{self._broken} Failing all {len(self._pending) + len(futures)} '
+                                             f'unfinished task(s).')
+                error = RuntimeError(self._broken)
+                futures += [f for _, f, _ in self._pending.values()]
+                self._pending.clear()
+                self._queued.clear()
+                self._load = [0] * len(self._load)
+        for f in futures:
+            f.set_exception(error)
+        if broke:
+            self.shutdown(wait=False)
+
+    def shutdown(self, wait=True):
+        """Stop the workers once they have finished their tasks"""
+        with self._lock:
+            if self._closed:
+                return
+            self._closed = True
+            procs, conns = list(self._procs), list(self._conns)
+            dead = set(self._dead)
+            queued = [(i, t) for i, tasks in self._queued.items() for t, _ in tasks]
+            self._queued.clear()
+        for i, task_id in queued:  # never sent, their workers won't be replaced now
+            self._fail(i, task_id, RuntimeError('WorkerPool was shut down'))
+        for i, (lock, conn) in enumerate(zip(self._send_locks, conns)):
+            if i in dead:
+                continue
+            try:
+                with lock:
+                    conn.send(None)
+            except (OSError, ValueError):
+                pass
+        self._wake()
+        if wait:
+            for i, p in enumerate(procs):
+                if i not in dead:
+                    p.join()
+            self._collector.join()
+
+
+def shared_pool(nworkers=None):
+    """
+    Return the pipeline-wide WorkerPool, starting it on first use and growing it to nworkers (default
+    mkidpipeline.config.n_cpus_available()). Returns None when called from a pool worker, there tasks should run in
+    the worker itself.
+    """
+    global _pool
+    if _in_worker:
+        return None
+    if nworkers is None:
+        import mkidpipeline.config
+        nworkers = mkidpipeline.config.n_cpus_available()
+    nworkers = max(int(nworkers), 1)
+    with _pool_lock:
+        if _pool is None:
+            getLogger(__name__).debug(f'Starting {nworkers} pipeline workers')
+            from mkidpipeline.photontable import close_photontables
+            close_photontables()  # Any of them may be written by a worker, see open_photontable
+            _pool = WorkerPool(nworkers)
+        elif len(_pool) < nworkers:
+            _pool.grow(nworkers)
+        return _pool
+
+
+def running():
+    """Return True if this process has started the shared pool and not shut it down"""
+    return _pool is not None and not _in_worker
+
+
+def pool_map(func, items, ncpu=1, affinity=None, star=False):
+    """
+    Return [func(item) for item in items], computed in the shared pool with at most ncpu items at once or, if ncpu is 1
+    or this is a pool worker, in this process.
+
+    :param affinity: optional function of an item returning the file(s) it works on, see WorkerPool.submit
+    :param star: items are tuples of arguments, call func(*item)
+    """
+    items = list(items)
+    ncpu = min(max(int(ncpu or 1), 1), len(items))
+    pool = shared_pool(ncpu) if ncpu > 1 else None
+    if pool is None:
+        return [func(*item) if star else func(item) for item in items]
+    if star:
+        return pool.starmap(func, items, affinity=affinity, ncpu=ncpu)
+    return pool.map(func, items, affinity=affinity, ncpu=ncpu)
+
+
+def release(file_name):
+    """Have the workers of the shared pool, if it is running, close file_name"""
+    if _pool is not None and not _in_worker:
+        _pool.release(file_name)
+
+
+def shutdown():
+    """Stop the shared pool, the next call to shared_pool starts new workers"""
+    global _pool
+    with _pool_lock:
+        pool, _pool = _pool, None
+    if pool is not None:
+        pool.shutdown()
+
+
+# Workers are not daemonic, multiprocessing would wait on them forever at exit
+atexit.register(shutdown)
@@ -0,0 +1,200 @@
+"""
+Dependency driven execution of a graph of tasks
+
+A pipeline run is a set of tasks (build an h5, apply a step to an h5, generate a calibration product) with
+dependencies between them. Running the pipeline step by step puts a barrier after every step, so one slow calibration
+holds up unrelated files and cores idle while the last few tasks of a step finish. TaskGraph instead starts each task as
+soon as everything it depends on has finished. Tasks run in the pipeline-wide worker pool (mkidpipeline.utils.pooling)
+limited to a CPU budget, ready tasks are started in order of the length of the chain of work that waits on them and are
+sent to the worker that already has their files open. Tasks that must run in the calling process
+(e.g. ones that open GUIs or manage their own pools) are run there one at a time, in a helper thread so that tasks
+finishing in the pool meanwhile still start their dependents.
+
+RAM is not budgeted here, tasks reserve it themselves through mkidpipeline.utils.memory as they open photontables.
+
+Classes
+
+    Task        : A unit of work and the keys of the tasks it depends on
+    TaskGraph   : Runs a set of tasks in dependency order
+"""
+import heapq
+import queue
+from collections import defaultdict
+from concurrent.futures import ThreadPoolExecutor
+
+from mkidcore.corelog import getLogger
+from mkidpipeline.utils import pooling
+
+# Seconds between checks for pool workers to replace while waiting on tasks
+REPLACE_INTERVAL = 1
+
+
+class Task:
+    def __init__(self, key, func, args=(), kwargs=None, deps=(), cost=1, local=False, affinity=()):
+        """
+        :param key: hashable name of the task, unique within a graph
+        :param func: the callable to run, must be picklable unless local
+        :param args: positional arguments for func
+        :param kwargs: keyword arguments for func
+        :param deps: keys of the tasks that must finish before this one starts
+        :param cost: number of CPUs the task occupies while it runs
+        :param local: run the task in the calling process instead of the pool, its cost should be the CPUs it uses
+            there (e.g. the size of a pool of its own) rather than the budget
+        :param affinity: files the task works on, it must name any file it writes (see mkidpipeline.utils.pooling)
+        """
+        self.key = key
+        self.func = func
+        self.args = tuple(args)
+        self.kwargs = kwargs or {}
+        self.deps = tuple(dict.fromkeys(deps))
+        self.cost = max(int(cost), 1)
+        self.local = local
+        self.affinity = affinity
+
+    def __call__(self):
+        return self.func(*self.args, **self.kwargs)
+
+    def __repr__(self):
+        return f'Task({self.key})'
+
+
+class TaskGraph:
+    def __init__(self, tasks=()):
+        self.tasks = {}
+        for t in tasks:
+            self.add(t)
+
+    def __len__(self):
+        return len(self.tasks)
+
+    def __contains__(self, key):
+        return key in self.tasks
+
+    def __iter__(self):
+        return iter(self.tasks.values())
+
+    def add(self, task):
+        """Add a task, its dependencies must be added before the graph is run"""
+        if task.key in self.tasks:
+            raise ValueError(f'Duplicate task {task.key}')
+        self.tasks[task.key] = task
+        return task
+
+    def _dependents(self):
+        dependents = defaultdict(list)
+        for t in self.tasks.values():
+            for d in t.deps:
+                if d not in self.tasks:
+                    raise ValueError(f'{t} depends on unknown task {d}')
+                dependents[d].append(t.key)
+        return dependents
+
+    def order(self):
+        """Return the task keys in a dependency respecting order, raises ValueError if the graph has a cycle"""
+        dependents = self._dependents()
+        waiting = {k: len(t.deps) for k, t in self.tasks.items()}
+        order = [k for k, n in waiting.items() if not n]
+        for k in order:
+            for d in dependents[k]:
+                waiting[d] -= 1
+                if not waiting[d]:
+                    order.append(d)
+        if len(order) != len(self.tasks):
+            raise ValueError(f'Task graph has a cycle through {[k for k, n in waiting.items() if n]}')
+        return order
+
+    def priorities(self):
+        """Return the number of tasks on the longest chain starting at each task"""
+        dependents = self._dependents()
+        depth = {}
+        for k in reversed(self.order()):
+            depth[k] = 1 + max((depth[d] for d in dependents[k]), default=0)
+        return depth
+
+    def run(self, ncpu=1):
+        """
+        Run every task once all of its dependencies have finished, using at most ncpu CPUs at a time. With ncpu=1, or
+        when called from a pool worker, every task is run in the calling process.
+
+        The tasks of a failed task are skipped, everything else is run before a RuntimeError naming the failures is
+        raised.
+
+        :return: dict of task key: return value
+        """
+        ncpu = max(int(ncpu or 1), 1)
+        dependents = self._dependents()
+        priority = self.priorities()
+        index = {k: i for i, k in enumerate(self.tasks)}
+        waiting = {k: len(t.deps) for k, t in self.tasks.items()}
+        ready = []
+        for k, n in waiting.items():
+            if not n:
+                heapq.heappush(ready, (-priority[k], index[k], k))
+
+        results, failed = {}, {}
+        finished = queue.Queue()
+        inline = []
+        free = ncpu
+        running = 0
+
+        def finish(key, error=None, result=None):
+            nonlocal free, running
+            free += min(self.tasks[key].cost, ncpu)
+            running -= 1
+            if error is not None:
+                failed[key] = error
+                getLogger(__name__).critical(f'Task {key} failed, its dependent tasks will be skipped',
+                                             exc_info=error)
+                return
+            results[key] = result
+            getLogger(__name__).info(f'Finished {key} ({len(results)}/{len(self.tasks)})')
+            for d in dependents[key]:
+                waiting[d] -= 1
+                if not waiting[d]:
+                    heapq.heappush(ready, (-priority[d], index[d], d))
+
+        pool = pooling.shared_pool(ncpu) if ncpu > 1 else None
+        # Local tasks run one at a time, as they would in this thread, but this thread must stay free to start the
+        # dependents of pool tasks while one runs
+        helper = ThreadPoolExecutor(max_workers=1, thread_name_prefix='TaskGraph') if pool is not None else None
+        try:
+            while ready or running:
+                # Start ready tasks in priority order while they fit in the budget. A task that doesn't fit blocks
+                # the ones behind it so that large tasks can't be starved.
+                while ready and min(self.tasks[ready[0][2]].cost, ncpu) <= free:
+                    key = heapq.heappop(ready)[2]
+                    task = self.tasks[key]
+                    free -= min(task.cost, ncpu)
+                    running += 1
+                    getLogger(__name__).debug(f'Starting {key}')
+                    if pool is None:
+                        inline.append(key)
+                        continue
+                    if task.local:
+                        future = helper.submit(task)
+                    else:
+                        future = pool.submit(task.func, *task.args, affinity=task.affinity, **task.kwargs)
+                    future.add_done_callback(lambda f, key=key: finished.put((key, f)))
+                if inline:
+                    key = inline.pop(0)
+                    try:
+                        result = self.tasks[key]()
+                    except Exception as e:
+                        finish(key, error=e)
+                    else:
+                        finish(key, result=result)
+                    continue
+                try:
+                    key, future = finished.get(timeout=REPLACE_INTERVAL)
+                except queue.Empty:
+                    pool.replace_lost()  # workers are only forked by this, the main, thread
+                    continue
+                finish(key, error=future.exception(), result=None if future.exception() else future.result())
+        finally:
+            if helper is not None:
+                helper.shutdown(wait=False)
+
+        if failed:
+            skipped = len(self.tasks) - len(results) - len(failed)
+            raise RuntimeError(f'{len(failed)} task(s) failed and {skipped} were skipped: {list(failed)}')
+        return results
@@ -0,0 +1,333 @@
+"""
+Photons of an h5 held in shared memory for all the pipeline processes
+
+Steps that look at every pixel of a file in many processes (e.g. wavecal) would otherwise each load the file. A
+SharedPhotons store is loaded once into named shared memory segments, one per photon column plus one for the index of
+the rows of each resID, and any process of the pipeline attaches to them without a copy. Stores are found by their
+file and query, so SharedPhotons.open loads a store only if no process has it yet, and a store passed to a pool worker
+(e.g. as a task argument) is attached to by name when unpickled.
+
+Each process holding a store counts as a reference to it, the segments are removed when the last is closed. The
+references are kept in a registry shared with the processes forked from this one and those of processes that die are
+dropped, so a crashed worker neither leaks a store nor removes it from under the others. Segment names carry the pid of
+the process the registry was created in, segments left by a pipeline run that died are removed by the next.
+
+Functions
+
+    cleanup     : Remove the segments of stores whose pipeline run has died
+
+Classes
+
+    SharedPhotons   : A read-only photon list in shared memory, its photons sorted by resID and indexed
+"""
+import atexit
+import ctypes
+import glob
+import hashlib
+import multiprocessing as mp
+import os
+import time
+from multiprocessing import resource_tracker, shared_memory
+
+import numpy as np
+
+from mkidcore.corelog import getLogger
+from mkidpipeline.utils.sysinfo import pid_alive
+
+SHM_DIR = '/dev/shm'
+PREFIX = 'mkidphot'
+MAX_STORES = 256
+MAX_HOLDS = 4096
+WAIT_INTERVAL = 1  # how often a process waiting on another's load checks that the loader is alive
+
+COLUMNS = (('resID', np.uint32), ('time', np.uint32), ('wavelength', np.float32), ('weight', np.float32))
+_INDEX_DTYPE = np.dtype([('resID', np.uint32), ('start', np.int64), ('stop', np.int64)])
+
+_FREE, _LOADING, _READY = 0, 1, 2
+
+
+class _Store(ctypes.Structure):
+    _fields_ = [('key', ctypes.c_char * 41), ('state', ctypes.c_int), ('loader', ctypes.c_int),
+                ('nrows', ctypes.c_int64), ('nresids', ctypes.c_int64), ('duration', ctypes.c_double)]
+
+
+class _Hold(ctypes.Structure):
+    _fields_ = [('store', ctypes.c_int), ('pid', ctypes.c_int), ('count', ctypes.c_int)]
+
+
+# The registry is shared with the processes forked from this one and guarded by _registry
+_root = os.getpid()
+_registry = mp.Condition()
+_stores = mp.RawArray(_Store, MAX_STORES)
+_holds = mp.RawArray(_Hold, MAX_HOLDS)  # pid 0 marks a free slot
+
+
+def _name(key, column):
+    return f'{PREFIX}_{_root}_{key}_{column}'
+
+
+def _unlink(key):
+    for column in [c for c, _ in COLUMNS] + ['index']:
+        try:
+            os.unlink(os.path.join(SHM_DIR, _name(key, column)))
+        except FileNotFoundError:
+            pass
+
+
+def _segment(name, size=0):
+    """
+    Create (size > 0) or attach to the segment name. It is untracked: the registry, not the multiprocessing resource
+    tracker of whichever process happened to touch it, decides when it goes.
+    """
+    shm = shared_memory.SharedMemory(name=name, create=size > 0, size=size)
+    try:
+        resource_tracker.unregister(shm._name, 'shared_memory')
+    except Exception:
+        pass
+    return shm
+
+
+def _free(i):
+    """Remove store i, call with _registry held"""
+    _unlink(_stores[i].key.decode())
+    _stores[i].state, _stores[i].key, _stores[i].loader = _FREE, b'', 0
+
+
+def _reap():
+    """Drop the holds of processes that have died and remove stores left without any, call with _registry held"""
+    changed = False
+    for h in _holds:
+        if h.pid and not pid_alive(h.pid):
+            h.pid, h.count = 0, 0
+            changed = True
+    held = {h.store for h in _holds if h.pid}
+    for i, s in enumerate(_stores):
+        if s.state == _READY and i not in held or s.state == _LOADING and not pid_alive(s.loader):
+            getLogger(__name__).debug(f'Removing abandoned shared photon store {s.key.decode()}')
+            _free(i)
+            changed = True
+    if changed:
+        _registry.notify_all()
+
+
+def _hold(i, pid, delta):
+    """Change the count of pid's references to store i by delta, call with _registry held"""
+    free = None
+    for h in _holds:
+        if h.pid == pid and h.store == i:
+            h.count += delta
+            if h.count <= 0:
+                h.pid, h.count = 0, 0
+            return
+        if free is None and not h.pid:
+            free = h
+    if delta > 0:
+        if free is None:
+            raise RuntimeError(f'More than {MAX_HOLDS} references to shared photon stores')
+        free.store, free.pid, free.count = i, pid, delta
+
+
+def _find(key):
+    for i, s in enumerate(_stores):
+        if s.state != _FREE and s.key.decode() == key:
+            return i
+    return None
+
+
+def cleanup():
+    """Remove the segments of stores made by pipeline runs whose first process has exited"""
+    for path in glob.glob(os.path.join(SHM_DIR, f'{PREFIX}_*')):
+        try:
+            pid = int(os.path.basename(path).split('_')[1])
+        except (IndexError, ValueError):
+            continue
+        if pid != _root and not pid_alive(pid):
+            getLogger(__name__).info(f'Removing {path} left by exited pipeline process {pid}')
+            try:
+                os.unlink(path)
+            except OSError:
+                pass
+
+
+def _cleanup_at_exit():
+    if os.getpid() != _root:
+        return
+    with _registry:
+        for i, s in enumerate(_stores):
+            if s.state != _FREE:
+                _free(i)
+
+
+atexit.register(_cleanup_at_exit)
+
+
+class SharedPhotons:
+    """
+    The photons of an h5 in shared memory, sorted by resID. Use open, then close or a with block, to get one.
+    Columns are read-only numpy arrays mapped from the segments, e.g. store.columns['wavelength'].
+    """
+
+    def __init__(self, key):
+        """Attach to the ready store key, with a reference already taken for this process"""
+        self.key = key
+        self._pid = os.getpid()
+        self._segments = {}
+        with _registry:
+            s = _stores[_find(key)]
+            self.nrows, nresids, self.duration = s.nrows, s.nresids, s.duration
+        self.columns = {c: self._map(c, dtype, self.nrows) for c, dtype in COLUMNS}
+        index = self._map('index', _INDEX_DTYPE, nresids)
+        self.resids, self.starts, self.stops = index['resID'], index['start'], index['stop']
+
+    def _map(self, column, dtype, n):
+        shm = self._segments[column] = _segment(_name(self.key, column))
+        a = np.ndarray(n, dtype=dtype, buffer=shm.buf)
+        a.flags.writeable = False
+        return a
+
+    @staticmethod
+    def _key(file, query):
+        file = os.path.realpath(file)
+        st = os.stat(file)
+        ident = repr((file, st.st_mtime_ns, st.st_size, sorted((query or {}).items())))
+        return hashlib.sha1(ident.encode()).hexdigest()
+
+    @classmethod
+    def open(cls, file, query=None):
+        """
+        Return the store of the photons of file returned by Photontable.query(**query) (all of them by default),
+        loading it unless a pipeline process has done so already or is doing so now
+        """
+        key, pid = cls._key(file, query), os.getpid()
+        with _registry:
+            while True:
+                _reap()
+                i = _find(key)
+                if i is None:
+                    i = next((j for j, s in enumerate(_stores) if s.state == _FREE), None)
+                    if i is None:
+                        raise RuntimeError(f'More than {MAX_STORES} shared photon stores')
+                    _stores[i].key, _stores[i].state, _stores[i].loader = key.encode(), _LOADING, pid
+                    break
+                if _stores[i].state == _READY:
+                    _hold(i, pid, 1)
+                    return cls(key)
+                _registry.wait(WAIT_INTERVAL)  # Another process is loading it
+
+        try:
+            nrows, nresids, duration = cls._load(file, query, key)
+        except BaseException:
+            with _registry:
+                _free(i)
+                _registry.notify_all()
+            raise
+        with _registry:
+            s = _stores[i]
+            s.nrows, s.nresids, s.duration, s.state, s.loader = nrows, nresids, duration, _READY, 0
+            _hold(i, pid, 1)
+            _registry.notify_all()
+        return cls(key)
+
+    @staticmethod
+    def _load(file, query, key):
+        from mkidpipeline.photontable import Photontable
+        tic = time.time()
+        pt = Photontable(file)
+        photons = pt.query(**(query or {}))
+        duration = pt.duration
+        del pt
+        if photons.size and (photons['resID'][1:] < photons['resID'][:-1]).any():
+            photons = photons[np.argsort(photons['resID'], kind='stable')]
+        for c, dtype in COLUMNS:
+            a = np.dtype(dtype)
+            shm = _segment(_name(key, c), size=max(photons.size * a.itemsize, 1))
+            np.ndarray(photons.size, dtype=a, buffer=shm.buf)[:] = photons[c]
+            shm.close()
+        resids, starts = np.unique(photons['resID'], return_index=True)
+        shm = _segment(_name(key, 'index'), size=max(resids.size * _INDEX_DTYPE.itemsize, 1))
+        index = np.ndarray(resids.size, dtype=_INDEX_DTYPE, buffer=shm.buf)
+        index['resID'], index['start'], index['stop'] = resids, starts, np.append(starts[1:], photons.size)
+        del index
+        shm.close()
+        msg = 'Loaded {} photons from {} into shared memory in {:.2f} s, using {:.2f} GB'
+        getLogger(__name__).info(msg.format(photons.size, file, time.time() - tic, photons.nbytes / 1024 ** 3))
+        return photons.size, resids.size, duration
+
+    def rows(self, resid):
+        """Return the (start, stop) rows of the photons of resid"""
+        i = np.searchsorted(self.resids, resid)
+        if i < self.resids.size and self.resids[i] == resid:
+            return int(self.starts[i]), int(self.stops[i])
+        return 0, 0
+
+    def query(self, resid=None, column=None):
+        """
+        Return the photons of resid (default all) as a structured array like Photontable.query, or if column is given
+        a read-only view of that column
+        """
+        start, stop = (0, self.nrows) if resid is None else self.rows(resid)
+        if column is not None:
+            return self.columns[column][start:stop]
+        photons = np.empty(stop - start, dtype=[(c, dtype) for c, dtype in COLUMNS])
+        for c, _ in COLUMNS:
+            photons[c] = self.columns[c][start:stop]
+        return photons
+
+    @property
+    def closed(self):
+        return not self._segments
+
+    def close(self):
+        """Release this reference, the segments are removed once no process holds the store"""
+        if self.closed:
+            return
+        self.columns, self.resids, self.starts, self.stops = {}, None, None, None
+        for shm in self._segments.values():
+            try:
+                shm.close()
+            except BufferError:  # a view of the data is still in use, the mapping goes with it
+                pass
+        self._segments = {}
+        if os.getpid() != self._pid:  # an object inherited by a forked process carries no reference
+            return
+        with _registry:
+            i = _find(self.key)
+            if i is None:
+                return
+            _hold(i, self._pid, -1)
+            _reap()
+            if _stores[i].state != _FREE and not any(h.pid and h.store == i for h in _holds):
+                _free(i)
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def __del__(self):
+        try:
+            self.close()
+        except Exception:
+            pass
+
+    def __reduce__(self):
+        return _attach, (self.key,)
+
+    def __repr__(self):
+        return f'SharedPhotons({self.key}, {self.nrows} photons{", closed" if self.closed else ""})'
+
+
+def _attach(key):
+    """Unpickle a store by taking a reference to it for this process"""
+    with _registry:
+        _reap()
+        i = _find(key)
+        if i is None or _stores[i].state != _READY:
+            raise RuntimeError(f'Shared photon store {key} no longer exists')
+        _hold(i, os.getpid(), 1)
+    return SharedPhotons(key)
+
+
+if os.path.isdir(SHM_DIR):
+    cleanup()
@@ -4,6 +4,8 @@ import matplotlib.pyplot as plt
 import scipy.constants as con
 from scipy.interpolate import griddata
 import scipy.integrate
+import scipy.ndimage
+from concurrent.futures import ThreadPoolExecutor
 import astropy
 import warnings
 from astropy.convolution import convolve
@@ -395,3 +397,133 @@ def nearest_n_std_filter(input_array, n=24):
         for col in np.arange(n_col):
             output_array[row, col] = np.std(input_array[find_nearest_finite(input_array, row, col, n=n)])
     return output_array
+
+
+# Stack filters
+#
+# The functions below filter a (n_slice, n_row, n_col) stack of images slice by slice, i.e. they are equivalent to
+# calling the 2D filter on each image, but do the work in array operations rather than per-pixel python callbacks.
+
+
+def map_slices(func, stack, ncpu=1):
+    """
+    Apply func to contiguous chunks of the leading axis of stack using ncpu threads and return the concatenated
+    result. func must work on any number of slices; numpy and scipy.ndimage release the GIL for the bulk of the work.
+    """
+    stack = np.asarray(stack)
+    nchunk = max(min(ncpu or 1, len(stack)), 1)
+    if nchunk == 1:
+        return func(stack)
+    chunks = np.array_split(stack, nchunk)
+    with ThreadPoolExecutor(max_workers=nchunk) as pool:
+        return np.concatenate(list(pool.map(func, chunks)))
+
+
+def mean_filter_nan_stack(stack, size=3):
+    """
+    mean_filter_nan(image, size=size, mode='mirror') of every image in stack. Windows without any finite value are
+    NaN.
+    """
+    good = np.isfinite(stack)
+    window = (1, size, size)
+    total = scipy.ndimage.uniform_filter(np.where(good, stack, 0.0), window, mode='mirror')
+    count = scipy.ndimage.uniform_filter(good.astype(float), window, mode='mirror')
+    with np.errstate(invalid='ignore', divide='ignore'):
+        mean = total / count
+    mean[count * size ** 2 < 0.5] = np.nan
+    return mean
+
+
+def std_filter_nan_stack(stack, size=3):
+    """
+    NaN-ignoring standard deviation (np.nanstd) of the size x size window around each pixel of every image in stack,
+    mirror boundary. Windows without any finite value are NaN.
+    """
+    good = np.isfinite(stack)
+    # Remove each slice's mean first so the sum of squares doesn't swamp the variance
+    offset = np.array([np.nanmean(im) if g.any() else 0.0 for im, g in zip(stack, good)])[:, None, None]
+    x = np.where(good, stack - offset, 0.0)
+    window = (1, size, size)
+    count = scipy.ndimage.uniform_filter(good.astype(float), window, mode='mirror')
+    with np.errstate(invalid='ignore', divide='ignore'):
+        mean = scipy.ndimage.uniform_filter(x, window, mode='mirror') / count
+        var = scipy.ndimage.uniform_filter(x * x, window, mode='mirror') / count - mean ** 2
+    std = np.sqrt(np.clip(var, 0, None))
+    std[count * size ** 2 < 0.5] = np.nan
+    return std
+
+
+def replace_nan_stack(stack, box_size=3):
+    """
+    replace_nan(image, mode='mean', box_size=box_size) of every image in stack. Slices that are entirely NaN are left
+    as is.
+    """
+    output_array = np.array(stack, dtype=float)
+    while True:
+        nan = np.isnan(output_array)
+        todo = nan.any(axis=(1, 2)) & ~nan.all(axis=(1, 2))
+        if not todo.any():
+            return output_array
+        sub = output_array[todo]
+        interpolates = mean_filter_nan_stack(sub, size=box_size)
+        sub[nan[todo]] = interpolates[nan[todo]]
+        output_array[todo] = sub
+
+
+def _neighbour_offsets(radius):
+    """Row and column offsets within radius of (0, 0), excluding it, ordered by distance then raster position"""
+    i, j = np.mgrid[-radius:radius + 1, -radius:radius + 1]
+    i, j = i.ravel(), j.ravel()
+    d2 = i ** 2 + j ** 2
+    keep = (d2 > 0) & (d2 <= radius ** 2)
+    order = np.argsort(d2[keep], kind='stable')
+    return i[keep][order], j[keep][order]
+
+
+def _sorted_median(sorted_vals, m):
+    """Median of the first m values of each row of sorted_vals, NaN where m is 0"""
+    rows = np.arange(len(m))
+    hi = sorted_vals[rows, np.minimum(m // 2, sorted_vals.shape[1] - 1)]
+    lo = sorted_vals[rows, np.maximum((m - 1) // 2, 0)]
+    with np.errstate(invalid='ignore'):
+        return np.where(m > 0, (lo + hi) / 2, np.nan)
+
+
+def _nearest_n_robust_sigma(image, n, max_elements=2 ** 22):
+    n_row, n_col = image.shape
+    output_array = np.full(image.shape, np.nan)
+    n_finite = np.isfinite(image).sum()
+    radius = int(np.ceil(np.sqrt(n))) + 1
+    todo_row, todo_col = np.divmod(np.arange(image.size), n_col)
+    while todo_row.size:
+        di, dj = _neighbour_offsets(radius)
+        padded = np.pad(image.astype(float), radius, mode='constant', constant_values=np.nan)
+        complete = radius >= max(n_row, n_col)
+        found = np.zeros(todo_row.size, dtype=bool)
+        block = max(max_elements // di.size, 1)
+        for s in range(0, todo_row.size, block):
+            r, c = todo_row[s:s + block, None] + radius, todo_col[s:s + block, None] + radius
+            vals = padded[r + di, c + dj]
+            good = np.isfinite(vals)
+            use = good & (np.cumsum(good, axis=1) <= n)
+            m = use.sum(axis=1)
+            # A pixel is done once it has n neighbours, or all the finite pixels of the image other than itself
+            done = (m == n) | (m == n_finite - np.isfinite(image[r[:, 0] - radius, c[:, 0] - radius])) | complete
+            vals = np.where(use, vals, np.inf)[done]
+            m = m[done]
+            med = _sorted_median(np.sort(vals, axis=1), m)
+            mad = _sorted_median(np.sort(np.abs(vals - med[:, None]), axis=1), m)
+            output_array[r[done, 0] - radius, c[done, 0] - radius] = mad * 1.4826
+            found[s:s + block] = done
+        todo_row, todo_col = todo_row[~found], todo_col[~found]
+        radius *= 2
+    return output_array
+
+
+def nearest_n_robust_sigma_filter_stack(stack, n=24, ncpu=1):
+    """
+    nearest_n_robust_sigma_filter(image, n=n) of every image in stack. Neighbours are gathered ring by ring from a
+    distance-ordered offset table instead of sorting the distance to every pixel of the image for every pixel.
+    Equidistant neighbours are taken in raster order.
+    """
+    return map_slices(lambda chunk: np.array([_nearest_n_robust_sigma(im, n) for im in chunk]), stack, ncpu=ncpu)
@@ -21,14 +21,12 @@ def signal_to_noise(image, num_apertures, center, dist, pa, radius, save_path=No
     the signal aperture)
     :return: signal, noise
     """
-    aperture_values = np.zeros(num_apertures)
     fig, ax = plt.subplots()
     im = ax.imshow(image)
     angular_size = 2 * np.arctan(radius / dist)
-    for i in range(num_apertures):
-        aperture_center = get_aperture_center(pa, i * angular_size, center, dist)
-        im = image.copy()
-        aperture_values[i] = aper_photometry(im, aperture_center, radius)
+    aperture_centers = [get_aperture_center(pa, i * angular_size, center, dist) for i in range(num_apertures)]
+    aperture_values = batch_aper_photometry(image, aperture_centers, radius)[0]
+    for aperture_center in aperture_centers:
         circle1 = plt.Circle((aperture_center[0], aperture_center[1]), radius=radius, fill=False, color='r')
         circle2 = plt.Circle((aperture_center[0], aperture_center[1]), radius=radius + 0.5 * radius, fill=False,
                              color='g')
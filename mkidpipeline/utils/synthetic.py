@@ -0,0 +1,312 @@
+"""
+Synthetic MKID photon data for benchmarks and tests
+
+Photons are drawn for the good pixels of a beammap. Each pixel has a constant Poisson count rate drawn from a lognormal
+distribution, with a small fraction of hot pixels at many times the typical rate and of dead pixels that never count.
+Cosmic rays arrive as bursts that put a photon in a large fraction of the array within a few microseconds. Photons
+closer together than the dead time of a pixel are dropped, as the readout would.
+
+Science exposures have a flat spectrum over a range of wavelengths, laser exposures the lines of the wavecal
+lasers broadened by the resolving power of each pixel. Either can be written calibrated (the wavelength column
+holds nm) or raw, in which case it holds the phase (degrees) of a linear phase-energy response that varies by pixel,
+as h5s do before the wavecal is applied.
+
+Raw photons can also be written as the per-second .bin files the readout produces (see write_bins) so the whole
+ingest path can be exercised. A .bin file is a stream of big-endian 64 bit words. Each packet is a header word followed
+by the photons one readout board (roach) saw in one 0.5 ms frame, at most PHOTONS_PER_PACKET of them. From the most
+significant bit:
+
+    header: start (8 bits, 0xff) | roach (8) | frame counter (12) | timestamp (36, 0.5 ms ticks since the start of the
+            UTC year)
+    photon: x (10) | y (10) | timestamp (9, us since the frame timestamp) | phase (18, signed, radians * 2**15) |
+            baseline (17, signed, radians * 2**14)
+
+Functions
+
+    good_resids     : resIDs of the unflagged pixels of a beammap
+    pixel_rates     : Per-pixel count rates with hot and dead pixels
+    photon_list     : Photons of a science or laser exposure, sorted as buildhdf writes them
+    encode_bin      : Encode raw photons as the words of a .bin file
+    write_bins      : Write an exposure as per-second .bin files
+
+Classes
+
+    Detector        : The pixels of a synthetic array, draws their photons
+"""
+import os
+import argparse
+import calendar
+import time as _time
+from datetime import datetime
+
+import numpy as np
+
+from mkidcore.binfile.mkidbin import PhotonNumpyType
+from mkidcore.corelog import getLogger
+
+# Wavelengths (nm) of the MEC wavecal lasers
+LASER_WAVELENGTHS = (850, 950, 1100, 1250, 1375)
+# Nominal phase response (degrees/eV) and its pixel to pixel scatter
+PHASE_PER_EV = -50.
+PHASE_PER_EV_SIGMA = 5.
+# Nominal baseline (degrees) and its pixel to pixel scatter
+BASELINE = -5.
+BASELINE_SIGMA = 2.
+# Cosmic ray hits within a burst arrive within this many microseconds
+COSMIC_SPREAD_US = 20
+HC_EV_NM = 1239.84198
+
+# .bin format
+FRAME_US = 500
+PHOTONS_PER_PACKET = 100
+# resIDs are feedline * 10000 + n, each feedline is read out by two boards split at this n
+ROACH_SPLIT = 1024
+
+
+def good_resids(beammap, npix=None, rng=None):
+    """
+    Return the sorted resIDs of the unflagged pixels of beammap
+
+    :param npix: use a random subset of this many pixels
+    """
+    resids = np.asarray(beammap.residmap).ravel()[np.asarray(beammap.flagmap).ravel() == 0]
+    if npix is not None and npix < resids.size:
+        rng = np.random.default_rng(rng)
+        resids = rng.choice(resids, npix, replace=False)
+    return np.sort(resids)
+
+
+def pixel_rates(n, rate=200., spread=.5, hot_fraction=.005, hot_factor=20., dead_fraction=.02, rng=None):
+    """
+    Return count rates (photons/s) for n pixels
+
+    :param rate: the mean rate of normal pixels
+    :param spread: the width (sigma of the log) of the lognormal distribution of rates
+    :param hot_fraction: fraction of pixels that are hot
+    :param hot_factor: hot pixels count this many times faster than they otherwise would
+    :param dead_fraction: fraction of pixels with no counts
+    """
+    rng = np.random.default_rng(rng)
+    rates = rate * rng.lognormal(-spread ** 2 / 2, spread, n)
+    rates[rng.random(n) < hot_fraction] *= hot_factor
+    rates[rng.random(n) < dead_fraction] = 0
+    return rates
+
+
+class Detector:
+    """
+    The pixels of a synthetic array: their resIDs, count rates, phase responses, baselines and resolving powers. These
+    are drawn once, so consecutive exposures (or seconds of bin files) come from the same array.
+    """
+
+    def __init__(self, beammap, rate=200., resolving_power=8., npix=None, seed=None, **rate_kwargs):
+        """
+        :param beammap: a beammap with residmap and flagmap, photons are drawn for the unflagged pixels
+        :param rate: mean count rate per pixel (photons/s)
+        :param resolving_power: mean energy resolving power (E/dE FWHM) of the pixels
+        :param npix: use a random subset of this many pixels
+        :param seed: seed for the random numbers, the same arguments and seed give the same photons
+        :param rate_kwargs: passed to pixel_rates
+        """
+        self.beammap = beammap
+        self.rng = np.random.default_rng(seed)
+        self.resids = good_resids(beammap, npix=npix, rng=self.rng)
+        self.rates = pixel_rates(self.resids.size, rate=rate, rng=self.rng, **rate_kwargs)
+        self.response = self.rng.normal(PHASE_PER_EV, PHASE_PER_EV_SIGMA, self.resids.size)
+        self.baseline = self.rng.normal(BASELINE, BASELINE_SIGMA, self.resids.size)
+        self.resolution = np.clip(self.rng.normal(resolving_power, resolving_power / 4, self.resids.size), 1, None)
+
+    def events(self, duration, kind='science', lasers=LASER_WAVELENGTHS, wavelength_range=(950, 1375),
+               cosmic_rate=.05, cosmic_fraction=.3, deadtime_us=10):
+        """
+        Draw the photons of an exposure, see photon_list for the parameters
+
+        :return: pixel (index into resids), time (us since the start) and energy (eV) arrays sorted by pixel then time
+        """
+        if duration * 1e6 >= 2 ** 32:
+            raise ValueError('Photon times are 32 bit microseconds, duration must be less than 4294 s')
+        rng = self.rng
+        counts = rng.poisson(self.rates * duration)
+        pixel = np.repeat(np.arange(self.resids.size), counts)
+        time = rng.integers(0, int(duration * 1e6), pixel.size, dtype=np.uint32)
+        if kind == 'laser':
+            energy = HC_EV_NM / np.asarray(lasers, dtype=float)[rng.integers(0, len(lasers), pixel.size)]
+            energy += rng.normal(0, 1, pixel.size) * energy / self.resolution[pixel] / 2.355
+        elif kind == 'science':
+            energy = HC_EV_NM / rng.uniform(*wavelength_range, pixel.size)
+        else:
+            raise ValueError(f'Unknown kind of exposure {kind}')
+
+        nburst = rng.poisson(cosmic_rate * duration)
+        if nburst:
+            hits = rng.random((nburst, self.resids.size)) < cosmic_fraction
+            burst, hit = np.nonzero(hits)
+            t0 = rng.integers(0, max(int(duration * 1e6) - COSMIC_SPREAD_US, 1), nburst)
+            pixel = np.concatenate((pixel, hit))
+            time = np.concatenate((time, (t0[burst] + rng.integers(0, COSMIC_SPREAD_US, hit.size)).astype(np.uint32)))
+            energy = np.concatenate((energy, rng.uniform(1.5, 3, hit.size)))  # Cosmic hits are large pulses
+
+        order = np.argsort((pixel.astype(np.uint64) << np.uint64(32)) | time, kind='stable')
+        pixel, time, energy = pixel[order], time[order], energy[order]
+        keep = np.ones(pixel.size, dtype=bool)
+        keep[1:] = (pixel[1:] != pixel[:-1]) | (np.diff(time.astype(np.int64)) >= deadtime_us)
+        return pixel[keep], time[keep], energy[keep]
+
+    def photons(self, duration, calibrated=True, **kwargs):
+        """Return a photon array of an exposure, see photon_list"""
+        pixel, time, energy = self.events(duration, **kwargs)
+        photons = np.zeros(pixel.size, dtype=PhotonNumpyType)
+        photons['resID'] = self.resids[pixel]
+        photons['time'] = time
+        photons['wavelength'] = HC_EV_NM / energy if calibrated else self.response[pixel] * energy
+        photons['weight'] = 1
+        return photons
+
+    def roaches(self):
+        """Return the readout board of each pixel"""
+        return 2 * (self.resids // 10000) + (self.resids % 10000 >= ROACH_SPLIT)
+
+    def coordinates(self):
+        """Return the x and y coordinates of each pixel, residmap is indexed [x, y]"""
+        residmap = np.asarray(self.beammap.residmap).ravel()
+        order = np.argsort(residmap)
+        flat = order[np.searchsorted(residmap[order], self.resids)]
+        return np.unravel_index(flat, np.shape(self.beammap.residmap))
+
+
+def photon_list(beammap, duration, rate=200., kind='science', calibrated=True, lasers=LASER_WAVELENGTHS,
+                resolving_power=8., wavelength_range=(950, 1375), cosmic_rate=.05, cosmic_fraction=.3, deadtime_us=10,
+                npix=None, seed=None, **rate_kwargs):
+    """
+    Return a photon array (mkidcore.binfile.mkidbin.PhotonNumpyType) for an exposure starting at time 0 and sorted by
+    resID then time
+
+    :param beammap: a beammap with residmap and flagmap, photons are drawn for the unflagged pixels
+    :param duration: length of the exposure in seconds
+    :param rate: mean count rate per pixel (photons/s)
+    :param kind: 'science' for a flat spectrum over wavelength_range or 'laser' for the lines in lasers
+    :param calibrated: store wavelengths (nm), else phases (degrees)
+    :param resolving_power: mean energy resolving power (E/dE FWHM) of the pixels
+    :param cosmic_rate: mean number of cosmic ray bursts per second
+    :param cosmic_fraction: fraction of pixels hit by each burst
+    :param deadtime_us: minimum separation of photons in a pixel
+    :param npix: use a random subset of this many pixels
+    :param seed: seed for the random numbers, the same arguments and seed give the same photons
+    :param rate_kwargs: passed to pixel_rates
+    """
+    detector = Detector(beammap, rate=rate, resolving_power=resolving_power, npix=npix, seed=seed, **rate_kwargs)
+    return detector.photons(duration, calibrated=calibrated, kind=kind, lasers=lasers,
+                            wavelength_range=wavelength_range, cosmic_rate=cosmic_rate,
+                            cosmic_fraction=cosmic_fraction, deadtime_us=deadtime_us)
+
+
+def _fixed_point(degrees, bits, fraction_bits):
+    """Return degrees as two's complement fixed point radians in the low bits of an int64, saturating"""
+    value = np.round(np.deg2rad(degrees) * 2 ** fraction_bits).astype(np.int64)
+    limit = 2 ** (bits - 1)
+    return np.clip(value, -limit, limit - 1) & (2 ** bits - 1)
+
+
+def encode_bin(x, y, roach, time, phase, baseline, start, frames=None):
+    """
+    Return the words (uint64) of a .bin file holding the photons, in packets ordered by frame then roach
+
+    :param x: x coordinate of each photon
+    :param y: y coordinate of each photon
+    :param roach: readout board of each photon
+    :param time: arrival time of each photon in us since start
+    :param phase: phase of each photon (degrees)
+    :param baseline: baseline of each photon (degrees)
+    :param start: integer unix time of time 0
+    :param frames: optional dict of roach: frame counter of its next packet. It is updated, so passing the same dict
+        for consecutive files continues the counters from one file to the next
+    """
+    year_start = calendar.timegm((datetime.utcfromtimestamp(start).year, 1, 1, 0, 0, 0))
+    tick = time.astype(np.int64) // FRAME_US
+    order = np.lexsort((time, roach, tick))
+    x, y, roach, time, tick = x[order], y[order], roach[order], time[order], tick[order]
+    phase, baseline = phase[order], baseline[order]
+
+    # A packet is a run of at most PHOTONS_PER_PACKET photons of one roach in one frame
+    n = time.size
+    index = np.arange(n)
+    new_group = np.ones(n, dtype=bool)
+    new_group[1:] = (tick[1:] != tick[:-1]) | (roach[1:] != roach[:-1])
+    group_start = np.maximum.accumulate(np.where(new_group, index, 0)) if n else index
+    new_packet = new_group | ((index - group_start) % PHOTONS_PER_PACKET == 0)
+    packet = np.cumsum(new_packet) - 1
+    first = np.flatnonzero(new_packet)
+
+    # Frame counters number the packets of each roach
+    proach = roach[first]
+    frame = np.zeros(first.size, dtype=np.int64)
+    frames = {} if frames is None else frames
+    for r in np.unique(proach):
+        mine = proach == r
+        offset = frames.get(int(r), 0)
+        frame[mine] = offset + np.arange(mine.sum())
+        frames[int(r)] = int(offset + mine.sum()) % 4096
+    frame %= 4096
+
+    header_time = (int(start - year_start) * (1000000 // FRAME_US) + tick[first]).astype(np.uint64)
+    words = np.empty(n + first.size, dtype=np.uint64)
+    words[first + np.arange(first.size)] = ((np.uint64(0xff) << np.uint64(56)) |
+                                            (proach.astype(np.uint64) << np.uint64(48)) |
+                                            (frame.astype(np.uint64) << np.uint64(36)) | header_time)
+    words[index + packet + 1] = ((x.astype(np.uint64) << np.uint64(54)) |
+                                 (y.astype(np.uint64) << np.uint64(44)) |
+                                 ((time.astype(np.uint64) % np.uint64(FRAME_US)) << np.uint64(35)) |
+                                 (_fixed_point(phase, 18, 15).astype(np.uint64) << np.uint64(17)) |
+                                 _fixed_point(baseline, 17, 14).astype(np.uint64))
+    return words
+
+
+def write_bins(directory, start, duration, detector, kind='science', **kwargs):
+    """
+    Write an exposure as the files <unix second>.bin in directory. Files are generated one second at a time, so days of
+    data can be written in bounded memory.
+
+    :param start: integer unix time of the first file
+    :param duration: number of seconds (files) to write
+    :param detector: a Detector
+    :param kind: the kind of exposure, see photon_list
+    :param kwargs: passed to Detector.events
+    :return: the number of photons written
+    """
+    os.makedirs(directory, exist_ok=True)
+    x, y = detector.coordinates()
+    roach = detector.roaches()
+    frames = {}
+    total = 0
+    tic = _time.time()
+    for i, second in enumerate(range(int(start), int(start) + int(duration))):
+        pixel, time, energy = detector.events(1, kind=kind, **kwargs)
+        words = encode_bin(x[pixel], y[pixel], roach[pixel], time, detector.response[pixel] * energy,
+                           detector.baseline[pixel], second, frames=frames)
+        words.astype('>u8').tofile(os.path.join(directory, f'{second}.bin'))
+        total += pixel.size
+        if i % 600 == 599:
+            getLogger(__name__).info(f'Wrote {i + 1}/{int(duration)} s of bin files ({total / 1e6:.1f} Mphot) in '
+                                     f'{_time.time() - tic:.0f} s')
+    return total
+
+
+if __name__ == '__main__':
+    import pkg_resources as pkg
+    from mkidcore.objects import Beammap
+
+    parser = argparse.ArgumentParser(description='Write synthetic MKID .bin files')
+    parser.add_argument('directory', type=str, help='Directory for the bin files')
+    parser.add_argument('start', type=int, help='Unix time of the first file')
+    parser.add_argument('duration', type=int, help='Number of seconds of data to write')
+    parser.add_argument('--rate', type=float, default=200, help='Mean count rate of a pixel (photons/s)')
+    parser.add_argument('--kind', type=str, default='science', help='science or laser')
+    parser.add_argument('--beammap', type=str, default='MEC', help='A beammap file or instrument name')
+    parser.add_argument('--npix', type=int, default=None, help='Number of illuminated pixels (default all good)')
+    parser.add_argument('--seed', type=int, default=None, help='Seed of the synthetic data')
+    args = parser.parse_args()
+
+    getLogger('mkidcore', setup=True, configfile=pkg.resource_filename('mkidpipeline', './config/logging.yaml'))
+    detector = Detector(Beammap(specifier=args.beammap), rate=args.rate, npix=args.npix, seed=args.seed)
+    n = write_bins(args.directory, args.start, args.duration, detector, kind=args.kind)
+    print(f'Wrote {n} photons in {args.duration} bin files to {args.directory}')
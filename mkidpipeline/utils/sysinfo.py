@@ -0,0 +1,55 @@
+"""
+Queries about the processes and cgroup limits of the machine shared by the pipeline's RAM broker, core budget and
+shared photon stores
+
+Functions
+
+    pid_alive       : Whether a process exists
+    cgroup_dirs     : Directories that may hold a controller's files for this process's cgroup
+    cgroup_file     : Path of the first of some controller files that exists for this process's cgroup
+"""
+import functools
+import os
+
+
+def pid_alive(pid):
+    """Return False if no process has pid, processes of other users count as alive"""
+    try:
+        os.kill(pid, 0)
+    except ProcessLookupError:
+        return False
+    except PermissionError:
+        pass
+    return True
+
+
+@functools.lru_cache()
+def cgroup_dirs(controller):
+    """
+    Return the directories that may hold the files of controller (e.g. 'memory' or 'cpu') for the cgroup of this
+    process, those of its own cgroup (v2 or v1) first then those of the root
+    """
+    dirs = []
+    try:
+        with open('/proc/self/cgroup') as f:
+            for line in f:
+                _, controllers, path = line.rstrip('\n').split(':', 2)
+                if not controllers:
+                    dirs.append('/sys/fs/cgroup' + path)  # cgroup v2
+                elif controller in controllers.split(','):
+                    # v1 hierarchies are mounted under their controller list, e.g. cpu,cpuacct, and usually linked
+                    dirs += ['/sys/fs/cgroup/' + controllers + path, f'/sys/fs/cgroup/{controller}' + path]
+    except (OSError, ValueError):
+        pass
+    dirs += ['/sys/fs/cgroup', f'/sys/fs/cgroup/{controller}']
+    return tuple(dict.fromkeys(os.path.normpath(d) for d in dirs))
+
+
+@functools.lru_cache()
+def cgroup_file(controller, name, *alternates):
+    """Return the path of the first of the files that exists for this process's cgroup of controller, or None"""
+    for d in cgroup_dirs(controller):
+        for n in (name,) + alternates:
+            if os.path.isfile(os.path.join(d, n)):
+                return os.path.join(d, n)
+    return None
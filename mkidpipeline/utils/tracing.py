@@ -0,0 +1,259 @@
+"""
+Lightweight timing and throughput instrumentation
+
+A span times a block of work and collects counters (photons, bytes_read, bytes_written, ...) from the code it runs.
+When a span ends, its counters are added to those of the span that encloses it in the same thread, so a step's span
+totals the photons read by all of its queries. Spans marked as tasks also sample the peak RSS of the process while they
+run.
+
+Nothing is recorded until a trace file is configured, either by calling configure or by setting MKIDPIPE_TRACE (which
+is how pool workers inherit it). Each finished span becomes one JSON line of the trace. Lines are buffered in the
+process and appended to the file, so that the processes of a run can share it, when a task span ends, when
+FLUSH_SPANS have accumulated, at exit or on flush. summarize, report and write_prometheus aggregate a trace by span
+name.
+
+Functions
+
+    configure           : Set the trace file
+    flush               : Append the buffered spans of this process to the trace
+    span                : Context manager that times a block of work
+    traced              : Decorator that wraps a function in a span
+    count               : Add to a counter of the innermost open span
+    summarize           : Aggregate a trace by span name
+    report              : Text table of a trace summary, with Mphot/s
+    write_prometheus    : Write a trace summary in the Prometheus text format
+"""
+import os
+import json
+import atexit
+import time
+import functools
+import threading
+from collections import defaultdict
+from contextlib import contextmanager
+
+# Finished spans a process holds before appending them to the trace
+FLUSH_SPANS = 1000
+
+_trace_file = os.environ.get('MKIDPIPE_TRACE') or None
+_write_lock = threading.Lock()
+_local = threading.local()
+_buffer = []
+_buffer_pid = os.getpid()  # A forked process starts with the buffer of its parent, which isn't its to write
+
+
+def configure(trace_file):
+    """Record spans to trace_file (appending), or stop recording if None. Processes started later inherit this."""
+    global _trace_file
+    flush()
+    _trace_file = trace_file
+    if trace_file:
+        os.environ['MKIDPIPE_TRACE'] = trace_file
+    else:
+        os.environ.pop('MKIDPIPE_TRACE', None)
+
+
+def enabled():
+    return _trace_file is not None
+
+
+class Span:
+    def __init__(self, name, task=False, **attrs):
+        self.name = name
+        self.task = task
+        self.attrs = attrs
+        self.counts = defaultdict(float)
+
+    def count(self, name, value=1):
+        self.counts[name] += value
+
+    def set(self, **attrs):
+        self.attrs.update(attrs)
+
+
+class _NullSpan(Span):
+    def count(self, name, value=1):
+        pass
+
+    def set(self, **attrs):
+        pass
+
+
+_NULL_SPAN = _NullSpan('')
+
+
+def _stack():
+    try:
+        return _local.stack
+    except AttributeError:
+        _local.stack = []
+        return _local.stack
+
+
+def _write(record):
+    global _buffer_pid
+    line = json.dumps(record, default=str) + '\n'
+    with _write_lock:
+        if _buffer_pid != os.getpid():
+            _buffer.clear()
+            _buffer_pid = os.getpid()
+        _buffer.append(line)
+        full = len(_buffer) >= FLUSH_SPANS
+    if full or record['task']:
+        flush()
+
+
+def flush():
+    """Append the spans this process has finished to the trace file"""
+    with _write_lock:
+        if _buffer_pid != os.getpid() or not _buffer:
+            return
+        lines = ''.join(_buffer)
+        _buffer.clear()
+        try:
+            with open(_trace_file, 'a') as f:
+                f.write(lines)
+        except (OSError, TypeError):
+            pass
+
+
+@contextmanager
+def span(name, task=False, **attrs):
+    """
+    Time the enclosed block, yielding a Span whose count method adds to its counters
+
+    :param name: name the span is aggregated under, e.g. 'wavecal.apply'
+    :param task: also record the peak RSS of the process during the span
+    :param attrs: JSON serializable values recorded with the span
+    """
+    if _trace_file is None:
+        yield _NULL_SPAN
+        return
+    s = Span(name, task=task, **attrs)
+    stack = _stack()
+    parent = stack[-1] if stack else None
+    sampler = None
+    if task:
+        from mkidpipeline.utils.memory import PeakSampler
+        sampler = PeakSampler()
+    stack.append(s)
+    start, tic = time.time(), time.perf_counter()
+    error = False
+    try:
+        yield s
+    except BaseException:
+        error = True
+        raise
+    finally:
+        wall = time.perf_counter() - tic
+        stack.pop()
+        if sampler is not None:
+            sampler.stop()
+        if parent is not None:
+            for k, v in s.counts.items():
+                parent.counts[k] += v
+        _write(dict(name=name, task=task, start=start, wall=wall, pid=os.getpid(), depth=len(stack),
+                    counts=dict(s.counts), peak_rss=sampler.peak if sampler else None, error=error, attrs=s.attrs))
+
+
+def traced(name, task=False, counts=None):
+    """
+    Decorator that runs the function in a span
+
+    :param counts: optional function of the return value giving a dict of counts to add to the span
+    """
+    def decorator(func):
+        @functools.wraps(func)
+        def wrapper(*args, **kwargs):
+            if _trace_file is None:
+                return func(*args, **kwargs)
+            with span(name, task=task) as s:
+                result = func(*args, **kwargs)
+                if counts is not None:
+                    for k, v in counts(result).items():
+                        s.count(k, v)
+                return result
+        return wrapper
+    return decorator
+
+
+def count(name, value=1):
+    """Add value to counter name of the innermost open span of this thread"""
+    if _trace_file is None:
+        return
+    stack = _stack()
+    if stack:
+        stack[-1].counts[name] += value
+
+
+def summarize(trace_file):
+    """
+    Return a dict of span name: totals over the spans of that name in trace_file. Totals are n, wall (s), errors,
+    peak_rss (max, bytes, tasks only), task and the summed counters.
+    """
+    flush()
+    summary = {}
+    with open(trace_file) as f:
+        for line in f:
+            try:
+                r = json.loads(line)
+            except ValueError:
+                continue
+            s = summary.setdefault(r['name'], dict(n=0, wall=0.0, errors=0, peak_rss=None, task=False,
+                                                   counts=defaultdict(float)))
+            s['n'] += 1
+            s['wall'] += r['wall']
+            s['errors'] += bool(r.get('error'))
+            s['task'] |= bool(r.get('task'))
+            if r.get('peak_rss') is not None:
+                s['peak_rss'] = max(s['peak_rss'] or 0, r['peak_rss'])
+            for k, v in r.get('counts', {}).items():
+                s['counts'][k] += v
+    return summary
+
+
+def report(trace_file):
+    """Return a text table of the spans in trace_file, tasks first, by total wall time"""
+    summary = summarize(trace_file)
+    rows = sorted(summary.items(), key=lambda x: (not x[1]['task'], -x[1]['wall']))
+    lines = [f"{'span':<28}{'n':>7}{'wall (s)':>11}{'Mphot':>10}{'Mphot/s':>9}{'read (GB)':>11}{'written (GB)':>14}"
+             f"{'peak RSS (GB)':>15}"]
+    for name, s in rows:
+        photons = s['counts'].get('photons', 0)
+        rate = f"{photons / s['wall'] / 1e6:.2f}" if photons and s['wall'] else '-'
+        peak = f"{s['peak_rss'] / 1024 ** 3:.2f}" if s['peak_rss'] is not None else '-'
+        lines.append(f"{name + ('*' if s['task'] else ''):<28}{s['n']:>7}{s['wall']:>11.1f}{photons / 1e6:>10.2f}"
+                     f"{rate:>9}{s['counts'].get('bytes_read', 0) / 1024 ** 3:>11.2f}"
+                     f"{s['counts'].get('bytes_written', 0) / 1024 ** 3:>14.2f}{peak:>15}"
+                     + (f"  ({s['errors']} failed)" if s['errors'] else ''))
+    lines.append('* tasks. Wall times of spans nested in others, and of spans in parallel processes, overlap.')
+    return '\n'.join(lines)
+
+
+def _label(value):
+    return str(value).replace('\\', '\\\\').replace('"', '\\"').replace('\n', '\\n')
+
+
+def write_prometheus(trace_file, metrics_file, prefix='mkidpipe'):
+    """Write the summary of trace_file to metrics_file in the Prometheus text exposition format"""
+    summary = summarize(trace_file)
+    metrics = [('span_seconds_total', 'counter', 'Wall time spent in spans', lambda s: s['wall']),
+               ('span_count_total', 'counter', 'Number of spans completed', lambda s: s['n']),
+               ('span_errors_total', 'counter', 'Number of spans ended by an exception', lambda s: s['errors']),
+               ('span_peak_rss_bytes', 'gauge', 'Peak process RSS during task spans', lambda s: s['peak_rss'])]
+    counters = sorted({k for s in summary.values() for k in s['counts']})
+    for k in counters:
+        metrics.append((f'{k}_total', 'counter', f'Sum of the {k} counter of spans',
+                        lambda s, k=k: s['counts'].get(k)))
+    lines = []
+    for metric, kind, doc, get in metrics:
+        lines += [f'# HELP {prefix}_{metric} {doc}', f'# TYPE {prefix}_{metric} {kind}']
+        for name, s in sorted(summary.items()):
+            value = get(s)
+            if value is not None:
+                lines.append(f'{prefix}_{metric}{{span="{_label(name)}"}} {value:g}')
+    with open(metrics_file, 'w') as f:
+        f.write('\n'.join(lines) + '\n')
+
+
+atexit.register(flush)
@@ -0,0 +1,241 @@
+"""
+Data driven tuning of the HDF5 layout and chunk cache of photontables
+
+How fast a photontable answers queries depends on its chunkshape (rows per HDF5 chunk), its compression (blosc codec,
+level and shuffle), and the size of the HDF5 chunk cache used to read it. The best choice differs between instruments
+(count rates, array size) and storage backends (local NVMe, NFS, Lustre), so autotune measures it. It copies a sample
+h5 with each candidate layout, next to the sample so that the copies are on the same storage, and times a query mix on
+each copy. Then it times chunk cache settings on the fastest layout. The page cache is dropped for the file before
+each timed query, so reads hit the storage as they would for a file that has not been read recently.
+
+The winning profile is saved in the pipeline config (save_profile, or mkidpipe --autotune): the layout in the buildhdf
+section, where it is used for every h5 built, and the cache in the photontable section, which Photontable applies
+whenever it opens a file (see open_kwargs).
+
+Functions
+
+    open_kwargs     : PyTables parameters to open a photontable with
+    override        : Context manager that replaces the configured cache parameters
+    copy_layout     : Copy a photontable h5 with a different chunkshape and compression
+    time_queries    : Time a query mix on an h5
+    autotune        : Find the layout and cache settings that run a query mix fastest
+    save_profile    : Store a tuned profile in a pipeline config file
+"""
+import os
+import time
+from contextlib import contextmanager, nullcontext
+from datetime import datetime
+
+import numpy as np
+import tables
+
+from mkidcore.corelog import getLogger
+
+# Keys of the layout (buildhdf section) and of the cache (photontable section) of a profile
+LAYOUT_KEYS = ('chunkshape', 'complib', 'complevel', 'shuffle', 'bitshuffle')
+CACHE_KEYS = ('chunk_cache_size', 'chunk_cache_nelmts')
+
+CHUNKSHAPES = (250, 1024, 4096, 16384, 65536)
+CODECS = (dict(complib='blosc:lz4', complevel=1, shuffle=True, bitshuffle=False),
+          dict(complib='blosc:lz4', complevel=5, shuffle=True, bitshuffle=False),
+          dict(complib='blosc:lz4', complevel=1, shuffle=False, bitshuffle=True),
+          dict(complib='blosc:zstd', complevel=1, shuffle=True, bitshuffle=False),
+          dict(complib='blosc:zstd', complevel=5, shuffle=False, bitshuffle=True),
+          dict(complib='blosc:blosclz', complevel=1, shuffle=True, bitshuffle=False),
+          dict(complib='blosc:lz4', complevel=0, shuffle=False, bitshuffle=False))
+# None leaves the PyTables default, nelmts should be prime
+CACHES = (dict(chunk_cache_size=None, chunk_cache_nelmts=None),
+          dict(chunk_cache_size=64 * 1024 ** 2, chunk_cache_nelmts=4099),
+          dict(chunk_cache_size=256 * 1024 ** 2, chunk_cache_nelmts=16411),
+          dict(chunk_cache_size=1024 ** 3, chunk_cache_nelmts=65537))
+
+_override = None
+
+
+def open_kwargs():
+    """
+    Return the PyTables parameters (e.g. CHUNK_CACHE_SIZE) to pass to tables.open_file for a photontable, from the
+    photontable section of the pipeline config unless overridden
+    """
+    settings = _override
+    if settings is None:
+        import mkidpipeline.config
+        cfg = mkidpipeline.config.config
+        settings = {}
+        if cfg is not None:
+            for k in CACHE_KEYS:
+                try:
+                    settings[k] = cfg.get(f'photontable.{k}')
+                except (KeyError, AttributeError):
+                    pass
+    return {k.upper(): int(v) for k, v in settings.items() if v is not None}
+
+
+@contextmanager
+def override(cache):
+    """Open photontables with the cache settings in the dict cache instead of the configured ones"""
+    global _override
+    previous, _override = _override, dict(cache)
+    try:
+        yield
+    finally:
+        _override = previous
+
+
+def copy_layout(source, dest, chunkshape=None, complib='blosc:lz4', complevel=1, shuffle=True, bitshuffle=False,
+                max_rows=None):
+    """
+    Copy the photontable h5 source to dest with the photon table rewritten in another layout, its indices are rebuilt
+
+    :param chunkshape: rows per chunk, None lets PyTables choose
+    :param max_rows: copy only the first max_rows photons
+    """
+    filters = tables.Filters(complevel=complevel, complib=complib, shuffle=shuffle, bitshuffle=bitshuffle,
+                             fletcher32=False)
+    with tables.open_file(source, 'r') as src, tables.open_file(dest, 'w', title=src.title) as dst:
+        src.root._v_attrs._f_copy(dst.root)
+        for node in src.root:
+            if node._v_name != 'photons':
+                node._f_copy(dst.root, recursive=True)
+        photons = src.root.photons._f_copy(dst.root, recursive=False)
+        for node in src.root.photons:
+            if node._v_name != 'photontable':
+                node._f_copy(photons, recursive=True)
+        src.root.photons.photontable.copy(photons, 'photontable', filters=filters, chunkshape=chunkshape,
+                                          stop=max_rows, propindexes=True)
+
+
+def _evict(file):
+    """Drop file from the page cache so the next read comes from storage"""
+    if not hasattr(os, 'posix_fadvise'):
+        return
+    fd = os.open(file, os.O_RDONLY)
+    try:
+        os.fsync(fd)
+        os.posix_fadvise(fd, 0, 0, os.POSIX_FADV_DONTNEED)
+    finally:
+        os.close(fd)
+
+
+def _time_slice(pt, rng):
+    duration = pt.duration
+    return pt.query(start=rng.uniform(0, .9 * duration), intt=min(.1 * duration, 10)).size
+
+
+def _wavelength(pt, rng):
+    bins = pt.nominal_wavelength_bins
+    lo = rng.uniform(bins[0], bins[-1])
+    return pt.query(startw=lo, stopw=lo + (bins[-1] - bins[0]) / 10).size
+
+
+def _pixels(pt, rng):
+    resids = rng.choice(pt.beamImage.ravel(), 20, replace=False)
+    return sum(pt.query(resid=r).size for r in resids)
+
+
+def _everything(pt, rng):
+    return pt.query().size
+
+
+# (name, weight, function(Photontable, np.random.Generator) -> photons read) modelled on the pipeline's use: time
+# slices (pixcal, time cubes), wavelength cuts (get_fits), single pixels (wavecal, lincal) and whole files (flatcal,
+# cosmiccal, images)
+DEFAULT_MIX = (('time_slice', 1, _time_slice),
+               ('wavelength', 1, _wavelength),
+               ('pixels', 1, _pixels),
+               ('everything', 1, _everything))
+
+
+def time_queries(file, mix=DEFAULT_MIX, cache=None, repeat=3, cold=True, seed=0):
+    """
+    Time the queries of mix on file, the same queries are made for the same seed
+
+    :param cache: dict of cache settings to open the file with, None for those in the pipeline config
+    :param cold: drop the file from the page cache before each query
+    :return: dict of query name: median time (s), and 'score', the weighted sum of the medians
+    """
+    from mkidpipeline.photontable import Photontable
+    result = {'score': 0.}
+    with override(cache) if cache is not None else nullcontext():
+        for name, weight, run in mix:
+            walls = []
+            for i in range(repeat):
+                rng = np.random.default_rng((seed, i))
+                pt = Photontable(file)
+                if cold:
+                    _evict(file)
+                tic = time.perf_counter()
+                run(pt, rng)
+                walls.append(time.perf_counter() - tic)
+                del pt
+            result[name] = float(np.median(walls))
+            result['score'] += weight * result[name]
+    return result
+
+
+def autotune(sample, workdir=None, mix=DEFAULT_MIX, chunkshapes=CHUNKSHAPES, codecs=CODECS, caches=CACHES, repeat=3,
+             cold=True, max_rows=None):
+    """
+    Find the photontable layout and chunk cache settings that run the query mix fastest on a sample h5. The chunkshape
+    is chosen with the first codec, then the codec with that chunkshape, then the cache with that layout.
+
+    :param sample: a built photontable h5, representative of the data to tune for
+    :param workdir: directory for the candidate copies, defaults to that of the sample so they are on the same storage
+    :param max_rows: use only the first max_rows photons of the sample
+    :return: (profile, trials) where profile is a dict of the LAYOUT_KEYS and CACHE_KEYS settings and trials lists the
+        settings, file size and timings of each candidate
+    """
+    workdir = workdir or os.path.dirname(os.path.abspath(sample))
+    log = getLogger(__name__)
+    trials = []
+    copies = {}  # layout: (file, trial)
+
+    def try_layout(layout):
+        key = tuple(sorted(layout.items()))
+        if key not in copies:
+            dest = os.path.join(workdir, f'.autotune_{len(copies)}_{os.path.basename(sample)}')
+            copies[key] = dest, None
+            copy_layout(sample, dest, max_rows=max_rows, **layout)
+            times = time_queries(dest, mix=mix, cache=caches[0], repeat=repeat, cold=cold)
+            trials.append(dict(layout, **caches[0], size=os.path.getsize(dest), **times))
+            copies[key] = dest, trials[-1]
+            log.info(f'{layout}: score {times["score"]:.3f} s, {os.path.getsize(dest) / 1024 ** 2:.0f} MiB')
+        return copies[key][1]
+
+    try:
+        best = min((try_layout(dict(codecs[0], chunkshape=c)) for c in chunkshapes), key=lambda t: t['score'])
+        chunkshape = best['chunkshape']
+        best = min((try_layout(dict(c, chunkshape=chunkshape)) for c in codecs), key=lambda t: t['score'])
+        layout = {k: best[k] for k in LAYOUT_KEYS}
+        file = copies[tuple(sorted(layout.items()))][0]
+        best_cache, best_score = caches[0], best['score']
+        for cache in caches[1:]:
+            times = time_queries(file, mix=mix, cache=cache, repeat=repeat, cold=cold)
+            trials.append(dict(layout, **cache, size=os.path.getsize(file), **times))
+            log.info(f'{cache}: score {times["score"]:.3f} s')
+            if times['score'] < best_score:
+                best_cache, best_score = cache, times['score']
+    finally:
+        for f, _ in copies.values():
+            try:
+                os.remove(f)
+            except FileNotFoundError:
+                pass
+
+    profile = dict(layout, **best_cache)
+    log.info(f'Best profile {profile}, score {best_score:.3f} s')
+    return profile, trials
+
+
+def save_profile(pipe_cfg, profile, sample=''):
+    """Store the profile returned by autotune in the pipeline config file pipe_cfg"""
+    import mkidcore.config
+    cfg = mkidcore.config.load(pipe_cfg, namespace=None)
+    note = f'autotuned {datetime.now().strftime("%Y-%m-%d")} on {sample}'
+    for k in LAYOUT_KEYS:
+        cfg.register(f'buildhdf.{k}', profile[k], comment=note, update=True)
+    for k in CACHE_KEYS:
+        cfg.register(f'photontable.{k}', profile[k], comment=note, update=True)
+    with open(pipe_cfg, 'w') as f:
+        mkidcore.config.yaml.dump(cfg, f)
+    return cfg